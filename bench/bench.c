@@ -0,0 +1,465 @@
+/*
+ * Headless benchmark driver for kilo.
+ *
+ * kilo.c includes this in place of its main() when built with KILO_BENCH,
+ * so that the driver reaches all of the editor and a profile taken of it
+ * fits the editor built alone.  The terminal is replaced by /dev/null: each
+ * corpus is opened and every keystroke trace replayed through
+ * editor_process_keypress(), one key per frame as if it were typed.  Every
+ * run forks so that it starts from a fresh editor and has a peak RSS of its
+ * own, and reports the time to load and draw the file, the frames per second
+ * of the replay, the latency and output of those frames as the editor's own
+ * stats measure them, and the peak RSS.
+ *
+ * The corpora are a large C file, a log and a file of long minified lines,
+ * made up in a temporary directory, plus the files named on the command
+ * line.  A run edits a copy, never the original.  Besides the built-in
+ * traces, -t replays the raw input recorded by running kilo with
+ * KILO_TRACE=<file>, less the CTRL-Q that ended the session.  Built with
+ * KILO_AUDIT as well, a run also reports the calls into malloc(3) made by
+ * the frames after the first BENCH_WARMUP percent of them.
+ *
+ * usage: kilo-bench [-m MB] [-s ROWSxCOLS] [-t trace]... [file ...]
+ */
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define BENCH_CORPUS_MB 8
+#define BENCH_ROWS 24
+#define BENCH_COLS 80
+#define BENCH_MAX_TRACES 16
+#define BENCH_WARMUP 10 /* percent of the frames of a run */
+
+struct bench_trace {
+  const char *name;
+  char *keys;
+  size_t len;
+};
+
+/* Sized up front for a frame per byte of the trace. */
+struct bench_frames {
+  int64_t *latency; /* ns */
+  int64_t *bytes;
+#ifdef KILO_AUDIT
+  int64_t *mallocs;
+#endif
+  size_t num;
+};
+
+static int64_t bench_now(void);
+static void bench_corpus_c(FILE *fp, size_t size);
+static void bench_corpus_log(FILE *fp, size_t size);
+static void bench_corpus_min(FILE *fp, size_t size);
+static char *bench_corpus(const char *dir, const char *name,
+                          void (*generate)(FILE *, size_t), size_t size);
+static void bench_copy(const char *from, const char *to);
+static void bench_trace_builtin(struct bench_trace *traces, int *num);
+static void bench_trace_load(struct bench_trace *trace, const char *file);
+static void bench_frames_init(struct bench_frames *frames, size_t capacity);
+static void bench_frames_collect(struct bench_frames *frames, long *seen);
+static int64_t bench_percentile(int64_t *values, size_t num, int p);
+#ifdef KILO_AUDIT
+static void bench_audit(const char *label, const struct bench_trace *trace,
+                        const struct bench_frames *frames);
+#endif
+static void bench_run(const char *file, const char *label,
+                      const struct bench_trace *trace, int rows, int cols);
+static void usage(void);
+
+static int64_t bench_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/* Functions with comments, strings and nested blocks. */
+static void bench_corpus_c(FILE *fp, size_t size) {
+  for (int i = 0; ftell(fp) < (long)size; i++)
+    fprintf(fp,
+            "/*\n"
+            " * Sum the values of the items named \"item %d\" in `t`.\n"
+            " */\n"
+            "static int\n"
+            "func_%d(struct thing *t, const char *name)\n"
+            "{\n"
+            "\tint total = 0;\n"
+            "\n"
+            "\tfor (int i = 0; i < t->count; i++) {\n"
+            "\t\tif (strcmp(t->items[i].name, \"item %d\") == 0)\n"
+            "\t\t\ttotal += t->items[i].value * %d; // scaled\n"
+            "\t}\n"
+            "\treturn (total + '\\n');\n"
+            "}\n"
+            "\n",
+            i, i, i, i % 97);
+}
+
+/* Short, similar lines as an access log has them. */
+static void bench_corpus_log(FILE *fp, size_t size) {
+  for (int i = 0; ftell(fp) < (long)size; i++)
+    fprintf(fp,
+            "2024-03-%02d %02d:%02d:%02d.%03d INFO [worker-%d] "
+            "GET /api/v1/items/%d?page=%d 200 %dms\n",
+            1 + i / 86400 % 28, i / 3600 % 24, i / 60 % 60, i % 60,
+            i * 7 % 1000, i % 16, i * 31 % 100000, i % 10, i * 13 % 900);
+}
+
+/* Minified JSON, a megabyte to the line. */
+static void bench_corpus_min(FILE *fp, size_t size) {
+  long line = 0;
+
+  fputc('[', fp);
+  for (int i = 0; ftell(fp) < (long)size; i++) {
+    if (ftell(fp) - line >= 1024 * 1024) {
+      fputs("\n[", fp);
+      line = ftell(fp);
+    } else if (i > 0)
+      fputc(',', fp);
+    fprintf(fp,
+            "{\"id\":%d,\"name\":\"item %d\",\"tags\":[\"a\",\"b%d\"],"
+            "\"value\":%d.%02d}",
+            i, i, i % 10, i % 1000, i % 100);
+  }
+  fputs("]\n", fp);
+}
+
+/* Generate a corpus of about `size` bytes as dir/name. */
+static char *bench_corpus(const char *dir, const char *name,
+                          void (*generate)(FILE *, size_t), size_t size) {
+  char *path;
+  FILE *fp;
+
+  if (asprintf(&path, "%s/%s", dir, name) == -1)
+    err(EXIT_FAILURE, "asprintf");
+
+  if ((fp = fopen(path, "w")) == NULL)
+    err(EXIT_FAILURE, "%s", path);
+  generate(fp, size);
+  if (fclose(fp) == EOF)
+    err(EXIT_FAILURE, "%s", path);
+
+  return (path);
+}
+
+static void bench_copy(const char *from, const char *to) {
+  char buf[65536];
+  ssize_t n;
+  int in, out;
+
+  if ((in = open(from, O_RDONLY)) == -1)
+    err(EXIT_FAILURE, "%s", from);
+  if ((out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+    err(EXIT_FAILURE, "%s", to);
+
+  while ((n = read(in, buf, sizeof(buf))) > 0) {
+    if (write(out, buf, n) != n)
+      err(EXIT_FAILURE, "%s", to);
+  }
+  if (n == -1)
+    err(EXIT_FAILURE, "%s", from);
+
+  close(in);
+  close(out);
+}
+
+/*
+ * Scroll line by line, page down and back up, jump into the file and type
+ * over a few lines, and page through it soft wrapped.
+ */
+static void bench_trace_builtin(struct bench_trace *traces, int *num) {
+  static const char *names[] = {"scroll", "page", "type", "wrap"};
+  struct sbuf *sb;
+
+  for (size_t t = 0; t < nitems(names); t++) {
+    if ((sb = sbuf_new_auto()) == NULL)
+      err(EXIT_FAILURE, "sbuf_new_auto");
+
+    switch (t) {
+    case 0:
+      for (int i = 0; i < 2000; i++)
+        sbuf_cat(sb, "\x1b[B");
+      break;
+    case 1:
+      for (int i = 0; i < 200; i++)
+        sbuf_cat(sb, "\x1b[6~");
+      for (int i = 0; i < 100; i++)
+        sbuf_cat(sb, "\x1b[5~");
+      break;
+    case 2:
+      sbuf_printf(sb, "%c1000\r", CTRL('g'));
+      for (int i = 0; i < 40; i++)
+        sbuf_cat(sb, "\ttotal += value * 2; /* typed */\r");
+      for (int i = 0; i < 400; i++)
+        sbuf_putc(sb, BACKSPACE);
+      break;
+    case 3:
+      sbuf_putc(sb, CTRL('e'));
+      for (int i = 0; i < 100; i++)
+        sbuf_cat(sb, "\x1b[6~");
+      for (int i = 0; i < 500; i++)
+        sbuf_cat(sb, "\x1b[B");
+      sbuf_putc(sb, CTRL('e'));
+      break;
+    }
+    if (sbuf_finish(sb) != 0)
+      err(EXIT_FAILURE, "sbuf_finish");
+
+    traces[*num].name = names[t];
+    traces[*num].len = sbuf_len(sb);
+    if ((traces[*num].keys = malloc(traces[*num].len)) == NULL)
+      err(EXIT_FAILURE, "malloc");
+    memcpy(traces[*num].keys, sbuf_data(sb), traces[*num].len);
+    (*num)++;
+    sbuf_delete(sb);
+  }
+}
+
+/* A trace recorded with KILO_TRACE, without the keys that quit kilo. */
+static void bench_trace_load(struct bench_trace *trace, const char *file) {
+  struct stat st;
+  int fd;
+
+  if ((fd = open(file, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+    err(EXIT_FAILURE, "%s", file);
+
+  trace->name = strrchr(file, '/') != NULL ? strrchr(file, '/') + 1 : file;
+  if ((trace->keys = malloc(st.st_size + 1)) == NULL)
+    err(EXIT_FAILURE, "malloc");
+  if (read(fd, trace->keys, st.st_size) != st.st_size)
+    err(EXIT_FAILURE, "%s", file);
+  close(fd);
+
+  trace->len = st.st_size;
+  while (trace->len > 0 && trace->keys[trace->len - 1] == CTRL('q'))
+    trace->len--;
+}
+
+static void bench_frames_init(struct bench_frames *frames, size_t capacity) {
+  frames->latency = malloc(capacity * sizeof(*frames->latency));
+  frames->bytes = malloc(capacity * sizeof(*frames->bytes));
+  if (frames->latency == NULL || frames->bytes == NULL)
+    err(EXIT_FAILURE, "malloc");
+#ifdef KILO_AUDIT
+  if ((frames->mallocs = malloc(capacity * sizeof(*frames->mallocs))) == NULL)
+    err(EXIT_FAILURE, "malloc");
+#endif
+  frames->num = 0;
+}
+
+/* Copy the frames the editor finished since frame `*seen`. */
+static void bench_frames_collect(struct bench_frames *frames, long *seen) {
+  struct editor_stats *stats = &editor.stats;
+
+  *seen = MAX(*seen, stats->frames - KILO_STATS_FRAMES);
+  for (; *seen < stats->frames; (*seen)++) {
+    const int64_t *frame = stats->history[*seen % KILO_STATS_FRAMES];
+
+#ifdef KILO_AUDIT
+    frames->mallocs[frames->num] = frame[STATS_MALLOCS];
+#endif
+    frames->latency[frames->num] = frame[STATS_FRAME];
+    frames->bytes[frames->num++] = frame[STATS_BYTES];
+  }
+}
+
+/* Nearest-rank percentile of `values`, which it sorts. */
+static int64_t bench_percentile(int64_t *values, size_t num, int p) {
+  if (num == 0)
+    return (0);
+
+  qsort(values, num, sizeof(*values), compare_int64);
+  return (values[MAX((num * p + 99) / 100, 1) - 1]);
+}
+
+#ifdef KILO_AUDIT
+/* Report the calls into malloc(3) once the run has warmed up. */
+static void bench_audit(const char *label, const struct bench_trace *trace,
+                        const struct bench_frames *frames) {
+  size_t warm = frames->num * BENCH_WARMUP / 100, hit = 0;
+  int64_t total = 0;
+
+  for (size_t i = warm; i < frames->num; i++) {
+    total += frames->mallocs[i];
+    hit += frames->mallocs[i] != 0;
+  }
+  printf("%-14.14s %-8.8s %" PRId64 " mallocs in %zu of %zu frames after %zu\n",
+         label, trace->name, total, hit, frames->num - warm, warm);
+}
+#endif
+
+/*
+ * Open `file` in a fresh editor drawing into /dev/null and replay `trace`,
+ * refreshing the screen after every key.  Runs in a child and exits.
+ */
+static void bench_run(const char *file, const char *label,
+                      const struct bench_trace *trace, int rows, int cols) {
+  struct editor_input *in = &editor.input;
+  struct bench_frames frames;
+  struct kevent events[2];
+  struct rusage ru;
+  struct stat st;
+  int64_t start, loaded, replayed;
+  long seen;
+  int fd;
+  double mb, secs;
+
+  unsetenv("KILO_STATS");
+  unsetenv("KILO_TRACE");
+  init_editor();
+
+  if ((editor.tty = open("/dev/null", O_RDWR)) == -1)
+    err(EXIT_FAILURE, "open(/dev/null)");
+  if ((editor.kq = kqueue()) == -1)
+    err(EXIT_FAILURE, "kqueue() failed");
+  EV_SET(&events[0], KILO_SEARCH_EVENT, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0,
+         NULL);
+  EV_SET(&events[1], KILO_SAVE_EVENT, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0,
+         NULL);
+  if (kevent(editor.kq, events, nitems(events), NULL, 0, NULL) == -1)
+    err(EXIT_FAILURE, "kevent register");
+
+  screen_resize(rows, cols);
+  editor_layout(editor.root, 0, 0, rows - 1, cols);
+  editor.stats.enabled = true;
+
+  /*
+   * All of the trace is pending at once, so an escape sequence is never
+   * waited for, and an ESC after it cancels a prompt it leaves open.
+   */
+  if ((in->buf = malloc(trace->len + 1)) == NULL)
+    err(EXIT_FAILURE, "malloc");
+  memcpy(in->buf, trace->keys, trace->len);
+  in->buf[trace->len] = ESC_CHAR;
+  in->len = in->cap = trace->len + 1;
+  in->pos = 0;
+  in->flush = true;
+  bench_frames_init(&frames, trace->len);
+
+  if (stat(file, &st) == -1)
+    err(EXIT_FAILURE, "%s", file);
+  start = bench_now();
+  if ((fd = editor_open_file(file)) == -1 || !editor_open(file, fd))
+    err(EXIT_FAILURE, "%s", file);
+  editor_window_show(editor.win, editor.buf);
+  editor_refresh_screen();
+  loaded = bench_now();
+  seen = editor.stats.frames;
+
+  while (in->pos < trace->len) {
+    editor_process_keypress();
+    editor_refresh_screen();
+    bench_frames_collect(&frames, &seen);
+  }
+  replayed = bench_now();
+
+  if (getrusage(RUSAGE_SELF, &ru) == -1)
+    err(EXIT_FAILURE, "getrusage");
+
+  mb = st.st_size / (1024.0 * 1024.0);
+  secs = (replayed - loaded) / 1e9;
+  printf("%-14.14s %-8.8s %7.1f %8.1f %8.1f %7zu %9.0f %7" PRId64 " %7" PRId64
+         " %8" PRId64 " %8" PRId64 " %7.1f\n",
+         label, trace->name, mb, (loaded - start) / 1e6,
+         mb / ((loaded - start) / 1e9), frames.num,
+         secs > 0 ? frames.num / secs : 0,
+         bench_percentile(frames.latency, frames.num, 50) / 1000,
+         bench_percentile(frames.latency, frames.num, 99) / 1000,
+         bench_percentile(frames.latency, frames.num, 100) / 1000,
+         bench_percentile(frames.bytes, frames.num, 50), ru.ru_maxrss / 1024.0);
+#ifdef KILO_AUDIT
+  bench_audit(label, trace, &frames);
+#endif
+  fflush(stdout);
+  exit(EXIT_SUCCESS);
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: kilo-bench [-m MB] [-s ROWSxCOLS] [-t trace]... "
+                  "[file ...]\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  struct bench_trace traces[BENCH_MAX_TRACES];
+  char dir[] = "/tmp/kilo-bench.XXXXXX";
+  char *corpora[3], *run;
+  size_t size = BENCH_CORPUS_MB * 1024 * 1024;
+  int rows = BENCH_ROWS, cols = BENCH_COLS;
+  int num_traces = 0, status, ch;
+  pid_t pid;
+
+  bench_trace_builtin(traces, &num_traces);
+  while ((ch = getopt(argc, argv, "m:s:t:")) != -1) {
+    switch (ch) {
+    case 'm':
+      size = strtoul(optarg, NULL, 10) * 1024 * 1024;
+      break;
+    case 's':
+      if (sscanf(optarg, "%dx%d", &rows, &cols) != 2 || rows < 2 || cols < 1)
+        usage();
+      break;
+    case 't':
+      if (num_traces == BENCH_MAX_TRACES)
+        errx(EXIT_FAILURE, "too many traces");
+      bench_trace_load(&traces[num_traces++], optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  argc -= optind;
+  argv += optind;
+
+  if (mkdtemp(dir) == NULL)
+    err(EXIT_FAILURE, "mkdtemp");
+  corpora[0] = bench_corpus(dir, "synthetic.c", bench_corpus_c, size);
+  corpora[1] = bench_corpus(dir, "synthetic.log", bench_corpus_log, size);
+  corpora[2] = bench_corpus(dir, "minified.js", bench_corpus_min, size);
+
+  printf("%-14s %-8s %7s %8s %8s %7s %9s %7s %7s %8s %8s %7s\n", "corpus",
+         "trace", "MB", "load ms", "MB/s", "frames", "frames/s", "p50 us",
+         "p99 us", "max us", "bytes", "RSS MB");
+  for (int i = 0; i < (int)nitems(corpora) + argc; i++) {
+    const char *file = i < (int)nitems(corpora) ? corpora[i]
+                                                : argv[i - nitems(corpora)];
+    const char *label = strrchr(file, '/') != NULL ? strrchr(file, '/') + 1
+                                                   : file;
+    const char *ext = strrchr(label, '.');
+
+    /* Keep the extension so that the copy is highlighted like the file. */
+    if (asprintf(&run, "%s/run%s", dir, ext != NULL ? ext : "") == -1)
+      err(EXIT_FAILURE, "asprintf");
+
+    for (int t = 0; t < num_traces; t++) {
+      char *swap;
+
+      bench_copy(file, run);
+      fflush(stdout);
+      if ((pid = fork()) == -1)
+        err(EXIT_FAILURE, "fork");
+      if (pid == 0)
+        bench_run(run, label, &traces[t], rows, cols);
+
+      if (waitpid(pid, &status, 0) == -1)
+        err(EXIT_FAILURE, "waitpid");
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        printf("%-14.14s %-8.8s failed\n", label, traces[t].name);
+
+      if (asprintf(&swap, "%s.swp", run) == -1)
+        err(EXIT_FAILURE, "asprintf");
+      unlink(swap);
+      free(swap);
+    }
+    unlink(run);
+    free(run);
+  }
+
+  for (size_t i = 0; i < nitems(corpora); i++) {
+    unlink(corpora[i]);
+    free(corpora[i]);
+  }
+  rmdir(dir);
+
+  return (EXIT_SUCCESS);
+}
@@ -23,6 +23,11 @@
 #define ALT_BUF_ON DEC_SET(1049)
 #define ALT_BUF_OFF DEC_RESET(1049)
 
+#define BRACKETED_PASTE_ON DEC_SET(2004)
+#define BRACKETED_PASTE_OFF DEC_RESET(2004)
+#define PASTE_BEGIN_SEQ CSI "200~"
+#define PASTE_END_SEQ CSI "201~"
+
 #define CURSOR_UP(x) CSI XSTR(x) "A"
 #define CURSOR_DOWN(x) CSI XSTR(x) "B"
 #define CURSOR_FORWARD(x) CSI XSTR(x) "C"
@@ -47,11 +52,17 @@
 #define ERASE_TO_BEGINNING 1
 #define ERASE_ENTIRE 2
 
+#define SET_SCROLL_REGION_FMT CSI "%d;%dr"
+#define RESET_SCROLL_REGION CSI "r"
+#define SCROLL_UP_FMT CSI "%dS"
+#define SCROLL_DOWN_FMT CSI "%dT"
+
 #define SGR(x) CSI XSTR(x) "m"
 #define SGR_FMT CSI "%dm"
 #define RESET_SGR SGR(0)
 #define BOLD SGR(1)
 #define INVERT SGR(7)
+#define NO_INVERT SGR(27)
 
 #define BLACK 0
 #define RED 1
@@ -1,38 +1,82 @@
 #include <ctype.h>
+#include <dirent.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/event.h>
+#include <sys/file.h>
 #include <sys/ioccom.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/queue.h>
 #include <sys/sbuf.h>
 #include <sys/stat.h>
 #include <sys/ttycom.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "ctrl_seq.h"
 
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
-
-struct editor_syntax {
-  char *file_type;
-  char **file_match;
-  char **keywords;
-  char *single_line_comment_start;
-  char *multi_line_comment_start, *multi_line_comment_end;
-  int flags;
-};
+#define KILO_ESC_TIMEOUT 50 /* ms */
+#define KILO_SEARCH_EVENT 1 /* EVFILT_USER ident */
+#define KILO_SEARCH_BATCH 1024
+#define KILO_SEARCH_FLUSH_ROWS 65536
+#define KILO_SAVE_EVENT 2 /* EVFILT_USER ident */
+#define KILO_SAVE_BATCH 64 /* iovecs per writev(2) */
+#define KILO_SAVE_CHUNK (1024 * 1024)
+#define KILO_UNDO_LIMIT (16 * 1024 * 1024) /* bytes */
+#define KILO_UNDO_GROUP_MS 1000
+#define KILO_SWAP_TIMER 3 /* EVFILT_TIMER ident */
+#define KILO_SWAP_INTERVAL 1000 /* ms */
+#define KILO_SWAP_BATCH (64 * 1024)
+#define KILO_SWAP_MAGIC "KILOSWP2"
+#define KILO_SWAP_TAIL 4096 /* bytes hashed to recognize a grown file */
+#define KILO_SYNTAX_MAGIC "KILOSYN1"
+#define KILO_SYNTAX_SUFFIX ".syntax"
+#define KILO_FOLLOW_CHUNK (64 * 1024)
+#define KILO_RESIZE_TIMER 4 /* EVFILT_TIMER ident */
+#define KILO_RESIZE_DELAY 30 /* ms */
+#define KILO_PAGER_EVENT 5 /* EVFILT_USER ident */
+#define KILO_PAGER_BLOCK (64 * 1024)
+#define KILO_PAGER_CACHE 64 /* MB, unless KILO_PAGER_MB says otherwise */
+#define KILO_PAGER_READAHEAD 8 /* blocks, at most one preadv(2) */
+#define KILO_PAGER_LINE_MAX (64 * 1024) /* longer lines are continued */
+#define KILO_PAGER_INDEX_MAX 65536 /* entries, must be even */
+#define KILO_PAGER_INDEX_CHUNK (256 * 1024)
+#define KILO_PAGER_INDEX_NOTIFY (64 * 1024 * 1024) /* bytes */
+#define KILO_REGEX_CACHE 8
+#define KILO_REGEX_STATES 1024
+#define KILO_HL_THREADS 16
+#define KILO_HL_CHUNK_ROWS 16384 /* fewest rows worth a thread */
+#define KILO_STATS_FRAMES 256     /* frames the percentiles are taken over */
+
+#define LEX_CONVERGED (-1)
+
+#define HASH_INIT UINT64_C(14695981039346656037) /* FNV-1a offset basis */
 
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
@@ -48,26 +92,669 @@ enum editor_highlight : char {
   HL_MATCH
 };
 
+/*
+ * Highlights are kept run-length encoded, a byte per run of up to
+ * HL_SPAN_MAX columns with the highlight in its low HL_SPAN_BITS bits.
+ */
+#define HL_SPAN_BITS 3
+#define HL_SPAN_MAX (1 << (CHAR_BIT - HL_SPAN_BITS))
+#define HL_SPAN(hl, len) ((unsigned char)(((len) - 1) << HL_SPAN_BITS | (hl)))
+#define HL_SPAN_HL(span) ((span) & ((1 << HL_SPAN_BITS) - 1))
+#define HL_SPAN_LEN(span) (((span) >> HL_SPAN_BITS) + 1)
+
+/*
+ * The keywords of a syntax as a trie.  Only bytes that occur in some keyword
+ * get a column in the transition table, and 0 stands for no edge since the
+ * root is never a child.  `kind` is HL_NORMAL for nodes that don't end a
+ * keyword.
+ */
+struct keyword_trie {
+  unsigned char byte_class[UCHAR_MAX + 1];
+  int num_classes, num_nodes;
+  const int *next;
+  const enum editor_highlight *kind;
+};
+
+/*
+ * A syntax as it is written, either built into highlight_db or read from a
+ * definition file.  Names in `file_match` that start with a dot are
+ * extensions and the others whole file names.  Keywords ending in `|` are
+ * highlighted as HL_KEYWORD2.  `quotes` are the bytes that start a string.
+ */
+struct syntax_def {
+  char *file_type;
+  char **file_match;
+  char **keywords;
+  char *single_line_comment_start;
+  char *multi_line_comment_start, *multi_line_comment_end;
+  char *quotes;
+  int flags;
+};
+
+/* A compiled syntax, whose strings and tables live in the syntax image. */
+struct editor_syntax {
+  const char *file_type;
+  const char *single_line_comment_start;
+  const char *multi_line_comment_start, *multi_line_comment_end;
+  const char *quotes;
+  int flags;
+  int slcs_len, mlcs_len, mlce_len;
+  int lookback;
+  struct keyword_trie trie;
+};
+
+/*
+ * All the syntaxes compiled into one image, which is written to the cache
+ * and mmap(2)ed as it is on later launches.  Offsets count from the start of
+ * the image, and a string at offset 0 is missing.  Files are matched through
+ * a hash table of `num_slots` slots, a power of two, keyed on the hash of
+ * the extension or file name and probed linearly; a slot with no name is
+ * free.  `key` hashes the definitions that the image was compiled from.
+ */
+struct syntax_header {
+  char magic[8];
+  uint64_t key;
+  uint32_t size, num_syntaxes, num_slots;
+  uint32_t syntaxes, slots;
+};
+
+struct syntax_record {
+  uint32_t file_type, slcs, mlcs, mlce, quotes;
+  int32_t flags, lookback, num_classes, num_nodes;
+  uint32_t next, kind;
+  unsigned char byte_class[UCHAR_MAX + 1];
+};
+
+struct syntax_slot {
+  uint32_t hash, name, syntax;
+};
+
+/*
+ * The syntax image in use, mmap(2)ed from the cache or compiled at startup.
+ * A syntax is only unpacked from its record into `syntaxes` once a file
+ * needs it, until then its `file_type` is NULL.
+ */
+struct syntax_table {
+  const char *image;
+  size_t size;
+  bool mapped;
+  struct editor_syntax *syntaxes;
+};
+
+/*
+ * A character of a row that doesn't take one render column per byte, i.e. a
+ * tab or a multibyte UTF-8 sequence, with the byte and the render column
+ * right after it.  Columns between two of them map one to one, so this is all
+ * it takes to convert between `chars` and `render` columns.
+ */
+struct editor_glyph {
+  int cursor_x, render_x;
+};
+
+/* A range of code points of wide_chars or zero_width_chars. */
+struct width_range {
+  uint32_t first, last;
+};
+
+/*
+ * `hl_in_comment` is the lexer state at the start of the row and
+ * `hl_open_comment` the state at its end.  `hl_stale` is set whenever the row
+ * has to be lexed again, either because its text or its start state changed.
+ * Only the render columns from `hl_from` on need to be lexed again then, and
+ * from `hl_to` on `hl_spans` still holds the result of the last lex, which
+ * lets the lexer stop once it gets back in step with it.
+ * `hl_spans` covers all of `render` and is NULL for rows that were only lexed
+ * for their end state.
+ * `glyphs` lists the tabs and non-ASCII characters of the rendered row, in
+ * order.
+ * The capacities are those of the arena blocks backing each buffer; a
+ * `capacity` of 0 means `chars` is borrowed from the text store's base.
+ */
 struct editor_row {
-  int i, size, render_size;
-  bool hl_open_comment;
+  int size, render_size, num_glyphs;
+  int capacity, render_capacity, hl_spans_capacity, glyphs_capacity;
+  int num_hl_spans, hl_from, hl_to;
+  bool hl_in_comment, hl_open_comment, hl_stale;
   char *chars, *render;
-  enum editor_highlight *highlight;
+  unsigned char *hl_spans;
+  struct editor_glyph *glyphs;
 };
 
-struct editor_config {
-  int tty, kq;
+/*
+ * `render` has one byte per column.  The columns of a non-ASCII character
+ * hold these, which the lexer takes for word characters, and the character
+ * itself is found through the glyph index.
+ */
+#define RENDER_GLYPH '\x80'
+#define RENDER_WIDE '\x81' /* the right half of a wide character */
+
+#define ARENA_MIN_SHIFT 4
+#define ARENA_CLASSES 13
+#define ARENA_CLASS_SIZE(class) ((size_t)1 << ((class) + ARENA_MIN_SHIFT))
+#define ARENA_CHUNK_SIZE (512 * 1024)
+#define ARENA_CHUNK_HEADER roundup(sizeof(struct arena_chunk), 16)
+#define ARENA_LARGE_HEADER roundup(sizeof(struct arena_large), 16)
+
+struct arena_block {
+  struct arena_block *next;
+};
+
+struct arena_chunk {
+  SLIST_ENTRY(arena_chunk) link;
+  size_t used;
+};
+
+struct arena_large {
+  LIST_ENTRY(arena_large) link;
+};
+
+/*
+ * Row buffers are carved out of large chunks in power-of-two size classes,
+ * so they grow geometrically and freed blocks are reused from a per-class
+ * free list.  Blocks bigger than the largest class are malloc(3)ed on their
+ * own.  Releasing the arena frees everything in one go.
+ */
+struct arena {
+  struct arena_block *free[ARENA_CLASSES];
+  SLIST_HEAD(, arena_chunk) chunks;
+  LIST_HEAD(, arena_large) large;
+};
+
+/*
+ * Rows are kept in a gap buffer: the rows before `gap` sit at the front of
+ * `rows` and the rest at the back, so inserting or deleting next to the last
+ * edit only moves the gap instead of the whole tail.  Rows loaded from a file
+ * are "borrowed" and point into `base`; they get their own copy on first edit.
+ * `base` is the mmap(2)ed file.  Saving replaces the file instead of writing
+ * over it, so the mapping stays valid as long as kilo is its only writer.  A
+ * followed file is written by others, who may truncate it under the mapping,
+ * so following it copies the borrowed rows out with text_store_own() first.
+ * The start and end lexer states of the first `hl_valid` rows are known to be
+ * correct; edits lower the mark and it is raised again lazily.
+ */
+struct text_store {
+  struct editor_row *rows;
+  int num_rows, capacity;
+  int gap;
+  char *base;
+  size_t base_len;
+  bool base_mapped;
+  int hl_valid;
+  struct arena arena;
+};
+
+/*
+ * The rows `[from, to)` lexed by one thread of the initial highlighting pass,
+ * guessing that the first of them starts outside of a comment.  The end
+ * state of each row goes to `open`, which is shared by all the chunks.
+ */
+struct editor_hl_chunk {
+  pthread_t thread;
+  int from, to;
+  bool *open;
+};
+
+/*
+ * The screen is composed into `chars`/`attrs` every frame and diffed against
+ * `last_chars`/`last_attrs`, the cells that were last sent to the terminal.
+ * A cell holds a code point, or 0 right of a wide character.
+ * An attribute is an editor_highlight value, optionally with ATTR_INVERT.
+ */
+struct editor_screen {
+  int rows, cols;
+  uint32_t *chars, *last_chars;
+  unsigned char *attrs, *last_attrs;
+  unsigned char attr;
+  struct sbuf *out;
+  int cursor_y, cursor_x;
+  bool valid;
+};
+
+#define ATTR_INVERT 0x80
+#define ATTR_UNKNOWN 0xff
+#define SCREEN_MOVE_COST 8
+
+/*
+ * Bytes read from the tty that haven't been decoded into keys yet.  Whatever
+ * is pending is drained on each wakeup so bursts are handled in one go.
+ */
+struct editor_input {
+  char *buf;
+  size_t pos, len, cap;
+  bool flush;
+};
+
+enum regex_op { RE_EPS, RE_SPLIT, RE_SET, RE_BOL, RE_EOL, RE_MATCH };
+
+/* A node of the NFA.  RE_SET nodes consume a byte in `set`. */
+struct regex_node {
+  enum regex_op op;
+  int out, out1;
+  unsigned char set[32];
+};
+
+/* A piece of the NFA under construction ending in an empty node. */
+struct regex_frag {
+  int start, end;
+};
+
+/*
+ * A state of a lazily built DFA: the set of NFA nodes it stands for and its
+ * transitions, which are -1 until first taken.  `accept_eol` tells whether
+ * it accepts at the end of a line, which is where `$` matches.
+ */
+struct regex_state {
+  int *nodes;
+  int num_nodes;
+  bool accept, accept_eol;
+  int next[UCHAR_MAX + 1];
+};
+
+/*
+ * States are looked up by their node set in `table`.  A DFA starts from the
+ * NFA node `root`, and the unanchored one also restarts there at every byte.
+ * Once it holds KILO_REGEX_STATES states a DFA is flushed and built again as
+ * the search goes on.
+ */
+struct regex_dfa {
+  struct regex_state *states;
+  int num_states, capacity;
+  int table[KILO_REGEX_STATES * 2];
+  int start[2];
+  int root;
+  bool unanchored;
+};
+
+/*
+ * A compiled pattern, with an anchored DFA of it and an unanchored DFA of
+ * the pattern reversed, which shares its nodes from `reverse_start` on and
+ * has `^` and `$` swapped.  `mark`, `list` and `seeds` are scratch space for
+ * building states.  `starts` has a bit set for each position of the line
+ * last passed to regex_starts() where a match starts.
+ */
+struct regex {
+  char *pattern;
+  struct regex_node *nodes;
+  int num_nodes, capacity, start, reverse_start;
+  bool reverse, error;
+  struct regex_dfa dfa[2];
+  int *mark, *list, *seeds;
+  int generation, num_list;
+  uint64_t *starts;
+  int starts_capacity;
+};
+
+/*
+ * Every occurrence of the current search query, overlapping ones included,
+ * in text order.  In regex mode matches don't overlap and the query is
+ * looked up in `cache`, which keeps the most recently used patterns
+ * compiled.  Extending the query can only drop matches, so once a
+ * search is complete its matches are narrowed down instead of searching the
+ * whole text again.  `current` is picked as the first match at or after
+ * `seek_row`, `seek_x`.
+ *
+ * Searches run on a worker thread over `snapshot`, a copy of the text
+ * store's header.  The text can't change while the find prompt is open and
+ * the worker is stopped before the prompt returns.  It hands its matches
+ * over in batches through `pending`, which together with `done` and `error`
+ * is guarded by `lock`, and wakes up the main thread with an EVFILT_USER
+ * event.  If that fails, the worker stops with `error` set, and the main
+ * thread picks up what it found on the next key instead.
+ */
+struct editor_match {
+  int row, cursor_x, len;
+};
+
+struct editor_search {
+  char *query;
+  size_t query_len;
+  struct editor_match *matches;
+  int num_matches, capacity;
+  int current, seek_row, seek_x;
+  bool active, running, updated;
+  bool use_regex, bad_regex;
+  struct regex *regex, *cache[KILO_REGEX_CACHE];
+
+  pthread_t worker;
+  pthread_mutex_t lock;
+  atomic_bool cancel;
+  struct text_store snapshot;
+  struct editor_match *pending;
+  int num_pending, pending_capacity;
+  bool done;
+  int error;
+};
+
+/*
+ * A save streams the rows of `buf` to a temporary file next to its file on a
+ * worker thread, then fsync(2)s it and renames it over the original.  `iov`
+ * is set up before the worker starts.  Borrowed rows are written straight
+ * from `base`, with rows that sit next to each other there merged into one
+ * entry of up to KILO_SAVE_CHUNK bytes.  The text of edited rows is copied
+ * to `copy`, so the editor can go on changing them.  The worker counts the
+ * bytes it has written in `written` and wakes up the main thread with an
+ * EVFILT_USER event after each writev(2) and once it is `done`.  `error` is
+ * only read after the worker has been joined.  `dirty` is the number of
+ * edits that the save covers and `swap_mark` where they end in the swap log.
+ * `follow_offset` is how far the file had been followed then, so that what
+ * follow mode appends during the save is still accounted for after it.
+ */
+struct editor_save {
+  struct editor_buffer *buf;
+  char *tmp;
+  struct iovec *iov;
+  int num_iov, iov_capacity;
+  char *copy;
+  size_t total, swap_mark;
+  off_t follow_offset;
+  int dirty, error;
+  bool running, updated;
+
+  pthread_t worker;
+  atomic_size_t written;
+  atomic_bool done;
+};
+
+enum journal_op { JOURNAL_INSERT, JOURNAL_DELETE };
+
+/*
+ * An edit in the undo journal.  `text` is what was inserted or deleted at
+ * `cursor_y`, `cursor_x`, with a newline ending each row as on disk.  An
+ * insert at the row past the last one adds rows, so its text ends with the
+ * newline of the last row it adds.  `group_start` marks the first edit of a
+ * group that is undone and redone as a whole.
+ */
+struct journal_edit {
+  enum journal_op op;
+  int cursor_y, cursor_x;
+  char *text;
+  size_t len, capacity;
+  bool group_start;
+};
+
+/*
+ * The edits made so far are `edits[first, num)`, of which the ones from
+ * `pos` on have been undone.  Recording an edit drops those.  An insert made
+ * where the last one left the cursor within KILO_UNDO_GROUP_MS joins its
+ * group, as does a delete next to the last one, unless it starts a new word,
+ * and is merged into it when their texts are adjacent.  Deletes go by their
+ * text, as deleting forward leaves the cursor in place.  `sealed` closes the
+ * group of the last edit.  Once the edits take up more than KILO_UNDO_LIMIT
+ * bytes, the oldest groups are dropped.  Their texts, most of them a word
+ * long, come from an arena of their own.
+ */
+struct editor_journal {
+  struct journal_edit *edits;
+  int first, pos, num, capacity;
+  size_t bytes;
+  int end_y, end_x;
+  struct timespec last;
+  bool sealed, replaying;
+  struct arena arena;
+};
+
+/*
+ * The swap file starts with a header naming the version of the file that it
+ * applies to, followed by a record for every edit made since, in the form of
+ * the undo journal.  Undoing and redoing are logged as the edits they make.
+ * Lines that follow mode appends aren't logged, as they are in the file:
+ * a file that grew past `size` still matches if the KILO_SWAP_TAIL bytes
+ * before `size` hash to `tail`.
+ */
+struct swap_header {
+  char magic[8];
+  int64_t size, mtime_sec, mtime_nsec;
+  uint64_t tail;
+};
+
+struct swap_record {
+  uint32_t op;
+  int32_t cursor_y, cursor_x;
+  uint32_t len;
+};
+
+/*
+ * Records are collected in `buf` and written out to `fd` once KILO_SWAP_BATCH
+ * bytes have piled up or the KILO_SWAP_TIMER fires, which also fsync(2)s
+ * the file if anything was written since the last time.  `logged` counts
+ * the bytes of all the records so far and `written` those in the file.
+ * The swap file at `path` is only created by the first edit, and is kept
+ * flock(2)ed so that a second kilo on the same file leaves it alone; `failed`
+ * is set once it has been given up on.  Until the file has a name there is
+ * no swap file, and records are only kept while the first save runs.
+ */
+struct editor_swap {
+  char *path;
+  int fd;
+  struct sbuf *buf;
+  size_t logged, written;
+  bool unsynced, failed;
+};
+
+/*
+ * In follow mode the file is watched with EVFILT_VNODE, and whatever gets
+ * appended to it from `offset` on is added as rows.  `offset` is the size of
+ * the file as it was loaded or last saved, and `partial` whether its last
+ * line had no newline yet, so the next bytes continue that row.
+ */
+struct editor_follow {
+  int fd;
+  off_t offset;
+  bool partial;
+};
+
+/*
+ * A block of the file in the cache of the pager.  Blocks are found by their
+ * `index` in the file through a hash table once `hashed`, and are `ready`
+ * when read; `len` is short for the last one of the file.  A block is off the
+ * LRU list while it has `pins`, so it is not reused under whoever reads it,
+ * and it goes back to the end that is reused first if `cold`.
+ */
+struct pager_block {
+  TAILQ_ENTRY(pager_block) lru;
+  LIST_ENTRY(pager_block) hash;
+  off_t index;
+  size_t len;
+  int pins;
+  bool hashed, ready, cold;
+  char *data;
+};
+
+/*
+ * The sparse line index: `offsets[i]` is where line `i * stride` starts.
+ * Once it holds KILO_PAGER_INDEX_MAX entries, every other one is dropped and
+ * the stride doubled, so it takes the same room whatever the length of the
+ * file.  `lines` counts the newlines in the first `scanned` bytes.
+ */
+struct pager_index {
+  off_t *offsets;
+  int num;
+  long stride, lines;
+  off_t scanned;
+  bool done;
+};
+
+enum pager_search_state {
+  PAGER_SEARCH_IDLE,
+  PAGER_SEARCH_RUNNING,
+  PAGER_SEARCH_FOUND,
+  PAGER_SEARCH_MISSING,
+  PAGER_SEARCH_BAD_REGEX
+};
+
+/*
+ * A file opened with -p is shown read-only straight from the file, through
+ * a cache of `num_blocks` blocks of KILO_PAGER_BLOCK bytes reused least
+ * recently used first, so memory stays the same however large it is.  The
+ * main thread reads the blocks it misses itself, and after each frame asks
+ * the `worker` to read ahead from block `prefetch` in the `direction` of the
+ * last scroll, a run of missing blocks at a time with a single preadv(2).
+ * The worker also searches for `query` from `search_from` on, over blocks it
+ * reads `cold`, and the `indexer` builds the line index with reads of its
+ * own.  `lock` guards the cache, the index, the requests and the results;
+ * `ready` is signalled when a block is read or unpinned, and `work` when
+ * there is something for the worker.  Lines are drawn through the scratch
+ * `row`, whose text is `line`.
+ */
+struct editor_pager {
+  int fd, error;
+  off_t size;
+  struct pager_block *blocks;
+  char *data;
+  int num_blocks, num_buckets;
+  TAILQ_HEAD(pager_lru, pager_block) lru;
+  LIST_HEAD(pager_bucket, pager_block) *buckets;
+  pthread_mutex_t lock;
+  pthread_cond_t ready, work;
+  pthread_t worker, indexer;
+  atomic_bool quit;
+  off_t prefetch;
+  int prefetch_direction, direction;
+  struct pager_index index;
+  char *index_buf;
+  char *query;
+  bool use_regex, search_pending;
+  enum pager_search_state search_state;
+  off_t search_from, match, origin;
+  int match_len;
+  unsigned long generation;
+  atomic_bool cancel;
+  char *search_line;
+  off_t shown; /* the match drawn highlighted, or -1 */
+  int shown_len;
+  struct editor_row row;
+  char *line;
+};
+
+/*
+ * An open file.  All the windows showing the same file share its buffer, so
+ * the text and its highlighting are only kept once.  `path` is the
+ * realpath(3) of `file`, to tell whether a file is already open, and
+ * `version` goes up with every change to the text, to tell which windows
+ * have to be drawn again.
+ */
+struct editor_buffer {
+  TAILQ_ENTRY(editor_buffer) link;
+  char *file, *path;
+  int dirty;
+  unsigned long version;
+  struct editor_syntax *syntax;
+  struct text_store text;
+  struct editor_journal journal;
+  struct editor_swap swap;
+  struct editor_follow follow;
+  struct editor_pager *pager;
+};
+
+/*
+ * The visual lines that the rows of a buffer take up in a window that wraps
+ * them at `width` columns, for each of the `capacity` slots of the text store
+ * in `height` (0 in the gap) and as a Fenwick tree in `tree`.  The line a row
+ * starts on and the row a line falls on are found in O(log n), and an edit
+ * only updates the slots it touched.  `width` is 0 until the window needs the
+ * index, and again whenever it has to be rebuilt.
+ */
+struct editor_wrap {
+  bool enabled;
+  int width, capacity;
+  int *height, *tree;
+};
+
+/*
+ * The screen above the message bar is tiled by a tree of windows.  A split
+ * divides its area between `child[0]` and `child[1]`, side by side with a
+ * separator column if `vertical` and one above the other otherwise.  A leaf
+ * shows `buf` in its `rows` by `cols` text area at `top`, `left`, with a
+ * status bar below it.  The cursor is drawn at `cursor_line`, `cursor_col` of
+ * the text, which are `cursor_y`, `render_x` unless `wrap` is enabled, and
+ * then `row_offset` counts visual lines too.  The `drawn_` fields describe
+ * the text area as it was last drawn; only windows that changed since, or are
+ * `damaged` by a change of the layout, are drawn again.  A pager window shows
+ * the lines from `top_offset` in the file on, the first of which is line
+ * `top_line`, or -1 while that is not known.
+ */
+struct editor_window {
+  struct editor_window *parent, *child[2];
+  bool vertical;
+  struct editor_buffer *buf;
   int cursor_x, cursor_y;
   int render_x;
+  int cursor_line, cursor_col;
   int row_offset, col_offset;
-  int screen_rows, screen_cols;
-  int num_rows;
-  int dirty;
-  char *file;
+  int top, left, rows, cols;
+  struct editor_wrap wrap;
+  unsigned long drawn_version;
+  int drawn_row_offset, drawn_col_offset;
+  bool drawn_matches, damaged;
+  off_t top_offset;
+  long top_line;
+};
+
+TAILQ_HEAD(editor_buffer_list, editor_buffer);
+
+/* What is measured of each frame; the phases are in nanoseconds. */
+enum stats_counter {
+  STATS_DECODE,
+  STATS_EDIT,
+  STATS_SYNTAX,
+  STATS_DRAW,
+  STATS_WRITE,
+  STATS_FRAME,
+  STATS_BYTES,
+  STATS_ALLOCS,
+#ifdef KILO_AUDIT
+  STATS_MALLOCS,
+#endif
+  STATS_COUNTERS
+};
+
+/*
+ * With KILO_STATS naming a file in the environment, every frame is measured,
+ * the message bar shows the median and 99th percentile of the last
+ * KILO_STATS_FRAMES frames when it has no message, and they are written to
+ * the file on exit.  The benchmark driver just sets `enabled` and reads the
+ * history.  A frame runs from decoding a key, or from the refresh if there is
+ * none, to the write(2) of the refresh; the edit is all that happens between
+ * the key and the refresh.  `frame` adds up the one in progress, whose key
+ * was decoded at `edit_start`.  The drawing of the rows includes their
+ * highlighting, and allocations are those from the arenas of the rows and
+ * of the undo journal.
+ */
+struct editor_stats {
+  bool enabled;
+  const char *file;
+#ifdef KILO_AUDIT
+  pthread_t thread; /* whose calls to malloc(3) are counted */
+#endif
+  int64_t frame[STATS_COUNTERS];
+  int64_t history[KILO_STATS_FRAMES][STATS_COUNTERS];
+  int64_t edit_start;
+  long frames;
+};
+
+/*
+ * `win` is the window that has the focus.  `buf` is the buffer that the
+ * editing functions work on: that of `win`, except while something is done
+ * to another buffer, like drawing another window or following its file.
+ */
+struct editor_config {
+  int tty, kq;
+  int trace; /* KILO_TRACE file that all input is copied to, or -1 */
   char statusmsg[80];
   time_t statusmsg_time;
-  struct editor_syntax *syntax;
-  struct editor_row *rows;
+  enum editor_highlight *hl_buf; /* the highlight of the row being lexed */
+  int hl_buf_capacity;
+  struct syntax_table syntax;
+  struct editor_buffer_list buffers;
+  struct editor_buffer *buf;
+  struct editor_window *root, *win;
+  bool follow_updated, pager_updated, resized;
+  bool swap_timer; /* whether KILO_SWAP_TIMER is armed */
+  struct editor_screen screen;
+  struct editor_input input;
+  struct editor_search search;
+  struct editor_save save;
+  struct editor_stats stats;
   struct termios orignal_termios;
 };
 
@@ -80,18 +767,167 @@ static char *c_hl_keywords[] = {
     "enum",   "class", "case",      "int|",    "long|",   "double|",
     "float|", "char|", "unsigned|", "signed|", "void|",   NULL};
 
-static struct editor_syntax highlight_db[] = {
+/* Definition files come first, so that they can take these over. */
+static struct syntax_def highlight_db[] = {
     {
-        "c",
-        c_hl_extensions,
-        c_hl_keywords,
-        "//",
-        "/*",
-        "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        .file_type = "c",
+        .file_match = c_hl_extensions,
+        .keywords = c_hl_keywords,
+        .single_line_comment_start = "//",
+        .multi_line_comment_start = "/*",
+        .multi_line_comment_end = "*/",
+        .quotes = "\"'",
+        .flags = HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
     },
 };
 
+static const char *hl_sgr[] = {
+    [HL_NORMAL] = DEFAULT_FG,          [HL_COMMENT] = COLOR(FG, CYAN),
+    [HL_MLCOMMENT] = COLOR(FG, CYAN),  [HL_KEYWORD1] = COLOR(FG, YELLOW),
+    [HL_KEYWORD2] = COLOR(FG, GREEN),  [HL_STRING] = COLOR(FG, MAGENTA),
+    [HL_NUMBER] = COLOR(FG, RED),      [HL_MATCH] = COLOR(FG, BLUE),
+};
+
+/* Characters taken to be two columns wide, after glibc's wcwidth(3). */
+static const struct width_range wide_chars[] = {
+    {0x01100, 0x0115f}, {0x0231a, 0x0231b}, {0x02329, 0x0232a},
+    {0x023e9, 0x023ec}, {0x023f0, 0x023f0}, {0x023f3, 0x023f3},
+    {0x025fd, 0x025fe}, {0x02614, 0x02615}, {0x02648, 0x02653},
+    {0x0267f, 0x0267f}, {0x02693, 0x02693}, {0x026a1, 0x026a1},
+    {0x026aa, 0x026ab}, {0x026bd, 0x026be}, {0x026c4, 0x026c5},
+    {0x026ce, 0x026ce}, {0x026d4, 0x026d4}, {0x026ea, 0x026ea},
+    {0x026f2, 0x026f3}, {0x026f5, 0x026f5}, {0x026fa, 0x026fa},
+    {0x026fd, 0x026fd}, {0x02705, 0x02705}, {0x0270a, 0x0270b},
+    {0x02728, 0x02728}, {0x0274c, 0x0274c}, {0x0274e, 0x0274e},
+    {0x02753, 0x02755}, {0x02757, 0x02757}, {0x02795, 0x02797},
+    {0x027b0, 0x027b0}, {0x027bf, 0x027bf}, {0x02b1b, 0x02b1c},
+    {0x02b50, 0x02b50}, {0x02b55, 0x02b55}, {0x02e80, 0x03029},
+    {0x0302e, 0x0303e}, {0x03041, 0x03096}, {0x0309b, 0x0a4c6},
+    {0x0a960, 0x0a97c}, {0x0ac00, 0x0d7a3}, {0x0f900, 0x0fad9},
+    {0x0fe10, 0x0fe19}, {0x0fe30, 0x0fe6b}, {0x0ff01, 0x0ff60},
+    {0x0ffe0, 0x0ffe6}, {0x16fe0, 0x16fe3}, {0x16ff0, 0x1b2fb},
+    {0x1f004, 0x1f004}, {0x1f0cf, 0x1f0cf}, {0x1f18e, 0x1f18e},
+    {0x1f191, 0x1f19a}, {0x1f200, 0x1f320}, {0x1f32d, 0x1f335},
+    {0x1f337, 0x1f37c}, {0x1f37e, 0x1f393}, {0x1f3a0, 0x1f3ca},
+    {0x1f3cf, 0x1f3d3}, {0x1f3e0, 0x1f3f0}, {0x1f3f4, 0x1f3f4},
+    {0x1f3f8, 0x1f43e}, {0x1f440, 0x1f440}, {0x1f442, 0x1f4fc},
+    {0x1f4ff, 0x1f53d}, {0x1f54b, 0x1f54e}, {0x1f550, 0x1f567},
+    {0x1f57a, 0x1f57a}, {0x1f595, 0x1f596}, {0x1f5a4, 0x1f5a4},
+    {0x1f5fb, 0x1f64f}, {0x1f680, 0x1f6c5}, {0x1f6cc, 0x1f6cc},
+    {0x1f6d0, 0x1f6d2}, {0x1f6d5, 0x1f6df}, {0x1f6eb, 0x1f6ec},
+    {0x1f6f4, 0x1f6fc}, {0x1f7e0, 0x1f7f0}, {0x1f90c, 0x1f93a},
+    {0x1f93c, 0x1f945}, {0x1f947, 0x1f9ff}, {0x1fa70, 0x1faf6},
+    {0x20000, 0x3134a},
+};
+
+/* Combining marks and other characters that take no column. */
+static const struct width_range zero_width_chars[] = {
+    {0x00300, 0x0036f}, {0x00483, 0x00489}, {0x00591, 0x005bd},
+    {0x005bf, 0x005bf}, {0x005c1, 0x005c2}, {0x005c4, 0x005c5},
+    {0x005c7, 0x005c7}, {0x00610, 0x0061a}, {0x0061c, 0x0061c},
+    {0x0064b, 0x0065f}, {0x00670, 0x00670}, {0x006d6, 0x006dc},
+    {0x006df, 0x006e4}, {0x006e7, 0x006e8}, {0x006ea, 0x006ed},
+    {0x00711, 0x00711}, {0x00730, 0x0074a}, {0x007a6, 0x007b0},
+    {0x007eb, 0x007f3}, {0x007fd, 0x007fd}, {0x00816, 0x00819},
+    {0x0081b, 0x00823}, {0x00825, 0x00827}, {0x00829, 0x0082d},
+    {0x00859, 0x0085b}, {0x00898, 0x0089f}, {0x008ca, 0x008e1},
+    {0x008e3, 0x00902}, {0x0093a, 0x0093a}, {0x0093c, 0x0093c},
+    {0x00941, 0x00948}, {0x0094d, 0x0094d}, {0x00951, 0x00957},
+    {0x00962, 0x00963}, {0x00981, 0x00981}, {0x009bc, 0x009bc},
+    {0x009c1, 0x009c4}, {0x009cd, 0x009cd}, {0x009e2, 0x009e3},
+    {0x009fe, 0x00a02}, {0x00a3c, 0x00a3c}, {0x00a41, 0x00a51},
+    {0x00a70, 0x00a71}, {0x00a75, 0x00a75}, {0x00a81, 0x00a82},
+    {0x00abc, 0x00abc}, {0x00ac1, 0x00ac8}, {0x00acd, 0x00acd},
+    {0x00ae2, 0x00ae3}, {0x00afa, 0x00b01}, {0x00b3c, 0x00b3c},
+    {0x00b3f, 0x00b3f}, {0x00b41, 0x00b44}, {0x00b4d, 0x00b56},
+    {0x00b62, 0x00b63}, {0x00b82, 0x00b82}, {0x00bc0, 0x00bc0},
+    {0x00bcd, 0x00bcd}, {0x00c00, 0x00c00}, {0x00c04, 0x00c04},
+    {0x00c3c, 0x00c3c}, {0x00c3e, 0x00c40}, {0x00c46, 0x00c56},
+    {0x00c62, 0x00c63}, {0x00c81, 0x00c81}, {0x00cbc, 0x00cbc},
+    {0x00cbf, 0x00cbf}, {0x00cc6, 0x00cc6}, {0x00ccc, 0x00ccd},
+    {0x00ce2, 0x00ce3}, {0x00d00, 0x00d01}, {0x00d3b, 0x00d3c},
+    {0x00d41, 0x00d44}, {0x00d4d, 0x00d4d}, {0x00d62, 0x00d63},
+    {0x00d81, 0x00d81}, {0x00dca, 0x00dca}, {0x00dd2, 0x00dd6},
+    {0x00e31, 0x00e31}, {0x00e34, 0x00e3a}, {0x00e47, 0x00e4e},
+    {0x00eb1, 0x00eb1}, {0x00eb4, 0x00ebc}, {0x00ec8, 0x00ecd},
+    {0x00f18, 0x00f19}, {0x00f35, 0x00f35}, {0x00f37, 0x00f37},
+    {0x00f39, 0x00f39}, {0x00f71, 0x00f7e}, {0x00f80, 0x00f84},
+    {0x00f86, 0x00f87}, {0x00f8d, 0x00fbc}, {0x00fc6, 0x00fc6},
+    {0x0102d, 0x01030}, {0x01032, 0x01037}, {0x01039, 0x0103a},
+    {0x0103d, 0x0103e}, {0x01058, 0x01059}, {0x0105e, 0x01060},
+    {0x01071, 0x01074}, {0x01082, 0x01082}, {0x01085, 0x01086},
+    {0x0108d, 0x0108d}, {0x0109d, 0x0109d}, {0x01160, 0x011ff},
+    {0x0135d, 0x0135f}, {0x01712, 0x01714}, {0x01732, 0x01733},
+    {0x01752, 0x01753}, {0x01772, 0x01773}, {0x017b4, 0x017b5},
+    {0x017b7, 0x017bd}, {0x017c6, 0x017c6}, {0x017c9, 0x017d3},
+    {0x017dd, 0x017dd}, {0x0180b, 0x0180f}, {0x01885, 0x01886},
+    {0x018a9, 0x018a9}, {0x01920, 0x01922}, {0x01927, 0x01928},
+    {0x01932, 0x01932}, {0x01939, 0x0193b}, {0x01a17, 0x01a18},
+    {0x01a1b, 0x01a1b}, {0x01a56, 0x01a56}, {0x01a58, 0x01a60},
+    {0x01a62, 0x01a62}, {0x01a65, 0x01a6c}, {0x01a73, 0x01a7f},
+    {0x01ab0, 0x01b03}, {0x01b34, 0x01b34}, {0x01b36, 0x01b3a},
+    {0x01b3c, 0x01b3c}, {0x01b42, 0x01b42}, {0x01b6b, 0x01b73},
+    {0x01b80, 0x01b81}, {0x01ba2, 0x01ba5}, {0x01ba8, 0x01ba9},
+    {0x01bab, 0x01bad}, {0x01be6, 0x01be6}, {0x01be8, 0x01be9},
+    {0x01bed, 0x01bed}, {0x01bef, 0x01bf1}, {0x01c2c, 0x01c33},
+    {0x01c36, 0x01c37}, {0x01cd0, 0x01cd2}, {0x01cd4, 0x01ce0},
+    {0x01ce2, 0x01ce8}, {0x01ced, 0x01ced}, {0x01cf4, 0x01cf4},
+    {0x01cf8, 0x01cf9}, {0x01dc0, 0x01dff}, {0x0200b, 0x0200f},
+    {0x0202a, 0x0202e}, {0x02060, 0x0206f}, {0x020d0, 0x020f0},
+    {0x02cef, 0x02cf1}, {0x02d7f, 0x02d7f}, {0x02de0, 0x02dff},
+    {0x0302a, 0x0302d}, {0x03099, 0x0309a}, {0x0a66f, 0x0a672},
+    {0x0a674, 0x0a67d}, {0x0a69e, 0x0a69f}, {0x0a6f0, 0x0a6f1},
+    {0x0a802, 0x0a802}, {0x0a806, 0x0a806}, {0x0a80b, 0x0a80b},
+    {0x0a825, 0x0a826}, {0x0a82c, 0x0a82c}, {0x0a8c4, 0x0a8c5},
+    {0x0a8e0, 0x0a8f1}, {0x0a8ff, 0x0a8ff}, {0x0a926, 0x0a92d},
+    {0x0a947, 0x0a951}, {0x0a980, 0x0a982}, {0x0a9b3, 0x0a9b3},
+    {0x0a9b6, 0x0a9b9}, {0x0a9bc, 0x0a9bd}, {0x0a9e5, 0x0a9e5},
+    {0x0aa29, 0x0aa2e}, {0x0aa31, 0x0aa32}, {0x0aa35, 0x0aa36},
+    {0x0aa43, 0x0aa43}, {0x0aa4c, 0x0aa4c}, {0x0aa7c, 0x0aa7c},
+    {0x0aab0, 0x0aab0}, {0x0aab2, 0x0aab4}, {0x0aab7, 0x0aab8},
+    {0x0aabe, 0x0aabf}, {0x0aac1, 0x0aac1}, {0x0aaec, 0x0aaed},
+    {0x0aaf6, 0x0aaf6}, {0x0abe5, 0x0abe5}, {0x0abe8, 0x0abe8},
+    {0x0abed, 0x0abed}, {0x0d7b0, 0x0d7fb}, {0x0fb1e, 0x0fb1e},
+    {0x0fe00, 0x0fe0f}, {0x0fe20, 0x0fe2f}, {0x0feff, 0x0feff},
+    {0x0fff9, 0x0fffb}, {0x101fd, 0x101fd}, {0x102e0, 0x102e0},
+    {0x10376, 0x1037a}, {0x10a01, 0x10a0f}, {0x10a38, 0x10a3f},
+    {0x10ae5, 0x10ae6}, {0x10d24, 0x10d27}, {0x10eab, 0x10eac},
+    {0x10f46, 0x10f50}, {0x10f82, 0x10f85}, {0x11001, 0x11001},
+    {0x11038, 0x11046}, {0x11070, 0x11070}, {0x11073, 0x11074},
+    {0x1107f, 0x11081}, {0x110b3, 0x110b6}, {0x110b9, 0x110ba},
+    {0x110c2, 0x110c2}, {0x11100, 0x11102}, {0x11127, 0x1112b},
+    {0x1112d, 0x11134}, {0x11173, 0x11173}, {0x11180, 0x11181},
+    {0x111b6, 0x111be}, {0x111c9, 0x111cc}, {0x111cf, 0x111cf},
+    {0x1122f, 0x11231}, {0x11234, 0x11234}, {0x11236, 0x11237},
+    {0x1123e, 0x1123e}, {0x112df, 0x112df}, {0x112e3, 0x112ea},
+    {0x11300, 0x11301}, {0x1133b, 0x1133c}, {0x11340, 0x11340},
+    {0x11366, 0x11374}, {0x11438, 0x1143f}, {0x11442, 0x11444},
+    {0x11446, 0x11446}, {0x1145e, 0x1145e}, {0x114b3, 0x114b8},
+    {0x114ba, 0x114ba}, {0x114bf, 0x114c0}, {0x114c2, 0x114c3},
+    {0x115b2, 0x115b5}, {0x115bc, 0x115bd}, {0x115bf, 0x115c0},
+    {0x115dc, 0x115dd}, {0x11633, 0x1163a}, {0x1163d, 0x1163d},
+    {0x1163f, 0x11640}, {0x116ab, 0x116ab}, {0x116ad, 0x116ad},
+    {0x116b0, 0x116b5}, {0x116b7, 0x116b7}, {0x1171d, 0x1171f},
+    {0x11722, 0x11725}, {0x11727, 0x1172b}, {0x1182f, 0x11837},
+    {0x11839, 0x1183a}, {0x1193b, 0x1193c}, {0x1193e, 0x1193e},
+    {0x11943, 0x11943}, {0x119d4, 0x119db}, {0x119e0, 0x119e0},
+    {0x11a01, 0x11a0a}, {0x11a33, 0x11a38}, {0x11a3b, 0x11a3e},
+    {0x11a47, 0x11a47}, {0x11a51, 0x11a56}, {0x11a59, 0x11a5b},
+    {0x11a8a, 0x11a96}, {0x11a98, 0x11a99}, {0x11c30, 0x11c3d},
+    {0x11c3f, 0x11c3f}, {0x11c92, 0x11ca7}, {0x11caa, 0x11cb0},
+    {0x11cb2, 0x11cb3}, {0x11cb5, 0x11cb6}, {0x11d31, 0x11d45},
+    {0x11d47, 0x11d47}, {0x11d90, 0x11d91}, {0x11d95, 0x11d95},
+    {0x11d97, 0x11d97}, {0x11ef3, 0x11ef4}, {0x13430, 0x13438},
+    {0x16af0, 0x16af4}, {0x16b30, 0x16b36}, {0x16f4f, 0x16f4f},
+    {0x16f8f, 0x16f92}, {0x16fe4, 0x16fe4}, {0x1bc9d, 0x1bc9e},
+    {0x1bca0, 0x1cf46}, {0x1d167, 0x1d169}, {0x1d173, 0x1d182},
+    {0x1d185, 0x1d18b}, {0x1d1aa, 0x1d1ad}, {0x1d242, 0x1d244},
+    {0x1da00, 0x1da36}, {0x1da3b, 0x1da6c}, {0x1da75, 0x1da75},
+    {0x1da84, 0x1da84}, {0x1da9b, 0x1daaf}, {0x1e000, 0x1e02a},
+    {0x1e130, 0x1e136}, {0x1e2ae, 0x1e2ae}, {0x1e2ec, 0x1e2ef},
+    {0x1e8d0, 0x1e8d6}, {0x1e944, 0x1e94a}, {0xe0001, 0xe01ef},
+};
+
 enum editor_key {
   BACKSPACE = 127,
   ARROW_LEFT = 1000,
@@ -102,58 +938,357 @@ enum editor_key {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  PASTE_BEGIN,
+  PASTE_END,
+  SEARCH_UPDATE,
+  SAVE_UPDATE,
+  FOLLOW_UPDATE,
+  PAGER_UPDATE,
+  RESIZE_UPDATE
 };
 
 static void die(const char *, ...);
 static void enable_raw_mode(void);
 static void disable_raw_mode(void);
+static void editor_wait_input(const struct timespec *timeout);
+static int editor_decode_key(int *key);
+static bool editor_key_pending(void);
 static int editor_read_key(void);
+static void editor_paste(void);
 static int get_cursor_position(int *rows, int *cols);
 static int get_window_size(int *rows, int *cols);
 
 static bool is_separator(char c);
-static void editor_update_syntax(struct editor_row *row);
-static int editor_syntax_to_color(enum editor_highlight hl);
+static uint64_t hash_bytes(uint64_t h, const void *p, size_t len);
+static uint64_t hash_string(uint64_t h, const char *s);
+static void editor_syntax_compile(const struct syntax_def *def,
+                                  struct editor_syntax *syntax);
+static void editor_syntax_release(void);
+static char *syntax_path(const char *xdg, const char *fallback,
+                         const char *name);
+static int syntax_filter(const struct dirent *d);
+static char *syntax_word(char **p);
+static void syntax_list_add(char ***list, int *num, const char *word,
+                            bool is_keyword2);
+static bool syntax_set(char **field, char **p);
+static bool syntax_def_load(int dir_fd, const char *name,
+                            struct syntax_def *def);
+static void syntax_def_free(struct syntax_def *def);
+static uint64_t syntax_def_hash(uint64_t h, const struct syntax_def *def);
+static uint64_t syntax_key(int dir_fd, struct dirent **names, int *num);
+static uint32_t syntax_image_put(struct sbuf *sb, const void *p, size_t len);
+static uint32_t syntax_image_string(struct sbuf *sb, const char *s);
+static void syntax_image_build(struct sbuf *sb, const struct syntax_def *defs,
+                               int num, uint64_t key);
+static bool syntax_image_map(const char *path, uint64_t key);
+static void syntax_image_save(char *path, const char *image, size_t size);
+static void editor_syntax_load(void);
+static const char *syntax_image_string_at(uint32_t off);
+static struct editor_syntax *editor_syntax_find(const char *name);
+static int keyword_match(const struct keyword_trie *trie, const char *s,
+                         int len, enum editor_highlight *kind);
+static int editor_lex(const char *s, int len, bool in_comment,
+                      enum editor_highlight *hl, int sync);
+static enum editor_highlight *editor_hl_buf(int size);
+static int hl_run(const enum editor_highlight *hl, int at, int len);
+static void editor_row_hl_decode(struct editor_row *row,
+                                 enum editor_highlight *hl);
+static void editor_row_hl_encode(struct editor_row *row,
+                                 const enum editor_highlight *hl, int len);
+static void editor_row_hl_splice(struct editor_row *row, int at, int old_len,
+                                 int new_len);
+static void editor_update_syntax(int file_row);
+static void editor_update_hl_state(int file_row);
+static void *editor_hl_worker(void *arg);
+static void editor_update_hl_state_all(void);
+static void editor_invalidate_syntax(void);
 static void editor_select_syntax_highlight(void);
 
+static int utf8_decode(const char *s, int len, int *cp);
+static int utf8_encode(int cp, char *s);
+static bool width_range_find(const struct width_range *table, size_t n,
+                             int cp);
+static int utf8_width(int cp);
+static int utf8_prev(const char *s, int at);
+static int utf8_start(const char *s, int len, int at);
+static bool text_is_ascii(const char *s, size_t len);
+static int render_width(const char *chars, int from, int to, int render_x);
 static int editor_row_cx_to_rx(struct editor_row *row, int cursor_x);
 static int editor_row_rx_to_cx(struct editor_row *row, int render_x);
-static void editor_update_row(struct editor_row *row);
+static void *editor_row_grow(void *p, int *capacity, int used, int size);
+static void editor_row_touch(struct editor_row *row, int from, int old_to,
+                             int new_to);
+static void editor_update_row(int file_row);
+static void editor_update_row_edit(int file_row, int at, int len);
+static struct editor_row *editor_row_prepare(int file_row);
+static void editor_row_init(struct editor_row *row, char *chars, int size,
+                            int capacity);
 static void editor_insert_row(int at, const char *s, size_t len);
 static void editor_free_row(struct editor_row *row);
 static void editor_del_row(int at);
-static void editor_row_append_string(struct editor_row *, const char *, size_t);
-static void editor_row_insert_char(struct editor_row *row, int at, char c);
-static void editor_row_del_char(struct editor_row *row, int at);
-
+static void editor_row_reserve(struct editor_row *row, int size);
+static void editor_row_append_string(int file_row, const char *, size_t);
+static void editor_row_insert_string(int file_row, int at, const char *s,
+                                     size_t len);
+static void editor_row_insert_char(int file_row, int at, char c);
+
+static struct editor_row *editor_row_at(int at);
+static struct editor_row *text_store_at(struct text_store *ts, int at);
+static int text_store_slot(struct text_store *ts, int at);
+static void text_store_reserve(struct text_store *ts, int capacity);
+static void text_store_move_gap(struct text_store *ts, int at);
+static struct editor_row *text_store_insert(struct text_store *ts, int at);
+static void text_store_delete(struct text_store *ts, int at);
+static void text_store_own(struct text_store *ts);
+static void text_store_free(struct text_store *ts);
+
+static void arena_init(struct arena *a);
+static int arena_class(size_t size);
+static void *arena_alloc(struct arena *a, size_t size, size_t *capacity);
+static void arena_free(struct arena *a, void *p, size_t capacity);
+static void arena_release(struct arena *a);
+
+static void editor_row_del_string(int file_row, int at, size_t len);
+static void editor_row_truncate(int file_row, int at);
 static void editor_insert_char(char c);
 static void editor_insert_newline(void);
+static void editor_insert_text(const char *s, size_t len);
 static void editor_del_char(void);
-
-static char *editor_rows_to_string(int *buflen);
-static void editor_open(const char *file);
+static void editor_delete_range(int y, int x, int end_y, int end_x);
+
+static void journal_text_end(int y, int x, const char *text, size_t len,
+                             int *end_y, int *end_x);
+static void editor_journal_insert(int y, int x, const char *s, size_t len,
+                                  bool new_row);
+static void editor_journal_delete(int y, int x, const char *s, size_t len);
+static void editor_journal_record(enum journal_op op, int y, int x,
+                                  const char *text, size_t len, int end_y,
+                                  int end_x);
+static void editor_journal_drop(struct journal_edit *edit);
+static void editor_journal_trim(void);
+static void editor_journal_apply(struct journal_edit *edit, bool undo);
+static void editor_undo(void);
+static void editor_redo(void);
+static void editor_journal_release(void);
+static bool editor_journal_valid(const struct journal_edit *edit);
+
+static void editor_swap_open(const struct stat *st);
+static int editor_swap_recover(char *buf, size_t len, size_t *end);
+static void editor_swap_start(struct editor_swap *swap, int fd,
+                              const char *file, off_t size);
+static uint64_t editor_swap_tail(const char *file, int64_t size);
+static bool editor_swap_lock(struct editor_swap *swap, int fd);
+static bool editor_swap_create(struct editor_buffer *buf);
+static void editor_swap_log(enum journal_op op, int y, int x,
+                            const char *text, size_t len);
+static void editor_swap_flush(struct editor_swap *swap, bool sync);
+static void editor_swap_fail(struct editor_swap *swap, const char *what);
+static void editor_swap_arm(void);
+static void editor_swap_rebase(struct editor_buffer *buf, size_t mark,
+                               off_t size);
+static void editor_swap_release(struct editor_swap *swap);
+
+static struct editor_buffer *editor_buffer_new(void);
+static struct editor_buffer *editor_buffer_find(const char *file);
+static void editor_buffer_free(struct editor_buffer *buf);
+static void editor_buffer_open(void);
+static void editor_buffer_cycle(bool forward);
+static int editor_open_file(const char *file);
+static bool editor_open(const char *file, int fd);
+static void editor_follow_toggle(void);
+static bool editor_follow_open(struct editor_buffer *buf);
+static void editor_follow_close(struct editor_buffer *buf);
+static void editor_follow_read(struct editor_buffer *buf, unsigned int fflags);
+static size_t editor_follow_append(struct editor_buffer *buf,
+                                   const char *data, size_t len);
+static void editor_pager_open(const char *file);
+static void editor_pager_close(struct editor_pager *pager);
+static void pager_notify(void);
+static struct pager_block *pager_lookup(struct editor_pager *pager,
+                                        off_t index);
+static struct pager_block *pager_claim(struct editor_pager *pager, off_t index,
+                                       bool cold);
+static ssize_t pager_preadv(int fd, struct iovec *iov, int n, off_t offset);
+static void pager_read(struct editor_pager *pager, struct pager_block **blocks,
+                       int n);
+static struct pager_block *pager_get(struct editor_pager *pager, off_t index,
+                                     bool cold);
+static void pager_put(struct editor_pager *pager, struct pager_block *block);
+static void pager_read_ahead(struct editor_pager *pager, off_t first,
+                             int direction);
+static off_t pager_find_eol(struct editor_pager *pager, off_t from, off_t to,
+                            bool backward, bool cold);
+static void pager_copy(struct editor_pager *pager, off_t offset, char *buf,
+                       int len, bool cold);
+static int pager_line(struct editor_pager *pager, off_t offset, char *buf,
+                      off_t *next, bool cold);
+static off_t pager_line_start(struct editor_pager *pager, off_t offset,
+                              bool cold);
+static off_t pager_next_line(struct editor_pager *pager, off_t offset);
+static off_t pager_line_cut(struct editor_pager *pager, off_t offset);
+static bool pager_ends_line(struct editor_pager *pager, off_t offset);
+static off_t pager_index_floor(struct editor_pager *pager, off_t offset,
+                               long *line);
+static void pager_index_add(struct pager_index *index, off_t offset);
+static long pager_line_number(struct editor_pager *pager, off_t offset);
+static void *editor_pager_indexer(void *arg);
+static enum pager_search_state pager_search_run(struct editor_pager *pager,
+                                                const char *query,
+                                                bool use_regex, off_t from,
+                                                off_t *match, int *match_len);
+static void *editor_pager_worker(void *arg);
+static void editor_pager_search(struct editor_pager *pager, const char *query,
+                                off_t from);
+static struct editor_row *editor_pager_render(struct editor_pager *pager,
+                                              off_t offset, off_t *next);
+static void editor_pager_scroll(struct editor_window *w, long n);
+static void editor_pager_end(struct editor_window *w);
+static void editor_pager_goto_line(void);
+static void editor_pager_find(void);
+static void editor_pager_find_callback(const char *query, int key);
+static bool editor_pager_key(int key);
+static void editor_pager_draw_rows(struct editor_window *w);
+static void editor_pager_draw_status_bar(struct editor_window *w);
 static void editor_save(void);
+static void editor_save_add(struct editor_save *save, char *p, size_t len);
+static void editor_save_snapshot(struct editor_save *save);
+static void *editor_save_worker(void *arg);
+static int editor_save_write(struct editor_save *save, int fd);
+static void editor_save_notify(void);
+static void editor_save_collect(void);
+static void editor_save_finish(struct editor_save *save);
+static struct regex *regex_compile(const char *pattern);
+static void regex_free(struct regex *re);
+static int regex_node(struct regex *re, enum regex_op op, int out, int out1);
+static struct regex_frag regex_parse_alt(struct regex *re, const char **p);
+static struct regex_frag regex_parse_concat(struct regex *re, const char **p);
+static struct regex_frag regex_parse_repeat(struct regex *re, const char **p);
+static struct regex_frag regex_parse_atom(struct regex *re, const char **p);
+static void regex_dfa_flush(struct regex_dfa *dfa);
+static int regex_dfa_start(struct regex *re, struct regex_dfa *dfa,
+                           bool at_bol);
+static void regex_starts(struct regex *re, const char *s, int len);
+static int regex_next_start(const struct regex *re, int len, int from);
+static int regex_longest(struct regex *re, const char *s, int len, int from);
+static bool regex_find(struct regex *re, const char *s, int len, int from,
+                       int *start, int *match_len);
+static struct regex *regex_lookup(struct regex **cache, const char *pattern);
+
+static const char *search_memmem(const char *s, size_t len,
+                                 const char *needle, size_t needle_len);
+static void editor_search_update(const char *query);
+static void editor_search_collect(void);
+static void editor_search_reset(void);
+static void editor_search_release(void);
 static void editor_find(void);
 static void editor_find_callback(const char *, int);
 static char *editor_prompt(const char *, void (*)(const char *, int));
 static void editor_move_cursor(int key);
+static void editor_clamp_cursor(struct editor_window *w);
+static void editor_page(bool up);
+static void editor_goto_line(void);
+static bool editor_row_zero_width(struct editor_row *row, int cursor_x);
 static void editor_process_keypress(void);
 
+static struct editor_window *editor_window_new(struct editor_buffer *buf);
+static void editor_window_show(struct editor_window *w,
+                               struct editor_buffer *buf);
+static void editor_window_focus(struct editor_window *w);
+static struct editor_window *editor_window_first(struct editor_window *w);
+static struct editor_window *editor_window_next(struct editor_window *w);
+static void editor_window_split(bool vertical);
+static void editor_window_close(void);
+static void editor_window_remove(struct editor_window *w);
+static void editor_window_command(void);
+static void editor_layout(struct editor_window *w, int top, int left,
+                          int rows, int cols);
+static bool editor_window_damaged(const struct editor_window *w);
+static bool editor_layout_fits(const struct editor_window *w, int rows,
+                               int cols);
+static void editor_resize(void);
+
+static struct editor_window *editor_wrap_next(struct text_store *ts,
+                                              struct editor_window *w);
+static int editor_wrap_height(struct editor_row *row, int width);
+static void editor_wrap_build(struct editor_window *w);
+static void editor_wrap_validate(struct editor_window *w);
+static void editor_wrap_toggle(void);
+static int editor_wrap_line(struct editor_window *w, int file_row);
+static int editor_wrap_find(struct editor_window *w, int line, int *sub);
+static void editor_wrap_page(struct editor_window *w, bool up);
+static void editor_wrap_update(struct text_store *ts, int slot,
+                               struct editor_row *row);
+static void editor_wrap_move_gap(struct text_store *ts, int at);
+static void editor_wrap_reserve(struct text_store *ts, int capacity);
+static void wrap_build(struct editor_wrap *wrap);
+static void wrap_add(struct editor_wrap *wrap, int slot, int delta);
+static void wrap_set(struct editor_wrap *wrap, int slot, int height);
+static int wrap_prefix(const struct editor_wrap *wrap, int slot);
+
 static void editor_refresh_screen(void);
 static void editor_set_status_message(const char *, ...);
-static void editor_scroll(void);
-static void editor_draw_status_bar(struct sbuf *sb);
-static void editor_draw_message_bar(struct sbuf *sb);
-static void editor_draw_rows(struct sbuf *sb);
+static void editor_scroll(struct editor_window *w);
+static void editor_draw_window(struct sbuf *sb, struct editor_window *w);
+static void editor_draw_status_bar(struct editor_window *w);
+static void editor_draw_separators(struct editor_window *w);
+static void editor_draw_message_bar(void);
+static void editor_draw_rows(struct editor_window *w);
+static void editor_draw_cells(struct editor_row *row, int from, uint32_t *cell,
+                              unsigned char *attr, int len);
+static void editor_draw_highlight(struct editor_row *row, int from,
+                                  unsigned char *attr, int len);
+static void editor_draw_matches(struct editor_row *row, int file_row, int from,
+                                unsigned char *attr, int len);
+
+static void screen_resize(int rows, int cols);
+static void screen_blank(uint32_t *cells, size_t n);
+static void screen_put(int y, int x, const char *s, int len,
+                       unsigned char attr);
+static void screen_clear(int y, int x, int len, unsigned char attr);
+static void screen_set_attr(struct sbuf *sb, unsigned char attr);
+static void screen_scroll(struct sbuf *sb, int top, int rows, int lines);
+static void screen_emit(struct sbuf *sb, int y, int from, int to);
+static void screen_flush(struct sbuf *sb, int cursor_y, int cursor_x);
+
+static int64_t stats_now(void);
+static void stats_add(enum stats_counter counter, int64_t start);
+static void stats_frame(size_t bytes);
+static int compare_int64(const void *a, const void *b);
+static void stats_percentiles(enum stats_counter counter, int64_t *p50,
+                              int64_t *p99, int64_t *max);
+static int stats_format(char *buf, size_t size);
+static bool stats_dump(void);
+#ifdef KILO_AUDIT
+static void stats_malloc(void);
+#endif
 
 static void enter_alt_buffer(void);
 static void leave_alt_buffer(void);
 
 static void init_editor(void);
+static void init_terminal(void);
 
+#ifdef KILO_BENCH
+#include "bench/bench.c"
+#else
 int main(int argc, char *argv[]) {
-  struct kevent event, tevent;
+  struct kevent events[5];
+  bool pager = false;
+  int ch, fd;
+
+  while ((ch = getopt(argc, argv, "p")) != -1) {
+    switch (ch) {
+    case 'p':
+      pager = true;
+      break;
+    default:
+      fprintf(stderr, "usage: kilo [-p] [file ...]\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  argc -= optind;
+  argv += optind;
 
   if (!isatty(STDIN_FILENO))
     errx(EXIT_FAILURE, "not a TTY");
@@ -161,32 +1296,64 @@ int main(int argc, char *argv[]) {
   enable_raw_mode();
   enter_alt_buffer();
   init_editor();
+  init_terminal();
 
-  if (argc > 1)
-    editor_open(argv[1]);
-
-  editor_set_status_message(
-      "HELP: CTRL-S = save | CTRL-Q = quit | CTRL-F = find");
+  if (editor.statusmsg[0] == '\0')
+    editor_set_status_message(
+        "HELP: CTRL-S = save | CTRL-Q = quit | CTRL-F = find | "
+        "CTRL-Z/Y = undo/redo");
 
-  EV_SET(&event, editor.tty, EVFILT_READ, EV_ADD, 0, 0, NULL);
-  if (kevent(editor.kq, &event, 1, NULL, 0, NULL) == -1)
+  for (int i = 0; i < argc; i++) {
+    if (i > 0) {
+      if (editor_buffer_find(argv[i]) != NULL)
+        continue;
+      editor.buf = editor_buffer_new();
+    }
+    if (pager)
+      editor_pager_open(argv[i]);
+    else if ((fd = editor_open_file(argv[i])) == -1 ||
+             !editor_open(argv[i], fd))
+      die("%s", argv[i]);
+  }
+  if (argc > 0)
+    editor_window_show(editor.win, TAILQ_FIRST(&editor.buffers));
+
+  EV_SET(&events[0], editor.tty, EVFILT_READ, EV_ADD, 0, 0, NULL);
+  EV_SET(&events[1], KILO_SEARCH_EVENT, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0,
+         NULL);
+  EV_SET(&events[2], KILO_SAVE_EVENT, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0,
+         NULL);
+  EV_SET(&events[3], SIGWINCH, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+  EV_SET(&events[4], KILO_PAGER_EVENT, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0,
+         NULL);
+  if (kevent(editor.kq, events, nitems(events), NULL, 0, NULL) == -1)
     err(EXIT_FAILURE, "kevent register");
 
   for (;;) {
-    int nev;
-
     editor_refresh_screen();
 
-    if ((nev = kevent(editor.kq, NULL, 0, &tevent, 1, NULL)) == -1)
-      die("kevent wait");
-    else if (nev > 0 && tevent.flags & EV_ERROR)
-      die("event error: %s", strerror(tevent.data));
-
-    editor_process_keypress();
+    do
+      editor_process_keypress();
+    while (editor_key_pending());
   }
 
   return (0);
 }
+#endif
+
+#ifdef KILO_AUDIT
+/*
+ * The audit build counts the calls of the main thread into the allocator in
+ * STATS_MALLOCS, which the benchmark driver reports for the steady state of
+ * each trace: scrolling and typing should not allocate once warmed up.
+ */
+#define malloc(size) (stats_malloc(), malloc(size))
+#define calloc(num, size) (stats_malloc(), calloc(num, size))
+#define realloc(p, size) (stats_malloc(), realloc(p, size))
+#define strdup(s) (stats_malloc(), strdup(s))
+#define strndup(s, n) (stats_malloc(), strndup(s, n))
+#define asprintf(...) (stats_malloc(), asprintf(__VA_ARGS__))
+#endif
 
 static void die(const char *fmt, ...) {
   leave_alt_buffer();
@@ -224,75 +1391,266 @@ static void enable_raw_mode(void) {
     die("tcsetattr");
 }
 
-static int editor_read_key(void) {
-  int nread;
-  char c;
+/*
+ * Wait until the tty is readable (or `timeout` expires) and append
+ * everything that is pending to the input buffer.
+ */
+static void editor_wait_input(const struct timespec *timeout) {
+  struct editor_input *in = &editor.input;
+  struct kevent tevent;
+  size_t want;
+  ssize_t nread;
+  int nev;
+
+  if ((nev = kevent(editor.kq, NULL, 0, &tevent, 1, timeout)) == -1) {
+    if (errno == EINTR)
+      return;
+    die("kevent wait");
+  } else if (nev > 0 && tevent.flags & EV_ERROR)
+    die("event error: %s", strerror(tevent.data));
+
+  if (nev == 0) {
+    in->flush = true;
+    return;
+  }
+
+  if (tevent.filter == EVFILT_SIGNAL) {
+    /* (Re)start the timer so a burst of resizes is handled once. */
+    EV_SET(&tevent, KILO_RESIZE_TIMER, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0,
+           KILO_RESIZE_DELAY, NULL);
+    if (kevent(editor.kq, &tevent, 1, NULL, 0, NULL) == -1)
+      die("kevent register");
+    return;
+  }
+
+  if (tevent.filter == EVFILT_TIMER && tevent.ident == KILO_RESIZE_TIMER) {
+    editor_resize();
+    return;
+  }
+
+  if (tevent.filter == EVFILT_TIMER) {
+    struct editor_buffer *buf;
 
-  while ((nread = read(editor.tty, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN)
+    editor.swap_timer = false;
+    TAILQ_FOREACH(buf, &editor.buffers, link)
+      editor_swap_flush(&buf->swap, true);
+    return;
+  }
+
+  if (tevent.filter == EVFILT_VNODE) {
+    editor_follow_read(tevent.udata, tevent.fflags);
+    return;
+  }
+
+  if (tevent.filter == EVFILT_USER) {
+    if (tevent.ident == KILO_SAVE_EVENT)
+      editor_save_collect();
+    else if (tevent.ident == KILO_PAGER_EVENT)
+      editor.pager_updated = true;
+    else
+      editor_search_collect();
+    return;
+  }
+
+  if (in->pos == in->len)
+    in->pos = in->len = 0;
+
+  want = tevent.data > 0 ? tevent.data : 1;
+  if (in->len + want > in->cap) {
+    memmove(in->buf, &in->buf[in->pos], in->len - in->pos);
+    in->len -= in->pos;
+    in->pos = 0;
+
+    while (in->len + want > in->cap)
+      in->cap = in->cap == 0 ? 4096 : in->cap * 2;
+    if ((in->buf = realloc(in->buf, in->cap)) == NULL)
+      die("realloc");
+  }
+
+  if ((nread = read(editor.tty, &in->buf[in->len], want)) == -1) {
+    if (errno != EAGAIN && errno != EINTR)
       die("read");
+    nread = 0;
   }
 
-  if (c == ESC_CHAR) {
-    char seq[3];
-
-    if (read(editor.tty, &seq[0], 1) != 1)
-      return (ESC_CHAR);
-    if (read(editor.tty, &seq[1], 1) != 1)
-      return (ESC_CHAR);
-
-    if (seq[0] == '[') {
-      if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(editor.tty, &seq[2], 1) != 1)
-          return (ESC_CHAR);
-
-        if (seq[2] == '~') {
-          switch (seq[1]) {
-          case '1':
-            return (HOME_KEY);
-          case '3':
-            return (DEL_KEY);
-          case '4':
-            return (END_KEY);
-          case '5':
-            return (PAGE_UP);
-          case '6':
-            return (PAGE_DOWN);
-          case '7':
-            return (HOME_KEY);
-          case '8':
-            return (END_KEY);
-          }
-        }
-      } else {
-        switch (seq[1]) {
-        case 'A':
-          return (ARROW_UP);
-        case 'B':
-          return (ARROW_DOWN);
-        case 'D':
-          return (ARROW_LEFT);
-        case 'C':
-          return (ARROW_RIGHT);
-        case 'H':
-          return (HOME_KEY);
-        case 'F':
-          return (END_KEY);
-        }
-      }
-    } else if (seq[0] == 'O') {
-      switch (seq[1]) {
-      case 'H':
-        return (HOME_KEY);
-      case 'F':
-        return (END_KEY);
-      }
+  if (editor.trace != -1 && nread > 0 &&
+      write(editor.trace, &in->buf[in->len], nread) != nread)
+    die("write trace");
+  in->len += nread;
+}
+
+/*
+ * Decode the key at the head of the input buffer into `key` and return the
+ * number of bytes it spans, or 0 if the buffer holds no complete key.  An
+ * escape sequence cut short at the end of the buffer is only taken as a
+ * plain ESC once `flush` is set, i.e. no more bytes arrived in time; the
+ * bytes after the ESC are then left to be decoded as keys of their own.
+ */
+static int editor_decode_key(int *key) {
+  struct editor_input *in = &editor.input;
+  const char *seq = &in->buf[in->pos];
+  size_t avail = in->len - in->pos, n;
+  int param = 0;
+
+  if (avail == 0)
+    return (0);
+
+  *key = seq[0];
+  if (seq[0] != ESC_CHAR)
+    return (1);
+
+  if (avail < 3)
+    goto incomplete;
+
+  *key = ESC_CHAR;
+  if (seq[1] == 'O') {
+    switch (seq[2]) {
+    case 'H':
+      *key = HOME_KEY;
+      break;
+    case 'F':
+      *key = END_KEY;
+      break;
+    }
+    return (3);
+  } else if (seq[1] != '[')
+    return (2);
+
+  for (n = 2; n < avail && seq[n] >= 0x30 && seq[n] <= 0x3f; n++) {
+    if (seq[n] >= '0' && seq[n] <= '9')
+      param = param * 10 + seq[n] - '0';
+  }
+
+  for (; n < avail && seq[n] >= 0x20 && seq[n] <= 0x2f; n++)
+    ;
+
+  if (n == avail)
+    goto incomplete;
+
+  if (seq[n] == '~') {
+    switch (param) {
+    case 1:
+    case 7:
+      *key = HOME_KEY;
+      break;
+    case 3:
+      *key = DEL_KEY;
+      break;
+    case 4:
+    case 8:
+      *key = END_KEY;
+      break;
+    case 5:
+      *key = PAGE_UP;
+      break;
+    case 6:
+      *key = PAGE_DOWN;
+      break;
+    case 200:
+      *key = PASTE_BEGIN;
+      break;
+    case 201:
+      *key = PASTE_END;
+      break;
+    }
+  } else if (n == 2) {
+    switch (seq[n]) {
+    case 'A':
+      *key = ARROW_UP;
+      break;
+    case 'B':
+      *key = ARROW_DOWN;
+      break;
+    case 'D':
+      *key = ARROW_LEFT;
+      break;
+    case 'C':
+      *key = ARROW_RIGHT;
+      break;
+    case 'H':
+      *key = HOME_KEY;
+      break;
+    case 'F':
+      *key = END_KEY;
+      break;
+    }
+  }
+
+  return (n + 1);
+
+incomplete:
+  if (!in->flush)
+    return (0);
+
+  *key = ESC_CHAR;
+  return (1);
+}
+
+static bool editor_key_pending(void) {
+  int key;
+
+  return (editor_decode_key(&key) != 0);
+}
+
+static int editor_read_key(void) {
+  static const struct timespec esc_timeout = {
+      .tv_nsec = KILO_ESC_TIMEOUT * 1000000L};
+  struct editor_input *in = &editor.input;
+  int64_t start = stats_now();
+  int key, n;
+
+  while ((n = editor_decode_key(&key)) == 0) {
+    if (editor.search.updated) {
+      editor.search.updated = false;
+      return (SEARCH_UPDATE);
+    }
+    if (editor.save.updated) {
+      editor.save.updated = false;
+      return (SAVE_UPDATE);
+    }
+    if (editor.follow_updated) {
+      editor.follow_updated = false;
+      return (FOLLOW_UPDATE);
+    }
+    if (editor.pager_updated) {
+      editor.pager_updated = false;
+      return (PAGER_UPDATE);
     }
+    if (editor.resized) {
+      editor.resized = false;
+      return (RESIZE_UPDATE);
+    }
+    editor_wait_input(in->pos == in->len ? NULL : &esc_timeout);
+    start = stats_now();
+  }
+  stats_add(STATS_DECODE, start);
+  if (editor.stats.edit_start == 0)
+    editor.stats.edit_start = stats_now();
+
+  in->pos += n;
+  in->flush = false;
+
+  return (key);
+}
 
-    return (ESC_CHAR);
+/*
+ * Called after PASTE_BEGIN: wait for the end of the pasted block and insert
+ * it as a whole instead of feeding it through the keymap byte by byte.
+ */
+static void editor_paste(void) {
+  struct editor_input *in = &editor.input;
+  size_t scanned = 0, end_len = sizeof(PASTE_END_SEQ) - 1;
+  char *end;
+
+  while ((end = memmem(&in->buf[in->pos + scanned], in->len - in->pos - scanned,
+                       PASTE_END_SEQ, end_len)) == NULL) {
+    if (in->len - in->pos >= end_len)
+      scanned = in->len - in->pos - (end_len - 1);
+    editor_wait_input(NULL);
   }
 
-  return (c);
+  editor_insert_text(&in->buf[in->pos], end - &in->buf[in->pos]);
+  in->pos = end - in->buf + end_len;
 }
 
 static int get_cursor_position(int *rows, int *cols) {
@@ -329,863 +1687,6738 @@ static int get_window_size(int *rows, int *cols) {
 }
 
 static bool is_separator(char c) {
-  return (isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL);
+  return (isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];:", c) != NULL);
 }
 
-static void editor_update_syntax(struct editor_row *row) {
-  int i = 0, slcs_len = 0, mlcs_len = 0, mlce_len = 0;
-  bool prev_sep = true, in_comment = false;
-  char quote = '\0';
-  char *slcs = NULL, *mlcs = NULL, *mlce = NULL;
-
-  row->highlight = realloc(row->highlight, row->render_size);
-  memset(row->highlight, HL_NORMAL, row->render_size);
+static bool starts_with(const char *s, int len, const char *prefix,
+                        int prefix_len) {
+  return (prefix_len <= len && memcmp(s, prefix, prefix_len) == 0);
+}
 
-  if (editor.syntax == NULL)
-    return;
+/* FNV-1a of the `len` bytes at `p`, carried on from `h`. */
+static uint64_t hash_bytes(uint64_t h, const void *p, size_t len) {
+  const unsigned char *b = p;
 
-  slcs = editor.syntax->single_line_comment_start;
-  mlcs = editor.syntax->multi_line_comment_start;
-  mlce = editor.syntax->multi_line_comment_end;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ b[i]) * 1099511628211u;
 
-  slcs_len = slcs == NULL ? 0 : strlen(slcs);
-  mlcs_len = mlcs == NULL ? 0 : strlen(mlcs);
-  mlce_len = mlce == NULL ? 0 : strlen(mlce);
+  return (h);
+}
 
-  in_comment = (row->i > 0 && editor.rows[row->i - 1].hl_open_comment);
+/* Hash `s` with its terminating NUL, so that strings in a row stay apart. */
+static uint64_t hash_string(uint64_t h, const char *s) {
+  if (s == NULL)
+    return (hash_bytes(h, "\xff", 1));
 
-  while (i < row->render_size) {
-    char c = row->render[i];
-    enum editor_highlight prev_hl = (i > 0) ? row->highlight[i - 1] : HL_NORMAL;
+  return (hash_bytes(h, s, strlen(s) + 1));
+}
 
-    if (slcs_len != 0 && quote == '\0' && !in_comment &&
-        strncmp(&row->render[i], slcs, slcs_len) == 0) {
-      memset(&row->highlight[i], HL_COMMENT, row->render_size - i);
-      break;
+/*
+ * Work out the delimiter lengths of `def` and build its keyword trie into
+ * `syntax`, whose tables are then the caller's to free.  The lookback is the
+ * length of the longest delimiter or keyword plus the byte after it that a
+ * keyword match looks at.  Tokens starting further back than this from an
+ * edit are not affected by it.
+ */
+static void editor_syntax_compile(const struct syntax_def *def,
+                                  struct editor_syntax *syntax) {
+  struct keyword_trie *trie = &syntax->trie;
+  const char *slcs = def->single_line_comment_start;
+  const char *mlcs = def->multi_line_comment_start;
+  const char *mlce = def->multi_line_comment_end;
+  enum editor_highlight *kind;
+  int max_nodes = 1, cells, *next;
+
+  syntax->file_type = def->file_type;
+  syntax->single_line_comment_start = slcs;
+  syntax->multi_line_comment_start = mlcs;
+  syntax->multi_line_comment_end = mlce;
+  syntax->quotes = def->quotes == NULL ? "\"'" : def->quotes;
+  syntax->flags = def->flags;
+  syntax->slcs_len = slcs == NULL ? 0 : strlen(slcs);
+  syntax->mlcs_len = mlcs == NULL ? 0 : strlen(mlcs);
+  syntax->mlce_len = mlce == NULL ? 0 : strlen(mlce);
+  syntax->lookback = MAX(syntax->slcs_len,
+                         MAX(syntax->mlcs_len, syntax->mlce_len));
+
+  memset(trie->byte_class, 0, sizeof(trie->byte_class));
+  trie->num_classes = 0;
+  for (char **k = def->keywords; k != NULL && *k != NULL; k++) {
+    int len = strlen(*k);
+
+    syntax->lookback = MAX(syntax->lookback, len);
+    if (len > 0 && (*k)[len - 1] == '|')
+      len--;
+    for (int i = 0; i < len; i++) {
+      unsigned char c = (*k)[i];
+
+      if (trie->byte_class[c] == 0)
+        trie->byte_class[c] = ++trie->num_classes;
     }
-
-    if (mlcs_len != 0 && mlce_len != 0 && quote == '\0') {
-      if (in_comment) {
-        row->highlight[i] = HL_MLCOMMENT;
-        if (strncmp(&row->render[i], mlce, mlce_len) == 0) {
-          memset(&row->highlight[i], HL_MLCOMMENT, mlce_len);
-          i += mlce_len;
-          in_comment = false;
-          prev_sep = true;
-          continue;
-        } else {
-          i++;
-          continue;
-        }
-      } else if (strncmp(&row->render[i], mlcs, mlcs_len) == 0) {
-        memset(&row->highlight[i], HL_MLCOMMENT, mlcs_len);
-        i += mlcs_len;
-        in_comment = true;
-        continue;
-      }
+    max_nodes += len;
+  }
+  syntax->lookback++;
+
+  cells = MAX(1, max_nodes * trie->num_classes);
+  if ((next = calloc(cells, sizeof(*next))) == NULL ||
+      (kind = calloc(max_nodes, sizeof(*kind))) == NULL)
+    die("calloc");
+
+  /* An earlier spelling of the same keyword wins, as it used to. */
+  trie->num_nodes = 1;
+  for (char **k = def->keywords; k != NULL && *k != NULL; k++) {
+    int len = strlen(*k), node = 0;
+    bool is_keyword2 = len > 0 && (*k)[len - 1] == '|';
+
+    if (is_keyword2)
+      len--;
+    if (len == 0)
+      continue;
+
+    for (int i = 0; i < len; i++) {
+      int *edge = &next[node * trie->num_classes +
+                        trie->byte_class[(unsigned char)(*k)[i]] - 1];
+
+      if (*edge == 0)
+        *edge = trie->num_nodes++;
+      node = *edge;
     }
 
-    if (editor.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (quote != '\0') {
-        row->highlight[i] = HL_STRING;
+    if (kind[node] == HL_NORMAL)
+      kind[node] = is_keyword2 ? HL_KEYWORD2 : HL_KEYWORD1;
+  }
 
-        if (c == '\\' && i + 1 < row->render_size) {
-          row->highlight[i + 1] = HL_STRING;
-          i += 2;
-          continue;
-        }
+  trie->next = next;
+  trie->kind = kind;
+}
 
-        if (c == quote)
-          quote = '\0';
+/* Free the syntax image and the lexer's scratch room on the way out. */
+static void editor_syntax_release(void) {
+  struct syntax_table *table = &editor.syntax;
+
+  free(editor.hl_buf);
+  editor.hl_buf = NULL;
+  free(table->syntaxes);
+  table->syntaxes = NULL;
+  if (table->mapped)
+    munmap((void *)table->image, table->size);
+  else
+    free((void *)table->image);
+  table->image = NULL;
+}
 
-        i++;
-        prev_sep = true;
-        continue;
-      } else if (c == '"' || c == '\'') {
-        quote = c;
-        row->highlight[i] = HL_STRING;
-        i++;
-        continue;
-      }
-    }
+/*
+ * The path of `name` in the kilo directory of $`xdg`, or of `fallback` in
+ * the home directory, or NULL if there is neither.
+ */
+static char *syntax_path(const char *xdg, const char *fallback,
+                         const char *name) {
+  const char *base = getenv(xdg), *home = getenv("HOME");
+  char *path;
+  int len;
 
-    if (editor.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if (isdigit(c) && ((prev_sep || prev_hl == HL_NUMBER) ||
-                         (c == '.' && prev_hl == HL_NUMBER))) {
-        row->highlight[i] = HL_NUMBER;
-        i++;
-        prev_sep = false;
-        continue;
-      }
-    }
+  if (base != NULL && base[0] != '\0')
+    len = asprintf(&path, "%s/kilo/%s", base, name);
+  else if (home != NULL && home[0] != '\0')
+    len = asprintf(&path, "%s/%s/kilo/%s", home, fallback, name);
+  else
+    return (NULL);
+  if (len == -1)
+    die("asprintf");
 
-    if (prev_sep && editor.syntax->keywords != NULL) {
-      char **keywords = editor.syntax->keywords;
-      int j = 0;
+  return (path);
+}
 
-      while (keywords[j] != NULL) {
-        int keyword_len = strlen(keywords[j]);
-        int is_keyword2 = keywords[j][keyword_len - 1] == '|';
+static int syntax_filter(const struct dirent *d) {
+  size_t len = strlen(d->d_name), suffix_len = strlen(KILO_SYNTAX_SUFFIX);
 
-        if (is_keyword2)
-          keyword_len--;
+  return (len > suffix_len &&
+          strcmp(&d->d_name[len - suffix_len], KILO_SYNTAX_SUFFIX) == 0);
+}
 
-        if (strncmp(&row->render[i], keywords[j], keyword_len) == 0 &&
-            is_separator(row->render[i + keyword_len])) {
-          memset(&row->highlight[i], is_keyword2 ? HL_KEYWORD2 : HL_KEYWORD1,
-                 keyword_len);
-          i += keyword_len;
-          break;
+/* The next word of the line at `*p`, or NULL at its end. */
+static char *syntax_word(char **p) {
+  char *word;
+
+  while ((word = strsep(p, " \t\r\n")) != NULL && *word == '\0')
+    ;
+
+  return (word);
+}
+
+static void syntax_list_add(char ***list, int *num, const char *word,
+                            bool is_keyword2) {
+  if ((*list = realloc(*list, (*num + 2) * sizeof(**list))) == NULL)
+    die("realloc");
+  if (asprintf(&(*list)[*num], "%s%s", word, is_keyword2 ? "|" : "") == -1)
+    die("asprintf");
+  (*list)[++*num] = NULL;
+}
+
+/* Set `*field` to the one word left on the line, or fail. */
+static bool syntax_set(char **field, char **p) {
+  char *word = syntax_word(p);
+
+  if (word == NULL || syntax_word(p) != NULL)
+    return (false);
+
+  free(*field);
+  if ((*field = strdup(word)) == NULL)
+    die("strdup");
+
+  return (true);
+}
+
+/*
+ * Read the definition file `name` in `dir_fd` into `def`.  Every line is a
+ * directive followed by its words, and lines starting with # are left out:
+ *
+ *   filetype  NAME         the name shown in the status bar
+ *   match     NAME...      extensions, with their dot, and file names
+ *   keywords  WORD...      highlighted as keywords
+ *   types     WORD...      highlighted as HL_KEYWORD2, like `int` in C
+ *   comment   START        the start of a comment up to the end of the line
+ *   multiline START END    the delimiters of a comment that spans lines
+ *   quotes    BYTES        the bytes that start and end a string
+ *   highlight WHAT...      "numbers" and "strings"
+ *
+ * A definition that can't be read is left out, with the line at fault in the
+ * status message, and false is returned.
+ */
+static bool syntax_def_load(int dir_fd, const char *name,
+                            struct syntax_def *def) {
+  char *line = NULL, *directive = NULL, *word;
+  int fd, num_match = 0, num_keywords = 0, line_num = 0;
+  bool valid = true;
+  size_t capacity = 0;
+  FILE *fp;
+
+  memset(def, 0, sizeof(*def));
+  if ((fd = openat(dir_fd, name, O_RDONLY)) == -1 ||
+      (fp = fdopen(fd, "r")) == NULL) {
+    editor_set_status_message("Skipped %s: %s", name, strerror(errno));
+    if (fd != -1)
+      close(fd);
+    return (false);
+  }
+
+  while (valid && getline(&line, &capacity, fp) != -1) {
+    char *p = line;
+
+    line_num++;
+    if (line[0] == '#' || (directive = syntax_word(&p)) == NULL)
+      continue;
+
+    if (strcmp(directive, "filetype") == 0)
+      valid = syntax_set(&def->file_type, &p);
+    else if (strcmp(directive, "comment") == 0)
+      valid = syntax_set(&def->single_line_comment_start, &p);
+    else if (strcmp(directive, "quotes") == 0)
+      valid = syntax_set(&def->quotes, &p);
+    else if (strcmp(directive, "multiline") == 0) {
+      char *start = syntax_word(&p);
+
+      valid = start != NULL && syntax_set(&def->multi_line_comment_end, &p);
+      if (valid) {
+        free(def->multi_line_comment_start);
+        if ((def->multi_line_comment_start = strdup(start)) == NULL)
+          die("strdup");
+      }
+    } else if (strcmp(directive, "match") == 0) {
+      while ((word = syntax_word(&p)) != NULL)
+        syntax_list_add(&def->file_match, &num_match, word, false);
+    } else if (strcmp(directive, "keywords") == 0 ||
+               strcmp(directive, "types") == 0) {
+      bool is_keyword2 = directive[0] == 't';
+
+      while ((word = syntax_word(&p)) != NULL)
+        syntax_list_add(&def->keywords, &num_keywords, word, is_keyword2);
+    } else if (strcmp(directive, "highlight") == 0) {
+      while (valid && (word = syntax_word(&p)) != NULL) {
+        if (strcmp(word, "numbers") == 0)
+          def->flags |= HL_HIGHLIGHT_NUMBERS;
+        else if (strcmp(word, "strings") == 0)
+          def->flags |= HL_HIGHLIGHT_STRINGS;
+        else
+          valid = false;
+      }
+    } else
+      valid = false;
+  }
+  if (ferror(fp)) {
+    editor_set_status_message("Skipped %s: %s", name, strerror(errno));
+    valid = false;
+  } else if (valid && def->file_type == NULL) {
+    editor_set_status_message("Skipped %s: no filetype", name);
+    valid = false;
+  } else if (!valid)
+    editor_set_status_message("Skipped %s:%d: bad %s", name, line_num,
+                              directive);
+  fclose(fp);
+  free(line);
+
+  if (!valid) {
+    syntax_def_free(def);
+    memset(def, 0, sizeof(*def));
+  }
+  return (valid);
+}
+
+static void syntax_def_free(struct syntax_def *def) {
+  for (char **m = def->file_match; m != NULL && *m != NULL; m++)
+    free(*m);
+  for (char **k = def->keywords; k != NULL && *k != NULL; k++)
+    free(*k);
+  free(def->file_match);
+  free(def->keywords);
+  free(def->file_type);
+  free(def->single_line_comment_start);
+  free(def->multi_line_comment_start);
+  free(def->multi_line_comment_end);
+  free(def->quotes);
+}
+
+static uint64_t syntax_def_hash(uint64_t h, const struct syntax_def *def) {
+  h = hash_string(h, def->file_type);
+  for (char **m = def->file_match; m != NULL && *m != NULL; m++)
+    h = hash_string(h, *m);
+  h = hash_string(h, "");
+  for (char **k = def->keywords; k != NULL && *k != NULL; k++)
+    h = hash_string(h, *k);
+  h = hash_string(h, "");
+  h = hash_string(h, def->single_line_comment_start);
+  h = hash_string(h, def->multi_line_comment_start);
+  h = hash_string(h, def->multi_line_comment_end);
+  h = hash_string(h, def->quotes);
+
+  return (hash_bytes(h, &def->flags, sizeof(def->flags)));
+}
+
+/*
+ * The cache key of the files in `names`, after dropping those that are no
+ * regular file, like a directory or a dangling symlink, with a note in the
+ * status message.
+ */
+static uint64_t syntax_key(int dir_fd, struct dirent **names, int *num) {
+  uint64_t key = hash_string(HASH_INIT, KILO_SYNTAX_MAGIC);
+  int n = 0;
+
+  for (int i = 0; i < *num; i++) {
+    struct stat st;
+
+    errno = 0;
+    if (fstatat(dir_fd, names[i]->d_name, &st, 0) == -1 ||
+        !S_ISREG(st.st_mode)) {
+      editor_set_status_message("Skipped %s: %s", names[i]->d_name,
+                                errno != 0 ? strerror(errno)
+                                           : "not a regular file");
+      free(names[i]);
+      continue;
+    }
+    key = hash_string(key, names[i]->d_name);
+    key = hash_bytes(key, &st.st_size, sizeof(st.st_size));
+    key = hash_bytes(key, &st.st_mtim, sizeof(st.st_mtim));
+    names[n++] = names[i];
+  }
+  *num = n;
+
+  for (size_t i = 0; i < nitems(highlight_db); i++)
+    key = syntax_def_hash(key, &highlight_db[i]);
+
+  return (key);
+}
+
+/* Append `len` bytes to the image, aligned for the tables, at their offset. */
+static uint32_t syntax_image_put(struct sbuf *sb, const void *p, size_t len) {
+  static const char pad[sizeof(int32_t)];
+  uint32_t off;
+
+  sbuf_bcat(sb, pad, (sizeof(pad) - sbuf_len(sb) % sizeof(pad)) % sizeof(pad));
+  off = sbuf_len(sb);
+  sbuf_bcat(sb, p, len);
+
+  return (off);
+}
+
+static uint32_t syntax_image_string(struct sbuf *sb, const char *s) {
+  return (s == NULL ? 0 : syntax_image_put(sb, s, strlen(s) + 1));
+}
+
+/*
+ * Compile the `num` definitions into an image in `sb`.  Where several of
+ * them match the same extension or file name, the first one gets it.
+ */
+static void syntax_image_build(struct sbuf *sb, const struct syntax_def *defs,
+                               int num, uint64_t key) {
+  struct syntax_header header = {.key = key, .num_syntaxes = num};
+  struct syntax_record *records;
+  struct syntax_slot *slots;
+  const char **slot_names;
+  uint32_t num_names = 0, mask;
+
+  for (int i = 0; i < num; i++) {
+    for (char **m = defs[i].file_match; m != NULL && *m != NULL; m++)
+      num_names++;
+  }
+  for (header.num_slots = 1; header.num_slots < 2 * num_names;)
+    header.num_slots *= 2;
+  mask = header.num_slots - 1;
+
+  if ((records = calloc(MAX(num, 1), sizeof(*records))) == NULL ||
+      (slots = calloc(header.num_slots, sizeof(*slots))) == NULL ||
+      (slot_names = calloc(header.num_slots, sizeof(*slot_names))) == NULL)
+    die("calloc");
+
+  sbuf_bcat(sb, &header, sizeof(header));
+  for (int i = 0; i < num; i++) {
+    struct syntax_record *r = &records[i];
+    struct editor_syntax syntax;
+    struct keyword_trie *trie = &syntax.trie;
+
+    editor_syntax_compile(&defs[i], &syntax);
+    r->file_type = syntax_image_string(sb, syntax.file_type);
+    r->slcs = syntax_image_string(sb, syntax.single_line_comment_start);
+    r->mlcs = syntax_image_string(sb, syntax.multi_line_comment_start);
+    r->mlce = syntax_image_string(sb, syntax.multi_line_comment_end);
+    r->quotes = syntax_image_string(sb, syntax.quotes);
+    r->flags = syntax.flags;
+    r->lookback = syntax.lookback;
+    r->num_classes = trie->num_classes;
+    r->num_nodes = trie->num_nodes;
+    memcpy(r->byte_class, trie->byte_class, sizeof(r->byte_class));
+    r->next = syntax_image_put(sb, trie->next, sizeof(*trie->next) *
+                                                   trie->num_nodes *
+                                                   trie->num_classes);
+    r->kind =
+        syntax_image_put(sb, trie->kind, sizeof(*trie->kind) * trie->num_nodes);
+    free((void *)trie->next);
+    free((void *)trie->kind);
+
+    for (char **m = defs[i].file_match; m != NULL && *m != NULL; m++) {
+      uint32_t h = hash_bytes(HASH_INIT, *m, strlen(*m)), slot = h & mask;
+
+      while (slot_names[slot] != NULL && strcmp(slot_names[slot], *m) != 0)
+        slot = (slot + 1) & mask;
+      if (slot_names[slot] != NULL)
+        continue;
+
+      slot_names[slot] = *m;
+      slots[slot].hash = h;
+      slots[slot].name = syntax_image_string(sb, *m);
+      slots[slot].syntax = i;
+    }
+  }
+
+  header.syntaxes = syntax_image_put(sb, records, sizeof(*records) * num);
+  header.slots =
+      syntax_image_put(sb, slots, sizeof(*slots) * header.num_slots);
+  if (sbuf_finish(sb) == -1)
+    die("sbuf_finish");
+  memcpy(header.magic, KILO_SYNTAX_MAGIC, sizeof(header.magic));
+  header.size = sbuf_len(sb);
+  memcpy(sbuf_data(sb), &header, sizeof(header));
+
+  free(records);
+  free(slots);
+  free(slot_names);
+}
+
+/* Map the image cached at `path`, unless it is not the one for `key`. */
+static bool syntax_image_map(const char *path, uint64_t key) {
+  const struct syntax_header *header;
+  struct stat st;
+  void *image;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) == -1)
+    return (false);
+  if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(*header)) {
+    close(fd);
+    return (false);
+  }
+  image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED)
+    return (false);
+
+  header = image;
+  if (memcmp(header->magic, KILO_SYNTAX_MAGIC, sizeof(header->magic)) != 0 ||
+      header->key != key || header->size != (uint64_t)st.st_size ||
+      header->num_slots == 0 ||
+      (header->num_slots & (header->num_slots - 1)) != 0 ||
+      header->syntaxes + (uint64_t)header->num_syntaxes *
+                             sizeof(struct syntax_record) > header->size ||
+      header->slots + (uint64_t)header->num_slots *
+                          sizeof(struct syntax_slot) > header->size) {
+    munmap(image, st.st_size);
+    return (false);
+  }
+
+  editor.syntax.image = image;
+  editor.syntax.size = st.st_size;
+  editor.syntax.mapped = true;
+  return (true);
+}
+
+/*
+ * Write the image out to the cache at `path`, making its directories as
+ * needed.  The cache only saves time, so failing to write it is no error.
+ */
+static void syntax_image_save(char *path, const char *image, size_t size) {
+  char *tmp;
+  bool written;
+  int fd;
+
+  for (char *p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+    *p = '\0';
+    mkdir(path, 0755);
+    *p = '/';
+  }
+
+  if (asprintf(&tmp, "%s.XXXXXX", path) == -1)
+    die("asprintf");
+  if ((fd = mkstemp(tmp)) != -1) {
+    written = write(fd, image, size) == (ssize_t)size;
+    if (close(fd) == -1 || !written || rename(tmp, path) == -1)
+      unlink(tmp);
+  }
+  free(tmp);
+}
+
+/*
+ * Set up the syntaxes: the *.syntax files of $KILO_SYNTAX, or else of the
+ * kilo/syntax directory of $XDG_CONFIG_HOME or ~/.config, followed by those
+ * of highlight_db.  Their compiled image is cached in kilo/syntax.cache of
+ * $XDG_CACHE_HOME or ~/.cache, under a key made of the names, sizes and
+ * modification times of the files.  While that matches, startup takes a
+ * stat(2) per file and an mmap(2), and nothing is read or compiled until a
+ * file needs its syntax.  Files that can't be used are skipped and left out
+ * of the key, so that the image is built again until they are fixed.
+ */
+static void editor_syntax_load(void) {
+  struct syntax_table *table = &editor.syntax;
+  const char *env = getenv("KILO_SYNTAX");
+  struct dirent **names = NULL;
+  uint64_t key = HASH_INIT;
+  int dir_fd = -1, num = 0;
+  char *dir, *cache;
+
+  if (env != NULL) {
+    if ((dir = strdup(env)) == NULL)
+      die("strdup");
+  } else
+    dir = syntax_path("XDG_CONFIG_HOME", ".config", "syntax");
+  cache = syntax_path("XDG_CACHE_HOME", ".cache", "syntax.cache");
+
+  if (dir != NULL && (dir_fd = open(dir, O_RDONLY | O_DIRECTORY)) != -1 &&
+      (num = scandir(dir, &names, syntax_filter, alphasort)) == -1)
+    die("%s", dir);
+
+  key = syntax_key(dir_fd, names, &num);
+  if (cache == NULL || !syntax_image_map(cache, key)) {
+    struct syntax_def *defs =
+        calloc(num + nitems(highlight_db), sizeof(*defs));
+    struct sbuf *sb = sbuf_new_auto();
+    char *image;
+    int n = 0;
+
+    if (defs == NULL || sb == NULL)
+      die("calloc");
+    for (int i = 0; i < num; i++) {
+      if (syntax_def_load(dir_fd, names[i]->d_name, &defs[n]))
+        names[n++] = names[i];
+      else
+        free(names[i]);
+    }
+    if (n < num) {
+      num = n;
+      key = syntax_key(dir_fd, names, &num);
+    }
+    memcpy(&defs[n], highlight_db, sizeof(highlight_db));
+
+    syntax_image_build(sb, defs, n + nitems(highlight_db), key);
+    if ((image = malloc(sbuf_len(sb))) == NULL)
+      die("malloc");
+    memcpy(image, sbuf_data(sb), sbuf_len(sb));
+    table->image = image;
+    table->size = sbuf_len(sb);
+    table->mapped = false;
+    if (cache != NULL)
+      syntax_image_save(cache, table->image, table->size);
+
+    sbuf_delete(sb);
+    for (int i = 0; i < n; i++)
+      syntax_def_free(&defs[i]);
+    free(defs);
+  }
+
+  table->syntaxes =
+      calloc(MAX(((const struct syntax_header *)table->image)->num_syntaxes, 1),
+             sizeof(*table->syntaxes));
+  if (table->syntaxes == NULL)
+    die("calloc");
+
+  for (int i = 0; i < num; i++)
+    free(names[i]);
+  free(names);
+  if (dir_fd != -1)
+    close(dir_fd);
+  free(dir);
+  free(cache);
+}
+
+static const char *syntax_image_string_at(uint32_t off) {
+  return (off == 0 ? NULL : editor.syntax.image + off);
+}
+
+/* The syntax for files with the extension or the name `name`, if any. */
+static struct editor_syntax *editor_syntax_find(const char *name) {
+  struct syntax_table *table = &editor.syntax;
+  const struct syntax_header *header = (const void *)table->image;
+  const struct syntax_slot *slots =
+      (const void *)(table->image + header->slots);
+  const struct syntax_record *r;
+  struct editor_syntax *syntax;
+  uint32_t h = hash_bytes(HASH_INIT, name, strlen(name));
+  uint32_t mask = header->num_slots - 1, slot = h & mask;
+
+  for (; slots[slot].name != 0; slot = (slot + 1) & mask) {
+    if (slots[slot].hash == h &&
+        strcmp(table->image + slots[slot].name, name) == 0)
+      break;
+  }
+  if (slots[slot].name == 0)
+    return (NULL);
+
+  /* Unpack the record the first time that the syntax is used. */
+  syntax = &table->syntaxes[slots[slot].syntax];
+  if (syntax->file_type != NULL)
+    return (syntax);
+
+  r = (const struct syntax_record *)(table->image + header->syntaxes) +
+      slots[slot].syntax;
+  syntax->file_type = syntax_image_string_at(r->file_type);
+  syntax->single_line_comment_start = syntax_image_string_at(r->slcs);
+  syntax->multi_line_comment_start = syntax_image_string_at(r->mlcs);
+  syntax->multi_line_comment_end = syntax_image_string_at(r->mlce);
+  syntax->quotes = syntax_image_string_at(r->quotes);
+  syntax->flags = r->flags;
+  syntax->slcs_len = r->slcs == 0 ? 0 : strlen(table->image + r->slcs);
+  syntax->mlcs_len = r->mlcs == 0 ? 0 : strlen(table->image + r->mlcs);
+  syntax->mlce_len = r->mlce == 0 ? 0 : strlen(table->image + r->mlce);
+  syntax->lookback = r->lookback;
+  memcpy(syntax->trie.byte_class, r->byte_class, sizeof(r->byte_class));
+  syntax->trie.num_classes = r->num_classes;
+  syntax->trie.num_nodes = r->num_nodes;
+  syntax->trie.next = (const int *)(table->image + r->next);
+  syntax->trie.kind = (const enum editor_highlight *)(table->image + r->kind);
+
+  return (syntax);
+}
+
+/*
+ * Length of the longest keyword at the start of `s` that is followed by a
+ * separator, or 0 if there is none.  Its highlight is stored in `kind`.
+ */
+static int keyword_match(const struct keyword_trie *trie, const char *s,
+                         int len, enum editor_highlight *kind) {
+  int node = 0, match = 0;
+
+  for (int i = 0; i < len; i++) {
+    int class = trie->byte_class[(unsigned char)s[i]];
+
+    if (class == 0)
+      break;
+    node = trie->next[node * trie->num_classes + class - 1];
+    if (node == 0)
+      break;
+
+    if (trie->kind[node] != HL_NORMAL &&
+        is_separator(i + 1 < len ? s[i + 1] : '\0')) {
+      *kind = trie->kind[node];
+      match = i + 1;
+    }
+  }
+
+  return (match);
+}
+
+/*
+ * Lex `len` bytes of a row starting in state `in_comment` and return the state
+ * at the end of the row.  When `hl` is NULL only the state is tracked, which
+ * is all that is needed for rows that aren't displayed.  If `hl` holds the
+ * result of an earlier lex of the same text from offset `sync` on, lexing
+ * stops as soon as both agree on a separator outside of any token, as the
+ * rest can't differ, and LEX_CONVERGED is returned instead of the state.
+ */
+static int editor_lex(const char *s, int len, bool in_comment,
+                      enum editor_highlight *hl, int sync) {
+  int i = 0, slcs_len, mlcs_len, mlce_len;
+  bool prev_sep = true;
+  char quote = '\0';
+  const char *slcs = NULL, *mlcs = NULL, *mlce = NULL;
+  enum editor_highlight prev_hl = HL_NORMAL;
+
+  if (editor.buf->syntax == NULL) {
+    if (hl != NULL)
+      memset(hl, HL_NORMAL, len);
+    return (false);
+  }
+
+  slcs = editor.buf->syntax->single_line_comment_start;
+  mlcs = editor.buf->syntax->multi_line_comment_start;
+  mlce = editor.buf->syntax->multi_line_comment_end;
+
+  slcs_len = editor.buf->syntax->slcs_len;
+  mlcs_len = editor.buf->syntax->mlcs_len;
+  mlce_len = editor.buf->syntax->mlce_len;
+
+  while (i < len) {
+    char c = s[i];
+
+    if (slcs_len != 0 && quote == '\0' && !in_comment &&
+        starts_with(&s[i], len - i, slcs, slcs_len)) {
+      if (hl != NULL)
+        memset(&hl[i], HL_COMMENT, len - i);
+      break;
+    }
+
+    if (mlcs_len != 0 && mlce_len != 0 && quote == '\0') {
+      if (in_comment) {
+        prev_hl = HL_MLCOMMENT;
+        if (starts_with(&s[i], len - i, mlce, mlce_len)) {
+          if (hl != NULL)
+            memset(&hl[i], HL_MLCOMMENT, mlce_len);
+          i += mlce_len;
+          in_comment = false;
+          prev_sep = true;
+          continue;
+        } else {
+          if (hl != NULL)
+            hl[i] = HL_MLCOMMENT;
+          i++;
+          continue;
+        }
+      } else if (starts_with(&s[i], len - i, mlcs, mlcs_len)) {
+        if (hl != NULL)
+          memset(&hl[i], HL_MLCOMMENT, mlcs_len);
+        prev_hl = HL_MLCOMMENT;
+        i += mlcs_len;
+        in_comment = true;
+        continue;
+      }
+    }
+
+    if (editor.buf->syntax->flags & HL_HIGHLIGHT_STRINGS) {
+      if (quote != '\0') {
+        prev_hl = HL_STRING;
+        if (hl != NULL)
+          hl[i] = HL_STRING;
+
+        if (c == '\\' && i + 1 < len) {
+          if (hl != NULL)
+            hl[i + 1] = HL_STRING;
+          i += 2;
+          continue;
         }
-        j++;
+
+        if (c == quote)
+          quote = '\0';
+
+        i++;
+        prev_sep = true;
+        continue;
+      } else if (c != '\0' &&
+                 strchr(editor.buf->syntax->quotes, c) != NULL) {
+        quote = c;
+        prev_hl = HL_STRING;
+        if (hl != NULL)
+          hl[i] = HL_STRING;
+        i++;
+        continue;
+      }
+    }
+
+    /* Numbers and keywords never change the state carried to the next row. */
+    if (hl == NULL) {
+      prev_sep = is_separator(c);
+      i++;
+      continue;
+    }
+
+    if (editor.buf->syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+      if (isdigit(c) && ((prev_sep || prev_hl == HL_NUMBER) ||
+                         (c == '.' && prev_hl == HL_NUMBER))) {
+        hl[i] = prev_hl = HL_NUMBER;
+        i++;
+        prev_sep = false;
+        continue;
       }
+    }
+
+    if (prev_sep) {
+      enum editor_highlight kind;
+      int keyword_len =
+          keyword_match(&editor.buf->syntax->trie, &s[i], len - i, &kind);
 
-      if (keywords[j] != NULL) {
+      if (keyword_len != 0) {
+        memset(&hl[i], kind, keyword_len);
+        prev_hl = kind;
+        i += keyword_len;
         prev_sep = false;
         continue;
       }
     }
 
+    if (i >= sync && hl[i] == HL_NORMAL && is_separator(c))
+      return (LEX_CONVERGED);
+
+    hl[i] = prev_hl = HL_NORMAL;
     prev_sep = is_separator(c);
     i++;
   }
 
-  bool changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->i + 1 < editor.num_rows)
-    editor_update_row(&editor.rows[row->i + 1]);
-}
-
-static int editor_syntax_to_color(enum editor_highlight hl) {
-  switch (hl) {
-  case HL_COMMENT:
-  case HL_MLCOMMENT:
-    return (36);
-  case HL_STRING:
-    return (35);
-  case HL_KEYWORD1:
-    return (33);
-  case HL_KEYWORD2:
-    return (32);
-  case HL_NUMBER:
-    return (31);
-  case HL_MATCH:
-    return (34);
-  default:
-    return (37);
+  return (in_comment);
+}
+
+/* Scratch room for the highlight of a row of `size` render columns. */
+static enum editor_highlight *editor_hl_buf(int size) {
+  if (size > editor.hl_buf_capacity) {
+    editor.hl_buf_capacity = MAX(size, editor.hl_buf_capacity * 2);
+    editor.hl_buf = realloc(editor.hl_buf, editor.hl_buf_capacity);
+    if (editor.hl_buf == NULL)
+      die("realloc");
   }
+
+  return (editor.hl_buf);
 }
 
-static void editor_select_syntax_highlight(void) {
-  char *extension = NULL;
+/* Length of the span that starts at `hl[at]`. */
+static int hl_run(const enum editor_highlight *hl, int at, int len) {
+  int run = 1;
+
+  while (run < HL_SPAN_MAX && at + run < len && hl[at + run] == hl[at])
+    run++;
+
+  return (run);
+}
+
+static void editor_row_hl_decode(struct editor_row *row,
+                                 enum editor_highlight *hl) {
+  for (int i = 0; i < row->num_hl_spans; i++) {
+    int len = HL_SPAN_LEN(row->hl_spans[i]);
+
+    memset(hl, HL_SPAN_HL(row->hl_spans[i]), len);
+    hl += len;
+  }
+}
+
+static void editor_row_hl_encode(struct editor_row *row,
+                                 const enum editor_highlight *hl, int len) {
+  int num_spans = 0;
+
+  for (int i = 0; i < len; i += hl_run(hl, i, len))
+    num_spans++;
+
+  row->hl_spans =
+      editor_row_grow(row->hl_spans, &row->hl_spans_capacity, 0,
+                      MAX(num_spans, 1));
+  row->num_hl_spans = 0;
+  for (int i = 0, run; i < len; i += run) {
+    run = hl_run(hl, i, len);
+    row->hl_spans[row->num_hl_spans++] = HL_SPAN(hl[i], run);
+  }
+}
+
+/*
+ * Replace the `old_len` highlighted columns at `at` with `new_len` normal
+ * ones, which are about to be lexed again, and shift the rest along.
+ */
+static void editor_row_hl_splice(struct editor_row *row, int at, int old_len,
+                                 int new_len) {
+  enum editor_highlight *hl;
+  int size = 0, tail;
+
+  for (int i = 0; i < row->num_hl_spans; i++)
+    size += HL_SPAN_LEN(row->hl_spans[i]);
+  old_len = MIN(old_len, size - at);
+  tail = size - at - old_len;
+
+  hl = editor_hl_buf(MAX(size, at + new_len + tail));
+  editor_row_hl_decode(row, hl);
+  memmove(&hl[at + new_len], &hl[at + old_len], tail);
+  memset(&hl[at], HL_NORMAL, new_len);
+  editor_row_hl_encode(row, hl, at + new_len + tail);
+}
+
+/*
+ * Lex the row again from the last separator that was highlighted as normal
+ * text far enough before the first edited column.  The lexer is in its
+ * initial state right after such a separator, so it can pick up from there.
+ */
+static void editor_update_syntax(int file_row) {
+  struct editor_row *row = editor_row_at(file_row);
+  enum editor_highlight *hl = editor_hl_buf(row->render_size);
+  bool in_comment = row->hl_in_comment;
+  int64_t start = stats_now();
+  int from = 0, state;
+
+  if (row->hl_spans == NULL) {
+    row->hl_from = 0;
+    row->hl_to = INT_MAX;
+  } else
+    editor_row_hl_decode(row, hl);
+
+  if (row->hl_from > 0) {
+    struct editor_syntax *syntax = editor.buf->syntax;
+    int lookback = syntax == NULL ? 1 : syntax->lookback;
+
+    for (from = row->hl_from - lookback; from > 0; from--) {
+      if (hl[from - 1] == HL_NORMAL &&
+          is_separator(row->render[from - 1]))
+        break;
+    }
+
+    if (from > 0)
+      in_comment = false;
+    else
+      from = 0;
+  }
+
+  state = editor_lex(&row->render[from], row->render_size - from, in_comment,
+                     &hl[from], row->hl_to - from);
+  editor_row_hl_encode(row, hl, row->render_size);
+  if (state != LEX_CONVERGED)
+    row->hl_open_comment = state;
+  row->hl_stale = false;
+  stats_add(STATS_SYNTAX, start);
+}
+
+/*
+ * Make sure the start state of `file_row` and the end states of all the rows
+ * above it are up to date.  Rows whose text and start state did not change
+ * since they were last lexed are skipped, so after an edit this only walks
+ * as far as the change in state actually propagates.  Rows above `file_row`
+ * are off screen and just have their state recomputed from `chars`.
+ */
+static void editor_update_hl_state(int file_row) {
+  struct text_store *ts = &editor.buf->text;
+
+  for (; ts->hl_valid <= file_row; ts->hl_valid++) {
+    struct editor_row *row = editor_row_at(ts->hl_valid);
+    bool in_comment = ts->hl_valid > 0 &&
+                      editor_row_at(ts->hl_valid - 1)->hl_open_comment;
+
+    if (row->hl_in_comment != in_comment) {
+      row->hl_in_comment = in_comment;
+      editor_row_touch(row, 0, INT_MAX, INT_MAX);
+    }
+
+    if (ts->hl_valid == file_row)
+      break;
+
+    if (row->hl_stale) {
+      row->hl_open_comment =
+          editor_lex(row->chars, row->size, row->hl_in_comment, NULL, INT_MAX);
+      row->hl_stale = false;
+      if (row->hl_spans != NULL)
+        arena_free(&ts->arena, row->hl_spans, row->hl_spans_capacity);
+      row->hl_spans = NULL;
+      row->num_hl_spans = row->hl_spans_capacity = 0;
+    }
+  }
+}
+
+static void *editor_hl_worker(void *arg) {
+  struct editor_hl_chunk *chunk = arg;
+  bool in_comment = false;
+
+  for (int file_row = chunk->from; file_row < chunk->to; file_row++) {
+    struct editor_row *row = text_store_at(&editor.buf->text, file_row);
+
+    in_comment =
+        editor_lex(row->chars, row->size, in_comment, NULL, INT_MAX);
+    chunk->open[file_row] = in_comment;
+  }
+
+  return (NULL);
+}
 
-  editor.syntax = NULL;
-  if (editor.file == NULL)
+/*
+ * Work out the lexer states of all the rows of a big file at once, with the
+ * rows split into a chunk per core.  Every chunk but the first may have
+ * guessed its start state wrong.  The chunks are then walked in order, and
+ * the rows of a chunk that started in the wrong state are lexed again, only
+ * until a row ends in the state that was guessed for it.  From there on, the
+ * guesses of the chunk are right.  This only computes the states, rows are
+ * still highlighted when they are drawn.
+ */
+static void editor_update_hl_state_all(void) {
+  struct text_store *ts = &editor.buf->text;
+  struct editor_hl_chunk chunks[KILO_HL_THREADS];
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int num_chunks = MIN(ts->num_rows / KILO_HL_CHUNK_ROWS,
+                       MIN(cpus, KILO_HL_THREADS));
+  bool *open, in_comment = false;
+
+  if (editor.buf->syntax == NULL || num_chunks < 2)
     return;
 
-  extension = strrchr(editor.file, '.');
+  if ((open = malloc(ts->num_rows * sizeof(*open))) == NULL)
+    die("malloc");
+
+  for (int i = 0; i < num_chunks; i++) {
+    chunks[i].from = (long)ts->num_rows * i / num_chunks;
+    chunks[i].to = (long)ts->num_rows * (i + 1) / num_chunks;
+    chunks[i].open = open;
+    if (i > 0 && (errno = pthread_create(&chunks[i].thread, NULL,
+                                         editor_hl_worker, &chunks[i])) != 0)
+      die("pthread_create");
+  }
+
+  editor_hl_worker(&chunks[0]);
+  for (int i = 1; i < num_chunks; i++) {
+    if ((errno = pthread_join(chunks[i].thread, NULL)) != 0)
+      die("pthread_join");
+  }
 
-  for (size_t i = 0; i < nitems(highlight_db); i++) {
-    struct editor_syntax *s = &highlight_db[i];
+  for (int i = 0; i < num_chunks; i++) {
+    bool guess = false;
 
-    for (size_t j = 0; s->file_match[j] != NULL; j++) {
-      bool is_extension = (s->file_match[j][0] == '.');
+    for (int file_row = chunks[i].from; file_row < chunks[i].to; file_row++) {
+      struct editor_row *row = text_store_at(ts, file_row);
+      bool end = open[file_row];
 
-      if ((is_extension && extension != NULL &&
-           strcmp(extension, s->file_match[i]) == 0) ||
-          (!is_extension && strstr(editor.file, s->file_match[i]) != NULL)) {
-        editor.syntax = s;
-        for (int file_row = 0; file_row < editor.num_rows; file_row++)
-          editor_update_syntax(&editor.rows[file_row]);
-        return;
+      if (in_comment != guess)
+        end = editor_lex(row->chars, row->size, in_comment, NULL, INT_MAX);
+      guess = open[file_row];
+
+      if (row->hl_in_comment != in_comment) {
+        row->hl_in_comment = in_comment;
+        editor_row_touch(row, 0, INT_MAX, INT_MAX);
       }
+      row->hl_open_comment = end;
+      if (row->hl_spans == NULL)
+        row->hl_stale = false;
+      in_comment = end;
     }
   }
+
+  ts->hl_valid = ts->num_rows;
+  free(open);
 }
 
-static int editor_row_cx_to_rx(struct editor_row *row, int cursor_x) {
-  int render_x = 0;
+static void editor_invalidate_syntax(void) {
+  for (int file_row = 0; file_row < editor.buf->text.num_rows; file_row++)
+    editor_row_touch(editor_row_at(file_row), 0, INT_MAX, INT_MAX);
 
-  for (int i = 0; i < cursor_x; i++) {
-    if (row->chars[i] == '\t')
-      render_x += (KILO_TAB_STOP - 1) - (render_x % KILO_TAB_STOP);
-    render_x++;
-  }
+  editor.buf->text.hl_valid = 0;
+  editor.buf->version++;
+}
 
-  return (render_x);
+/*
+ * Pick the syntax of the file by its name, or else by its extension, with
+ * a lookup in the hash table of the syntax image.
+ */
+static void editor_select_syntax_highlight(void) {
+  const char *name, *extension;
+
+  editor.buf->syntax = NULL;
+  if (editor.buf->file == NULL)
+    return;
+
+  name = strrchr(editor.buf->file, '/');
+  name = name == NULL ? editor.buf->file : name + 1;
+  extension = strrchr(name, '.');
+
+  editor.buf->syntax = editor_syntax_find(name);
+  if (editor.buf->syntax == NULL && extension != NULL)
+    editor.buf->syntax = editor_syntax_find(extension);
+
+  editor_invalidate_syntax();
+  if (editor.buf->syntax != NULL)
+    editor_update_hl_state_all();
 }
 
-static int editor_row_rx_to_cx(struct editor_row *row, int render_x) {
-  int cursor_x = 0, current_render_x = 0;
+/*
+ * Decode the UTF-8 sequence at the start of the `len` bytes at `s` into `*cp`
+ * and return its length.  A byte that doesn't start a valid sequence is taken
+ * on its own, as -1.
+ */
+static int utf8_decode(const char *s, int len, int *cp) {
+  const unsigned char *u = (const unsigned char *)s;
+  int n, min;
+
+  if (u[0] < 0x80) {
+    *cp = u[0];
+    return (1);
+  }
+
+  if (u[0] >= 0xc2 && u[0] < 0xe0) {
+    n = 2;
+    min = 0x80;
+  } else if (u[0] >= 0xe0 && u[0] < 0xf0) {
+    n = 3;
+    min = 0x800;
+  } else if (u[0] >= 0xf0 && u[0] < 0xf5) {
+    n = 4;
+    min = 0x10000;
+  } else
+    goto invalid;
 
-  while (cursor_x < row->size) {
-    if (row->chars[cursor_x] == '\t')
-      current_render_x +=
-          (KILO_TAB_STOP - 1) - (current_render_x % KILO_TAB_STOP);
-    current_render_x++;
+  if (n > len)
+    goto invalid;
 
-    if (current_render_x > render_x)
-      return (cursor_x);
+  *cp = u[0] & (0x7f >> n);
+  for (int i = 1; i < n; i++) {
+    if ((u[i] & 0xc0) != 0x80)
+      goto invalid;
+    *cp = *cp << 6 | (u[i] & 0x3f);
+  }
+
+  if (*cp < min || *cp > 0x10ffff || (*cp >= 0xd800 && *cp < 0xe000))
+    goto invalid;
+
+  return (n);
+
+invalid:
+  *cp = -1;
+  return (1);
+}
 
-    cursor_x++;
+static int utf8_encode(int cp, char *s) {
+  if (cp < 0x80) {
+    s[0] = cp;
+    return (1);
+  } else if (cp < 0x800) {
+    s[0] = 0xc0 | cp >> 6;
+    s[1] = 0x80 | (cp & 0x3f);
+    return (2);
+  } else if (cp < 0x10000) {
+    s[0] = 0xe0 | cp >> 12;
+    s[1] = 0x80 | (cp >> 6 & 0x3f);
+    s[2] = 0x80 | (cp & 0x3f);
+    return (3);
   }
 
-  return (cursor_x);
+  s[0] = 0xf0 | cp >> 18;
+  s[1] = 0x80 | (cp >> 12 & 0x3f);
+  s[2] = 0x80 | (cp >> 6 & 0x3f);
+  s[3] = 0x80 | (cp & 0x3f);
+  return (4);
 }
 
-static void editor_update_row(struct editor_row *row) {
-  int i = 0, tabs = 0;
+static bool width_range_find(const struct width_range *table, size_t n,
+                             int cp) {
+  size_t lo = 0, hi = n;
 
-  for (int j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t')
-      tabs++;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (table[mid].last < (uint32_t)cp)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
 
-  free(row->render);
-  row->render = malloc(row->size + tabs * (KILO_TAB_STOP - 1) + 1);
+  return (lo < n && table[lo].first <= (uint32_t)cp);
+}
 
-  for (int j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[i++] = ' ';
-      while (i % KILO_TAB_STOP != 0)
-        row->render[i++] = ' ';
-    } else
-      row->render[i++] = row->chars[j];
+/* Columns taken by `cp`, counting an invalid byte (-1) as one. */
+static int utf8_width(int cp) {
+  if (cp < 0x300)
+    return (1);
+
+  if (width_range_find(zero_width_chars, nitems(zero_width_chars), cp))
+    return (0);
+
+  if (width_range_find(wide_chars, nitems(wide_chars), cp))
+    return (2);
+
+  return (1);
+}
+
+/* Start of the character that ends at `at`. */
+static int utf8_prev(const char *s, int at) {
+  int i = at - 1, cp;
+
+  while (i > 0 && at - i < 4 && ((unsigned char)s[i] & 0xc0) == 0x80)
+    i--;
+
+  return (utf8_decode(&s[i], at - i, &cp) == at - i ? i : at - 1);
+}
+
+/* Start of the character `at` is in, out of the `len` bytes at `s`. */
+static int utf8_start(const char *s, int len, int at) {
+  int i = at, cp;
+
+  if (at >= len)
+    return (at);
+
+  while (i > 0 && at - i < 3 && ((unsigned char)s[i] & 0xc0) == 0x80)
+    i--;
+
+  return (i + utf8_decode(&s[i], len - i, &cp) > at ? i : at);
+}
+
+/* Whether none of the `len` bytes at `s` has the high bit set. */
+static bool text_is_ascii(const char *s, size_t len) {
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  for (; i + 16 <= len; i += 16) {
+    if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)&s[i])) != 0)
+      return (false);
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 16 <= len; i += 16) {
+    uint64x2_t v = vreinterpretq_u64_u8(vld1q_u8((const uint8_t *)&s[i]));
+
+    if (((vgetq_lane_u64(v, 0) | vgetq_lane_u64(v, 1)) &
+         UINT64_C(0x8080808080808080)) != 0)
+      return (false);
   }
+#endif
 
-  row->render[i] = '\0';
-  row->render_size = i;
+  for (; i < len; i++) {
+    if ((unsigned char)s[i] >= 0x80)
+      return (false);
+  }
 
-  editor_update_syntax(row);
+  return (true);
 }
 
-static void editor_insert_row(int at, const char *s, size_t len) {
-  if (at < 0 || at > editor.num_rows)
-    return;
+/* Render column reached by expanding `chars[from..to)` from `render_x`. */
+static int render_width(const char *chars, int from, int to, int render_x) {
+  int cp;
+
+  for (int i = from; i < to;) {
+    if (chars[i] == '\t') {
+      render_x += KILO_TAB_STOP - (render_x % KILO_TAB_STOP);
+      i++;
+    } else if ((unsigned char)chars[i] < 0x80) {
+      render_x++;
+      i++;
+    } else {
+      i += utf8_decode(&chars[i], to - i, &cp);
+      render_x += utf8_width(cp);
+    }
+  }
 
-  editor.rows =
-      realloc(editor.rows, sizeof(struct editor_row) * (editor.num_rows + 1));
-  memmove(&editor.rows[at + 1], &editor.rows[at],
-          sizeof(struct editor_row) * (editor.num_rows - at));
-  for (int i = at + 1; i <= editor.num_rows; i++)
-    editor.rows[i].i++;
+  return (render_x);
+}
 
-  editor.rows[at].i = at;
+/* Number of glyphs that end at or before `cursor_x`. */
+static int editor_row_glyphs_before(struct editor_row *row, int cursor_x) {
+  int lo = 0, hi = row->num_glyphs;
 
-  editor.rows[at].size = len;
-  editor.rows[at].chars = malloc(len + 1);
-  memcpy(editor.rows[at].chars, s, len);
-  editor.rows[at].chars[len] = '\0';
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
 
-  editor.rows[at].render_size = 0;
-  editor.rows[at].render = NULL;
-  editor.rows[at].highlight = NULL;
-  editor.rows[at].hl_open_comment = false;
-  editor_update_row(&editor.rows[at]);
+    if (row->glyphs[mid].cursor_x <= cursor_x)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
 
-  editor.num_rows++;
-  editor.dirty++;
+  return (lo);
 }
 
-static void editor_free_row(struct editor_row *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->highlight);
+static int editor_row_cx_to_rx(struct editor_row *row, int cursor_x) {
+  struct editor_glyph *glyph;
+  int k;
+
+  if (row->render == NULL)
+    return (render_width(row->chars, 0, cursor_x, 0));
+
+  if ((k = editor_row_glyphs_before(row, cursor_x)) == 0)
+    return (cursor_x);
+
+  glyph = &row->glyphs[k - 1];
+  return (glyph->render_x + (cursor_x - glyph->cursor_x));
 }
 
-static void editor_del_row(int at) {
-  if (at < 0 || at >= editor.num_rows)
-    return;
+/* Byte of the character that starts at render column `render_x`. */
+static int editor_row_rx_to_cx(struct editor_row *row, int render_x) {
+  struct editor_glyph *glyph;
+  int lo = 0, hi = row->num_glyphs;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
 
-  editor_free_row(&editor.rows[at]);
-  memmove(&editor.rows[at], &editor.rows[at + 1],
-          sizeof(struct editor_row) * (editor.num_rows - at - 1));
+    if (row->glyphs[mid].render_x <= render_x)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
 
-  for (int i = at; i < editor.num_rows - 1; i++)
-    editor.rows[i].i--;
+  if (lo == 0)
+    return (render_x);
 
-  editor.num_rows--;
-  editor.dirty++;
+  glyph = &row->glyphs[lo - 1];
+  return (glyph->cursor_x + (render_x - glyph->render_x));
 }
 
-static void editor_row_append_string(struct editor_row *row, const char *s,
-                                     size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
 
-  editor_update_row(row);
-  editor.dirty++;
+/*
+ * Grow an arena block to hold at least `size` bytes, keeping the first `used`
+ * ones.
+ */
+static void *editor_row_grow(void *p, int *capacity, int used, int size) {
+  size_t new_capacity;
+  void *q;
+
+  if (size <= *capacity)
+    return (p);
+
+  q = arena_alloc(&editor.buf->text.arena, size, &new_capacity);
+  if (p != NULL) {
+    memcpy(q, p, used);
+    arena_free(&editor.buf->text.arena, p, *capacity);
+  }
+  *capacity = new_capacity;
+
+  return (q);
 }
 
-static void editor_row_insert_char(struct editor_row *row, int at, char c) {
-  if (at < 0 || at > row->size)
+static void editor_row_add_glyph(struct editor_row *row, int cursor_x,
+                               int render_x) {
+  row->glyphs = editor_row_grow(row->glyphs, &row->glyphs_capacity,
+                              sizeof(*row->glyphs) * row->num_glyphs,
+                              sizeof(*row->glyphs) * (row->num_glyphs + 1));
+  row->glyphs[row->num_glyphs].cursor_x = cursor_x;
+  row->glyphs[row->num_glyphs].render_x = render_x;
+  row->num_glyphs++;
+}
+
+/*
+ * Expand `chars[from..to)` into the render starting at `render_x`.  The glyph
+ * index must already have been cut back to the glyphs before `from`.
+ */
+static int editor_row_expand(struct editor_row *row, int from, int to,
+                             int render_x) {
+  int cp, len, width;
+
+  for (int j = from; j < to;) {
+    if (row->chars[j] == '\t') {
+      row->render[render_x++] = ' ';
+      while (render_x % KILO_TAB_STOP != 0)
+        row->render[render_x++] = ' ';
+      editor_row_add_glyph(row, ++j, render_x);
+    } else if ((unsigned char)row->chars[j] < 0x80)
+      row->render[render_x++] = row->chars[j++];
+    else {
+      len = utf8_decode(&row->chars[j], to - j, &cp);
+      width = utf8_width(cp);
+      for (int i = 0; i < width; i++)
+        row->render[render_x++] = i == 0 ? RENDER_GLYPH : RENDER_WIDE;
+      j += len;
+      if (len != width)
+        editor_row_add_glyph(row, j, render_x);
+    }
+  }
+
+  return (render_x);
+}
+
+/*
+ * Record that the render columns `[from, old_to)` were replaced by
+ * `[from, new_to)`, widening the range that has to be lexed again.
+ */
+static void editor_row_touch(struct editor_row *row, int from, int old_to,
+                             int new_to) {
+  if (!row->hl_stale) {
+    row->hl_from = from;
+    row->hl_to = new_to;
+  } else {
+    row->hl_from = MIN(row->hl_from, from);
+    if (row->hl_to != INT_MAX)
+      row->hl_to = row->hl_to >= old_to ? row->hl_to + (new_to - old_to)
+                                        : MAX(row->hl_to, new_to);
+  }
+
+  row->hl_stale = true;
+}
+
+/* Render the row from `chars[at]` on, keeping what comes before. */
+static void editor_row_render_from(struct editor_row *row, int at) {
+  int tabs = 0, render_x = editor_row_cx_to_rx(row, at);
+
+  for (int j = at; j < row->size; j++) {
+    if (row->chars[j] == '\t')
+      tabs++;
+  }
+
+  row->render = editor_row_grow(
+      row->render, &row->render_capacity, render_x,
+      render_x + (row->size - at) + tabs * (KILO_TAB_STOP - 1) + 1);
+  row->num_glyphs = editor_row_glyphs_before(row, at);
+  row->render_size = editor_row_expand(row, at, row->size, render_x);
+  row->render[row->render_size] = '\0';
+
+  if (row->hl_spans != NULL)
+    editor_row_hl_splice(row, render_x, INT_MAX, row->render_size - render_x);
+  editor_row_touch(row, render_x, INT_MAX, INT_MAX);
+}
+
+static void editor_update_row(int file_row) {
+  editor_row_render_from(editor_row_at(file_row), 0);
+
+  if (editor.buf->text.hl_valid > file_row)
+    editor.buf->text.hl_valid = file_row;
+}
+
+/*
+ * Update the render of a row after the `len` bytes of text at `at` changed.
+ * The text before and after them must not have changed since the render was
+ * last updated.  If the text after the edit is ASCII without tabs, the rest of
+ * the render and its highlight are just shifted in place, otherwise the rest
+ * has to be expanded again from the edit point on.
+ */
+static void editor_update_row_edit(int file_row, int at, int len) {
+  struct editor_row *row = editor_row_at(file_row);
+  int k = editor_row_glyphs_before(row, at), tail, render_x, old_tail, new_tail;
+  int from = MAX(at - 3, k == 0 ? 0 : row->glyphs[k - 1].cursor_x);
+
+  /*
+   * The edit may have joined or split the multibyte character before it,
+   * which starts at most three bytes back, after the last glyph.
+   */
+  for (; at > from && (unsigned char)row->chars[at - 1] >= 0x80; at--)
+    len++;
+  tail = row->size - at - len;
+
+  if (row->render == NULL ||
+      memchr(&row->chars[at + len], '\t', tail) != NULL ||
+      !text_is_ascii(&row->chars[at + len], tail)) {
+    if (row->render == NULL)
+      at = 0;
+    editor_row_render_from(row, at);
+  } else {
+    render_x = editor_row_cx_to_rx(row, at);
+    new_tail = render_width(row->chars, at, at + len, render_x);
+    old_tail = row->render_size - tail;
+
+    row->render = editor_row_grow(row->render, &row->render_capacity,
+                                  row->render_size + 1, new_tail + tail + 1);
+    memmove(&row->render[new_tail], &row->render[old_tail], tail + 1);
+    if (row->hl_spans != NULL)
+      editor_row_hl_splice(row, render_x, old_tail - render_x,
+                           new_tail - render_x);
+
+    row->num_glyphs = editor_row_glyphs_before(row, at);
+    editor_row_expand(row, at, at + len, render_x);
+    row->render_size = new_tail + tail;
+    editor_row_touch(row, render_x, old_tail, new_tail);
+  }
+
+  editor_wrap_update(&editor.buf->text,
+                     text_store_slot(&editor.buf->text, file_row), row);
+  if (editor.buf->text.hl_valid > file_row)
+    editor.buf->text.hl_valid = file_row;
+  editor.buf->version++;
+}
+
+/*
+ * Rows are only rendered and highlighted once something needs to display or
+ * search them.
+ */
+static struct editor_row *editor_row_prepare(int file_row) {
+  struct editor_row *row = editor_row_at(file_row);
+
+  if (row->render == NULL)
+    editor_update_row(file_row);
+
+  editor_update_hl_state(file_row);
+  if (row->hl_stale || row->hl_spans == NULL)
+    editor_update_syntax(file_row);
+
+  if (editor.buf->text.hl_valid == file_row)
+    editor.buf->text.hl_valid++;
+
+  return (row);
+}
+
+static void editor_row_init(struct editor_row *row, char *chars, int size,
+                            int capacity) {
+  row->size = size;
+  row->chars = chars;
+  row->capacity = capacity;
+  row->render_capacity = row->hl_spans_capacity = row->glyphs_capacity = 0;
+  row->render_size = row->num_glyphs = row->num_hl_spans = 0;
+  row->render = NULL;
+  row->hl_spans = NULL;
+  row->glyphs = NULL;
+  row->hl_in_comment = row->hl_open_comment = false;
+  row->hl_from = 0;
+  row->hl_to = INT_MAX;
+  row->hl_stale = true;
+}
+
+static struct editor_row *editor_row_at(int at) {
+  return (text_store_at(&editor.buf->text, at));
+}
+
+static struct editor_row *text_store_at(struct text_store *ts, int at) {
+  return (&ts->rows[text_store_slot(ts, at)]);
+}
+
+/* The slot of `rows` that row `at` is kept in; `num_rows` maps past the end. */
+static int text_store_slot(struct text_store *ts, int at) {
+  if (at >= ts->gap)
+    at += ts->capacity - ts->num_rows;
+
+  return (at);
+}
+
+static void text_store_move_gap(struct text_store *ts, int at) {
+  int gap_len = ts->capacity - ts->num_rows;
+
+  editor_wrap_move_gap(ts, at);
+
+  if (at < ts->gap)
+    memmove(&ts->rows[at + gap_len], &ts->rows[at],
+            sizeof(struct editor_row) * (ts->gap - at));
+  else if (at > ts->gap)
+    memmove(&ts->rows[ts->gap], &ts->rows[ts->gap + gap_len],
+            sizeof(struct editor_row) * (at - ts->gap));
+
+  ts->gap = at;
+}
+
+static void text_store_reserve(struct text_store *ts, int capacity) {
+  int tail = ts->num_rows - ts->gap;
+
+  if (capacity <= ts->capacity)
+    return;
+
+  editor_wrap_reserve(ts, capacity);
+  ts->rows = realloc(ts->rows, sizeof(struct editor_row) * capacity);
+  if (ts->rows == NULL)
+    die("realloc");
+
+  memmove(&ts->rows[capacity - tail], &ts->rows[ts->capacity - tail],
+          sizeof(struct editor_row) * tail);
+  ts->capacity = capacity;
+}
+
+static struct editor_row *text_store_insert(struct text_store *ts, int at) {
+  if (ts->num_rows == ts->capacity)
+    text_store_reserve(ts, ts->capacity == 0 ? 64 : ts->capacity * 2);
+
+  text_store_move_gap(ts, at);
+  ts->gap++;
+  ts->num_rows++;
+
+  return (&ts->rows[at]);
+}
+
+static void text_store_delete(struct text_store *ts, int at) {
+  text_store_move_gap(ts, at);
+  editor_wrap_update(ts, text_store_slot(ts, at), NULL);
+  ts->num_rows--;
+}
+
+/* Give the borrowed rows copies of their own and drop the base. */
+static void text_store_own(struct text_store *ts) {
+  for (int i = 0; i < ts->num_rows; i++) {
+    struct editor_row *row = text_store_at(ts, i);
+    size_t capacity;
+    char *chars;
+
+    if (row->capacity != 0)
+      continue;
+
+    chars = arena_alloc(&ts->arena, row->size + 1, &capacity);
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    row->chars = chars;
+    row->capacity = capacity;
+  }
+
+  if (ts->base_mapped)
+    munmap(ts->base, ts->base_len);
+  else
+    free(ts->base);
+  ts->base = NULL;
+  ts->base_len = 0;
+  ts->base_mapped = false;
+}
+
+/* Drop all rows at once; their buffers all came from the store's arena. */
+static void text_store_free(struct text_store *ts) {
+  arena_release(&ts->arena);
+  free(ts->rows);
+
+  if (ts->base_mapped)
+    munmap(ts->base, ts->base_len);
+  else
+    free(ts->base);
+
+  ts->rows = NULL;
+  ts->num_rows = ts->capacity = ts->gap = ts->hl_valid = 0;
+  ts->base = NULL;
+  ts->base_len = 0;
+  ts->base_mapped = false;
+}
+
+static void arena_init(struct arena *a) {
+  for (int class = 0; class < ARENA_CLASSES; class++)
+    a->free[class] = NULL;
+  SLIST_INIT(&a->chunks);
+  LIST_INIT(&a->large);
+}
+
+static int arena_class(size_t size) {
+  int class = 0;
+
+  while (class < ARENA_CLASSES && ARENA_CLASS_SIZE(class) < size)
+    class++;
+
+  return (class);
+}
+
+static void *arena_alloc(struct arena *a, size_t size, size_t *capacity) {
+  struct arena_chunk *chunk;
+  int class = arena_class(size);
+  char *p;
+
+  editor.stats.frame[STATS_ALLOCS]++;
+
+  if (class == ARENA_CLASSES) {
+    struct arena_large *large;
+    size_t cap = ARENA_CLASS_SIZE(ARENA_CLASSES - 1);
+
+    while (cap < size)
+      cap *= 2;
+
+    if ((large = malloc(ARENA_LARGE_HEADER + cap)) == NULL)
+      die("malloc");
+
+    LIST_INSERT_HEAD(&a->large, large, link);
+    *capacity = cap;
+    return ((char *)large + ARENA_LARGE_HEADER);
+  }
+
+  *capacity = ARENA_CLASS_SIZE(class);
+
+  if (a->free[class] != NULL) {
+    struct arena_block *block = a->free[class];
+
+    a->free[class] = block->next;
+    return (block);
+  }
+
+  chunk = SLIST_FIRST(&a->chunks);
+  if (chunk == NULL || chunk->used + *capacity > ARENA_CHUNK_SIZE) {
+    /* Hand the tail of the current chunk to the free lists. */
+    while (chunk != NULL &&
+           ARENA_CHUNK_SIZE - chunk->used >= ARENA_CLASS_SIZE(0)) {
+      int tail = arena_class(ARENA_CHUNK_SIZE - chunk->used + 1) - 1;
+
+      arena_free(a, (char *)chunk + chunk->used, ARENA_CLASS_SIZE(tail));
+      chunk->used += ARENA_CLASS_SIZE(tail);
+    }
+
+    if ((chunk = malloc(ARENA_CHUNK_SIZE)) == NULL)
+      die("malloc");
+
+    chunk->used = ARENA_CHUNK_HEADER;
+    SLIST_INSERT_HEAD(&a->chunks, chunk, link);
+  }
+
+  p = (char *)chunk + chunk->used;
+  chunk->used += *capacity;
+
+  return (p);
+}
+
+static void arena_free(struct arena *a, void *p, size_t capacity) {
+  int class = arena_class(capacity);
+  struct arena_block *block = p;
+
+  if (class == ARENA_CLASSES) {
+    struct arena_large *large =
+        (struct arena_large *)((char *)p - ARENA_LARGE_HEADER);
+
+    LIST_REMOVE(large, link);
+    free(large);
+    return;
+  }
+
+  block->next = a->free[class];
+  a->free[class] = block;
+}
+
+static void arena_release(struct arena *a) {
+  struct arena_chunk *chunk;
+  struct arena_large *large;
+
+  while ((chunk = SLIST_FIRST(&a->chunks)) != NULL) {
+    SLIST_REMOVE_HEAD(&a->chunks, link);
+    free(chunk);
+  }
+
+  while ((large = LIST_FIRST(&a->large)) != NULL) {
+    LIST_REMOVE(large, link);
+    free(large);
+  }
+
+  for (int class = 0; class < ARENA_CLASSES; class++)
+    a->free[class] = NULL;
+}
+
+static void editor_insert_row(int at, const char *s, size_t len) {
+  size_t capacity;
+  char *chars;
+
+  if (at < 0 || at > editor.buf->text.num_rows)
+    return;
+
+  chars = arena_alloc(&editor.buf->text.arena, len + 1, &capacity);
+  memcpy(chars, s, len);
+  chars[len] = '\0';
+
+  editor_row_init(text_store_insert(&editor.buf->text, at), chars, len,
+                  capacity);
+  editor_wrap_update(&editor.buf->text, text_store_slot(&editor.buf->text, at),
+                     editor_row_at(at));
+  if (editor.buf->text.hl_valid > at)
+    editor.buf->text.hl_valid = at;
+
+  editor.buf->version++;
+  editor.buf->dirty++;
+}
+
+static void editor_free_row(struct editor_row *row) {
+  struct arena *a = &editor.buf->text.arena;
+
+  if (row->render != NULL)
+    arena_free(a, row->render, row->render_capacity);
+  if (row->capacity != 0)
+    arena_free(a, row->chars, row->capacity);
+  if (row->hl_spans != NULL)
+    arena_free(a, row->hl_spans, row->hl_spans_capacity);
+  if (row->glyphs != NULL)
+    arena_free(a, row->glyphs, row->glyphs_capacity);
+}
+
+static void editor_del_row(int at) {
+  if (at < 0 || at >= editor.buf->text.num_rows)
+    return;
+
+  editor_free_row(editor_row_at(at));
+  text_store_delete(&editor.buf->text, at);
+  if (editor.buf->text.hl_valid > at)
+    editor.buf->text.hl_valid = at;
+  editor.buf->version++;
+  editor.buf->dirty++;
+}
+
+/*
+ * Make sure the row owns a buffer of at least `size` bytes for its text,
+ * copying it out of the base on the first edit of a borrowed row.
+ */
+static void editor_row_reserve(struct editor_row *row, int size) {
+  size_t capacity;
+  char *chars;
+
+  if (size <= row->capacity)
+    return;
+
+  chars = arena_alloc(&editor.buf->text.arena, size, &capacity);
+  memcpy(chars, row->chars, row->size);
+  chars[row->size] = '\0';
+
+  if (row->capacity != 0)
+    arena_free(&editor.buf->text.arena, row->chars, row->capacity);
+
+  row->chars = chars;
+  row->capacity = capacity;
+}
+
+static void editor_row_append_string(int file_row, const char *s, size_t len) {
+  struct editor_row *row = editor_row_at(file_row);
+
+  editor_row_reserve(row, row->size + len + 1);
+  memcpy(&row->chars[row->size], s, len);
+  row->size += len;
+  row->chars[row->size] = '\0';
+
+  editor_update_row_edit(file_row, row->size - len, len);
+  editor.buf->dirty++;
+}
+
+static void editor_row_insert_string(int file_row, int at, const char *s,
+                                     size_t len) {
+  struct editor_row *row = editor_row_at(file_row);
+
+  if (at < 0 || at > row->size)
     at = row->size;
 
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  editor_update_row(row);
-  editor.dirty++;
+  editor_row_reserve(row, row->size + len + 1);
+  memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+  memcpy(&row->chars[at], s, len);
+  row->size += len;
+  editor_update_row_edit(file_row, at, len);
+  editor.buf->dirty++;
+}
+
+static void editor_row_insert_char(int file_row, int at, char c) {
+  editor_row_insert_string(file_row, at, &c, 1);
+}
+
+static void editor_row_del_string(int file_row, int at, size_t len) {
+  struct editor_row *row = editor_row_at(file_row);
+
+  if (at < 0 || at + len > (size_t)row->size)
+    return;
+
+  editor_row_reserve(row, row->size + 1);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  row->size -= len;
+  editor_update_row_edit(file_row, at, 0);
+  editor.buf->dirty++;
+}
+
+/* Cut the row off at `at`. */
+static void editor_row_truncate(int file_row, int at) {
+  struct editor_row *row = editor_row_at(file_row);
+
+  editor_row_reserve(row, row->size + 1);
+  row->size = at;
+  row->chars[row->size] = '\0';
+  editor_update_row_edit(file_row, at, 0);
+}
+
+static void editor_insert_char(char c) {
+  struct editor_window *w = editor.win;
+  bool new_row = w->cursor_y == editor.buf->text.num_rows;
+
+  editor_journal_insert(w->cursor_y, w->cursor_x, &c, 1, new_row);
+  if (new_row)
+    editor_insert_row(editor.buf->text.num_rows, "", 0);
+
+  editor_row_insert_char(w->cursor_y, w->cursor_x++, c);
+}
+
+static void editor_insert_newline(void) {
+  struct editor_window *w = editor.win;
+
+  editor_journal_insert(w->cursor_y, w->cursor_x, "\n", 1, false);
+
+  if (w->cursor_x == 0) {
+    editor_insert_row(w->cursor_y, "", 0);
+  } else {
+    struct editor_row *row = editor_row_at(w->cursor_y);
+
+    editor_insert_row(w->cursor_y + 1, &row->chars[w->cursor_x],
+                      row->size - w->cursor_x);
+    editor_row_truncate(w->cursor_y, w->cursor_x);
+  }
+  w->cursor_y++;
+  w->cursor_x = 0;
+}
+
+static const char *find_eol(const char *s, const char *end) {
+  for (; s < end; s++) {
+    if (*s == '\r' || *s == '\n')
+      return (s);
+  }
+
+  return (NULL);
+}
+
+static const char *skip_eol(const char *eol, const char *end) {
+  if (eol[0] == '\r' && eol + 1 < end && eol[1] == '\n')
+    return (eol + 2);
+
+  return (eol + 1);
+}
+
+/*
+ * Insert a block of text at the cursor in one go.  The first line is spliced
+ * into the cursor row, the following ones become new rows and whatever was
+ * after the cursor ends up at the end of the last line.  Each affected row is
+ * rendered once and highlighted lazily when it is displayed.
+ */
+static void editor_insert_text(const char *s, size_t len) {
+  struct editor_window *w = editor.win;
+  const char *end = s + len, *p, *eol;
+  struct editor_row *row;
+  bool new_row = w->cursor_y == editor.buf->text.num_rows;
+  int y;
+
+  editor.buf->journal.sealed = true;
+  editor_journal_insert(w->cursor_y, w->cursor_x, s, len, new_row);
+  editor.buf->journal.sealed = true;
+  if (new_row)
+    editor_insert_row(editor.buf->text.num_rows, "", 0);
+
+  if ((eol = find_eol(s, end)) == NULL) {
+    editor_row_insert_string(w->cursor_y, w->cursor_x, s, len);
+    w->cursor_x += len;
+    return;
+  }
+
+  row = editor_row_at(w->cursor_y);
+  editor_insert_row(w->cursor_y + 1, &row->chars[w->cursor_x],
+                    row->size - w->cursor_x);
+  editor_row_truncate(w->cursor_y, w->cursor_x);
+  editor_row_insert_string(w->cursor_y, w->cursor_x, s, eol - s);
+
+  y = w->cursor_y + 1;
+  for (p = skip_eol(eol, end); (eol = find_eol(p, end)) != NULL;
+       p = skip_eol(eol, end))
+    editor_insert_row(y++, p, eol - p);
+
+  editor_row_insert_string(y, 0, p, end - p);
+  w->cursor_y = y;
+  w->cursor_x = end - p;
+}
+
+static void editor_del_char(void) {
+  struct editor_window *w = editor.win;
+
+  if (w->cursor_y == editor.buf->text.num_rows)
+    return;
+
+  if (w->cursor_x == 0 && w->cursor_y == 0)
+    return;
+
+  if (w->cursor_x > 0) {
+    struct editor_row *row = editor_row_at(w->cursor_y);
+    int at = utf8_prev(row->chars, w->cursor_x);
+
+    editor_journal_delete(w->cursor_y, at, &row->chars[at], w->cursor_x - at);
+    editor_row_del_string(w->cursor_y, at, w->cursor_x - at);
+    w->cursor_x = at;
+  } else {
+    struct editor_row *row = editor_row_at(w->cursor_y);
+
+    editor_journal_delete(w->cursor_y - 1,
+                          editor_row_at(w->cursor_y - 1)->size, "\n", 1);
+    w->cursor_x = editor_row_at(w->cursor_y - 1)->size;
+    editor_row_append_string(w->cursor_y - 1, row->chars, row->size);
+    editor_del_row(w->cursor_y);
+    w->cursor_y--;
+  }
+}
+
+/*
+ * Delete the text from `y`, `x` up to `end_y`, `end_x`.  A range that ends
+ * past the last row takes whole rows from `y` on with it.
+ */
+static void editor_delete_range(int y, int x, int end_y, int end_x) {
+  if (end_y == editor.buf->text.num_rows) {
+    while (editor.buf->text.num_rows > y)
+      editor_del_row(y);
+  } else if (y == end_y) {
+    editor_row_del_string(y, x, end_x - x);
+  } else {
+    struct editor_row *last = editor_row_at(end_y);
+
+    editor_row_truncate(y, x);
+    editor_row_append_string(y, &last->chars[end_x], last->size - end_x);
+    for (int i = y; i < end_y; i++)
+      editor_del_row(y + 1);
+  }
+
+  editor.win->cursor_y = y;
+  editor.win->cursor_x = x;
+}
+
+/* Where `text` ends when it is inserted at `y`, `x`. */
+static void journal_text_end(int y, int x, const char *text, size_t len,
+                             int *end_y, int *end_x) {
+  const char *nl = memrchr(text, '\n', len);
+
+  *end_y = y;
+  *end_x = nl == NULL ? x + (int)len : (int)(&text[len] - nl - 1);
+  for (size_t i = 0; nl != NULL && i < len; i++) {
+    if (text[i] == '\n')
+      (*end_y)++;
+  }
+}
+
+/*
+ * Record the insert of `s` at `y`, `x`, which leaves the cursor at its end.
+ * Line ends are stored as newlines.  `new_row` is set when the insert adds
+ * a row before it is made.
+ */
+static void editor_journal_insert(int y, int x, const char *s, size_t len,
+                                  bool new_row) {
+  const char *end = s + len, *eol;
+  char *text, *p;
+  int end_y, end_x;
+
+  if (editor.buf->journal.replaying)
+    return;
+
+  /* Typing needs no copy: only line ends and an added row are rewritten. */
+  if (!new_row && memchr(s, '\r', len) == NULL) {
+    journal_text_end(y, x, s, len, &end_y, &end_x);
+    editor_journal_record(JOURNAL_INSERT, y, x, s, len, end_y, end_x);
+    return;
+  }
+
+  if ((text = p = malloc(len + 1)) == NULL)
+    die("malloc");
+  for (; (eol = find_eol(s, end)) != NULL; s = skip_eol(eol, end)) {
+    memcpy(p, s, eol - s);
+    p += eol - s;
+    *p++ = '\n';
+  }
+  memcpy(p, s, end - s);
+  p += end - s;
+
+  journal_text_end(y, x, text, p - text, &end_y, &end_x);
+  if (new_row)
+    *p++ = '\n';
+  editor_journal_record(JOURNAL_INSERT, y, x, text, p - text, end_y, end_x);
+  free(text);
+}
+
+/* Record that `s` is about to be deleted at `y`, `x`. */
+static void editor_journal_delete(int y, int x, const char *s, size_t len) {
+  if (!editor.buf->journal.replaying)
+    editor_journal_record(JOURNAL_DELETE, y, x, s, len, y, x);
+}
+
+static void editor_journal_record(enum journal_op op, int y, int x,
+                                  const char *text, size_t len, int end_y,
+                                  int end_x) {
+  struct editor_journal *j = &editor.buf->journal;
+  struct journal_edit *last = j->pos > j->first ? &j->edits[j->pos - 1] : NULL;
+  struct timespec now;
+  long elapsed;
+  bool grouped, append = false, prepend = false;
+  char prev = '\0';
+
+  editor_swap_log(op, y, x, text, len);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed = (now.tv_sec - j->last.tv_sec) * 1000 +
+            (now.tv_nsec - j->last.tv_nsec) / 1000000;
+
+  for (int i = j->pos; i < j->num; i++)
+    editor_journal_drop(&j->edits[i]);
+  j->num = j->pos;
+
+  grouped = last != NULL && !j->sealed && last->op == op &&
+            elapsed < KILO_UNDO_GROUP_MS;
+  if (grouped) {
+    int last_end_y, last_end_x, text_end_y, text_end_x;
+
+    journal_text_end(last->cursor_y, last->cursor_x, last->text, last->len,
+                     &last_end_y, &last_end_x);
+    journal_text_end(y, x, text, len, &text_end_y, &text_end_x);
+    if (op == JOURNAL_INSERT) {
+      grouped = editor.win->cursor_y == j->end_y &&
+                editor.win->cursor_x == j->end_x;
+      append = grouped && y == last_end_y && x == last_end_x;
+    } else {
+      append = y == last->cursor_y && x == last->cursor_x;
+      prepend = text_end_y == last->cursor_y && text_end_x == last->cursor_x;
+      grouped = append || prepend;
+    }
+
+    /* A word and the blanks after it go together. */
+    if (append)
+      prev = last->text[last->len - 1];
+    else if (prepend)
+      prev = last->text[0];
+    if (isspace(prev) && !isspace(prepend ? text[len - 1] : text[0]))
+      grouped = append = prepend = false;
+  }
+
+  if (append || prepend) {
+    if (last->len + len > last->capacity) {
+      size_t capacity;
+      char *grown = arena_alloc(&j->arena, last->len + len, &capacity);
+
+      memcpy(grown, last->text, last->len);
+      arena_free(&j->arena, last->text, last->capacity);
+      j->bytes += capacity - last->capacity;
+      last->text = grown;
+      last->capacity = capacity;
+    }
+
+    if (prepend) {
+      memmove(&last->text[len], last->text, last->len);
+      memcpy(last->text, text, len);
+      last->cursor_y = y;
+      last->cursor_x = x;
+    } else
+      memcpy(&last->text[last->len], text, len);
+    last->len += len;
+  } else {
+    struct journal_edit *edit;
+
+    if (j->num == j->capacity) {
+      j->capacity = j->capacity == 0 ? 64 : j->capacity * 2;
+      j->edits = realloc(j->edits, sizeof(*j->edits) * j->capacity);
+      if (j->edits == NULL)
+        die("realloc");
+    }
+
+    edit = &j->edits[j->num++];
+    edit->op = op;
+    edit->cursor_y = y;
+    edit->cursor_x = x;
+    edit->len = len;
+    edit->group_start = !grouped;
+    edit->text = arena_alloc(&j->arena, MAX(len, 1), &edit->capacity);
+    memcpy(edit->text, text, len);
+    j->bytes += sizeof(*edit) + edit->capacity;
+    j->pos = j->num;
+  }
+
+  j->end_y = end_y;
+  j->end_x = end_x;
+  j->last = now;
+  j->sealed = false;
+  editor_journal_trim();
+}
+
+static void editor_journal_drop(struct journal_edit *edit) {
+  editor.buf->journal.bytes -= sizeof(*edit) + edit->capacity;
+  arena_free(&editor.buf->journal.arena, edit->text, edit->capacity);
+}
+
+/*
+ * Drop the oldest groups while the journal is over its limit, keeping at
+ * least the last one.
+ */
+static void editor_journal_trim(void) {
+  struct editor_journal *j = &editor.buf->journal;
+
+  while (j->bytes > KILO_UNDO_LIMIT) {
+    int end = j->first + 1;
+
+    while (end < j->num && !j->edits[end].group_start)
+      end++;
+    if (end == j->num)
+      break;
+
+    for (; j->first < end; j->first++)
+      editor_journal_drop(&j->edits[j->first]);
+  }
+
+  if (j->first > j->num / 2) {
+    memmove(j->edits, &j->edits[j->first],
+            sizeof(*j->edits) * (j->num - j->first));
+    j->num -= j->first;
+    j->pos -= j->first;
+    j->first = 0;
+  }
+}
+
+/* Make `edit` again, or revert it if `undo` is set. */
+static void editor_journal_apply(struct journal_edit *edit, bool undo) {
+  editor_swap_log((edit->op == JOURNAL_INSERT) == undo ? JOURNAL_DELETE
+                                                        : JOURNAL_INSERT,
+                  edit->cursor_y, edit->cursor_x, edit->text, edit->len);
+
+  if ((edit->op == JOURNAL_INSERT) == undo) {
+    int end_y, end_x;
+
+    journal_text_end(edit->cursor_y, edit->cursor_x, edit->text, edit->len,
+                     &end_y, &end_x);
+    editor_delete_range(edit->cursor_y, edit->cursor_x, end_y, end_x);
+  } else {
+    size_t len = edit->len;
+
+    /* editor_insert_text() adds the row that the last newline stands for. */
+    if (edit->cursor_y == editor.buf->text.num_rows)
+      len--;
+    editor.win->cursor_y = edit->cursor_y;
+    editor.win->cursor_x = edit->cursor_x;
+    editor_insert_text(edit->text, len);
+  }
+}
+
+static void editor_undo(void) {
+  struct editor_journal *j = &editor.buf->journal;
+
+  if (j->pos == j->first) {
+    editor_set_status_message("Nothing to undo");
+    return;
+  }
+
+  j->replaying = true;
+  while (j->pos > j->first) {
+    struct journal_edit *edit = &j->edits[--j->pos];
+
+    editor_journal_apply(edit, true);
+    if (edit->group_start)
+      break;
+  }
+  j->replaying = false;
+  j->sealed = true;
+}
+
+static void editor_redo(void) {
+  struct editor_journal *j = &editor.buf->journal;
+
+  if (j->pos == j->num) {
+    editor_set_status_message("Nothing to redo");
+    return;
+  }
+
+  j->replaying = true;
+  do
+    editor_journal_apply(&j->edits[j->pos++], false);
+  while (j->pos < j->num && !j->edits[j->pos].group_start);
+  j->replaying = false;
+  j->sealed = true;
+}
+
+static void editor_journal_release(void) {
+  struct editor_journal *j = &editor.buf->journal;
+
+  for (int i = j->first; i < j->num; i++)
+    editor_journal_drop(&j->edits[i]);
+  arena_release(&j->arena);
+  free(j->edits);
+  j->edits = NULL;
+  j->first = j->pos = j->num = j->capacity = 0;
+}
+
+/* Whether `edit` can be made on the text as it is now. */
+static bool editor_journal_valid(const struct journal_edit *edit) {
+  int num_rows = editor.buf->text.num_rows, end_y, end_x;
+
+  if ((edit->op != JOURNAL_INSERT && edit->op != JOURNAL_DELETE) ||
+      edit->cursor_y < 0 || edit->cursor_y > num_rows || edit->cursor_x < 0)
+    return (false);
+
+  if (edit->cursor_y == num_rows)
+    return (edit->op == JOURNAL_INSERT && edit->cursor_x == 0 &&
+            edit->len != 0 && edit->text[edit->len - 1] == '\n');
+
+  if (edit->cursor_x > editor_row_at(edit->cursor_y)->size)
+    return (false);
+  if (edit->op == JOURNAL_INSERT)
+    return (true);
+
+  journal_text_end(edit->cursor_y, edit->cursor_x, edit->text, edit->len,
+                   &end_y, &end_x);
+  if (end_y == num_rows)
+    return (edit->cursor_x == 0 && end_x == 0);
+
+  return (end_y < num_rows && end_x <= editor_row_at(end_y)->size);
+}
+
+/*
+ * Look for a swap file of the file that was just loaded.  If it belongs to
+ * the same version of the file, or to one that has only grown since, the
+ * edits in it are made again, so recovering only costs as much as the edits
+ * did.  Otherwise it is removed, and the first edit starts a new one.
+ */
+static void editor_swap_open(const struct stat *st) {
+  struct editor_swap *swap = &editor.buf->swap;
+  struct swap_header header;
+  struct stat swap_st;
+  char *buf;
+  size_t end = 0;
+  int fd, recovered;
+
+  if (asprintf(&swap->path, "%s.swp", editor.buf->file) == -1)
+    die("asprintf");
+
+  if ((fd = open(swap->path, O_RDWR)) == -1) {
+    if (errno != ENOENT)
+      editor_swap_fail(swap, "open");
+    return;
+  }
+  if (!editor_swap_lock(swap, fd))
+    return;
+  if (fstat(fd, &swap_st) == -1) {
+    close(fd);
+    editor_swap_fail(swap, "open");
+    return;
+  }
+
+  if ((buf = malloc(MAX(swap_st.st_size, 1))) == NULL)
+    die("malloc");
+  if (pread(fd, buf, swap_st.st_size, 0) == swap_st.st_size &&
+      (size_t)swap_st.st_size >= sizeof(header)) {
+    memcpy(&header, buf, sizeof(header));
+    if (memcmp(header.magic, KILO_SWAP_MAGIC, sizeof(header.magic)) == 0 &&
+        (header.size == st->st_size
+             ? header.mtime_sec == st->st_mtim.tv_sec &&
+                   header.mtime_nsec == st->st_mtim.tv_nsec
+             : header.size < st->st_size &&
+                   header.tail ==
+                       editor_swap_tail(editor.buf->file, header.size))) {
+      /* The edits made again are in the swap file already. */
+      swap->failed = true;
+      recovered = editor_swap_recover(buf, swap_st.st_size, &end);
+      swap->failed = false;
+      if (recovered != 0)
+        editor_set_status_message("Recovered %d edits from %s", recovered,
+                                  swap->path);
+    } else
+      editor_set_status_message("Ignoring the stale %s", swap->path);
+  }
+  free(buf);
+
+  if (end == 0) {
+    unlink(swap->path);
+    close(fd);
+    return;
+  }
+
+  swap->fd = fd;
+  swap->logged = swap->written = end - sizeof(header);
+  if (ftruncate(fd, end) == -1 || lseek(fd, end, SEEK_SET) == -1)
+    editor_swap_fail(swap, "truncate");
+}
+
+/*
+ * Make the valid records in `buf` until the first one that is cut short or
+ * doesn't fit, and return how many there were.  `end` is set to where they
+ * end.
+ */
+static int editor_swap_recover(char *buf, size_t len, size_t *end) {
+  size_t off = sizeof(struct swap_header);
+  int recovered = 0;
+
+  editor.buf->journal.replaying = true;
+  while (len - off >= sizeof(struct swap_record)) {
+    struct swap_record record;
+    struct journal_edit edit;
+
+    memcpy(&record, &buf[off], sizeof(record));
+    if (record.len > len - off - sizeof(record))
+      break;
+
+    edit.op = record.op;
+    edit.cursor_y = record.cursor_y;
+    edit.cursor_x = record.cursor_x;
+    edit.text = &buf[off + sizeof(record)];
+    edit.len = record.len;
+    if (!editor_journal_valid(&edit))
+      break;
+
+    editor_journal_apply(&edit, false);
+    off += sizeof(record) + record.len;
+    recovered++;
+  }
+  editor.buf->journal.replaying = false;
+
+  *end = off;
+  return (recovered);
+}
+
+/* Make `fd` an empty swap file for the first `size` bytes of `file`. */
+static void editor_swap_start(struct editor_swap *swap, int fd,
+                              const char *file, off_t size) {
+  struct swap_header header;
+  struct stat st;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, KILO_SWAP_MAGIC, sizeof(header.magic));
+  header.size = size;
+  if (stat(file, &st) == 0) {
+    header.mtime_sec = st.st_mtim.tv_sec;
+    header.mtime_nsec = st.st_mtim.tv_nsec;
+  }
+  header.tail = editor_swap_tail(file, size);
+
+  swap->fd = fd;
+  swap->logged = swap->written = 0;
+  if (ftruncate(fd, 0) == -1 ||
+      pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      lseek(fd, sizeof(header), SEEK_SET) == -1) {
+    editor_swap_fail(swap, "write");
+    return;
+  }
+  swap->unsynced = true;
+}
+
+/* Hash of the KILO_SWAP_TAIL bytes of `file` before `size`, or 0. */
+static uint64_t editor_swap_tail(const char *file, int64_t size) {
+  char tail[KILO_SWAP_TAIL];
+  size_t len = MIN(size, KILO_SWAP_TAIL);
+  uint64_t h = 0;
+  int fd;
+
+  if ((fd = open(file, O_RDONLY)) == -1)
+    return (0);
+  if (pread(fd, tail, len, size - len) == (ssize_t)len)
+    h = hash_bytes(HASH_INIT, tail, len);
+  close(fd);
+
+  return (h);
+}
+
+/*
+ * Take the lock on the swap file `fd`, or close it and give up on the swap
+ * file if another kilo has it.
+ */
+static bool editor_swap_lock(struct editor_swap *swap, int fd) {
+  if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+    return (true);
+
+  if (errno == EWOULDBLOCK) {
+    editor_set_status_message("Swap file disabled, %s is in use",
+                              swap->path);
+    swap->failed = true;
+  } else
+    editor_swap_fail(swap, "flock");
+  close(fd);
+  return (false);
+}
+
+/* Create the swap file of `buf` for its text as it was loaded or saved. */
+static bool editor_swap_create(struct editor_buffer *buf) {
+  struct editor_swap *swap = &buf->swap;
+  int fd;
+
+  if ((fd = open(swap->path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) == -1) {
+    editor_swap_fail(swap, "open");
+    return (false);
+  }
+  if (!editor_swap_lock(swap, fd))
+    return (false);
+
+  editor_swap_start(swap, fd, buf->file, buf->follow.offset);
+  return (swap->fd != -1);
+}
+
+static void editor_swap_log(enum journal_op op, int y, int x,
+                            const char *text, size_t len) {
+  struct editor_swap *swap = &editor.buf->swap;
+  struct swap_record record = {
+      .op = op, .cursor_y = y, .cursor_x = x, .len = len};
+
+  if (swap->fd == -1 &&
+      (swap->path == NULL
+           ? !editor.save.running || editor.save.buf != editor.buf
+           : swap->failed || !editor_swap_create(editor.buf)))
+    return;
+
+  if (sbuf_bcat(swap->buf, &record, sizeof(record)) == -1 ||
+      sbuf_bcat(swap->buf, text, len) == -1)
+    die("sbuf_bcat");
+  swap->logged += sizeof(record) + len;
+
+  if (swap->fd != -1) {
+    if (sbuf_len(swap->buf) >= KILO_SWAP_BATCH)
+      editor_swap_flush(swap, false);
+    editor_swap_arm();
+  }
+}
+
+/* Write out the records collected so far, and make them stick if `sync`. */
+static void editor_swap_flush(struct editor_swap *swap, bool sync) {
+  const char *p;
+  ssize_t left, n;
+
+  if (swap->fd == -1)
+    return;
+
+  if (sbuf_finish(swap->buf) == -1)
+    die("sbuf_finish");
+  p = sbuf_data(swap->buf);
+  left = sbuf_len(swap->buf);
+  for (; left > 0; p += n, left -= n) {
+    if ((n = write(swap->fd, p, left)) == -1) {
+      if (errno == EINTR) {
+        n = 0;
+        continue;
+      }
+      editor_swap_fail(swap, "write");
+      return;
+    }
+    swap->written += n;
+    swap->unsynced = true;
+  }
+  sbuf_clear(swap->buf);
+
+  if (sync && swap->unsynced) {
+    if (fsync(swap->fd) == -1)
+      editor_swap_fail(swap, "fsync");
+    swap->unsynced = false;
+  }
+}
+
+/* Give up on the swap file, but keep what is in it. */
+static void editor_swap_fail(struct editor_swap *swap, const char *what) {
+  editor_set_status_message("Swap file disabled, %s failed: %s", what,
+                            strerror(errno));
+  if (swap->fd != -1)
+    close(swap->fd);
+  swap->fd = -1;
+  swap->failed = true;
+  sbuf_clear(swap->buf);
+}
+
+/* Have the KILO_SWAP_TIMER flush the swap files, unless it already will. */
+static void editor_swap_arm(void) {
+  struct kevent event;
+
+  if (editor.swap_timer)
+    return;
+
+  EV_SET(&event, KILO_SWAP_TIMER, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0,
+         KILO_SWAP_INTERVAL, NULL);
+  if (kevent(editor.kq, &event, 1, NULL, 0, NULL) == -1)
+    die("kevent register");
+  editor.swap_timer = true;
+}
+
+/*
+ * A save has replaced the file with the `size` bytes of the text as it was
+ * `mark` bytes into the log.  Start a new swap file for that version of the
+ * file, holding just the records after `mark`, and rename(2) it over the old
+ * one; without any such records, the swap file is removed instead.
+ */
+static void editor_swap_rebase(struct editor_buffer *buf, size_t mark,
+                               off_t size) {
+  struct editor_swap *swap = &buf->swap;
+  char *tmp, *records;
+  size_t len;
+  int fd;
+
+  if (swap->path == NULL) {
+    if (asprintf(&swap->path, "%s.swp", buf->file) == -1)
+      die("asprintf");
+  } else if (swap->fd == -1) {
+    /* Given up on, or nothing was logged yet to create it. */
+    return;
+  }
+
+  /* Get all the records in one place, the old swap file or the buffer. */
+  editor_swap_flush(swap, false);
+  if (sbuf_finish(swap->buf) == -1)
+    die("sbuf_finish");
+  len = swap->logged - mark;
+  if ((records = malloc(MAX(len, 1))) == NULL)
+    die("malloc");
+  if (swap->fd != -1) {
+    if (pread(swap->fd, records, len, sizeof(struct swap_header) + mark) !=
+        (ssize_t)len) {
+      free(records);
+      editor_swap_fail(swap, "read");
+      return;
+    }
+  } else
+    memcpy(records, &sbuf_data(swap->buf)[sbuf_len(swap->buf) - len], len);
+  sbuf_clear(swap->buf);
+
+  if (len == 0) {
+    free(records);
+    if (swap->fd != -1) {
+      unlink(swap->path);
+      close(swap->fd);
+      swap->fd = -1;
+    }
+    swap->logged = swap->written = 0;
+    swap->unsynced = false;
+    return;
+  }
+
+  if (asprintf(&tmp, "%s.XXXXXX", swap->path) == -1)
+    die("asprintf");
+  if ((fd = mkstemp(tmp)) == -1 || flock(fd, LOCK_EX) == -1) {
+    if (fd != -1) {
+      unlink(tmp);
+      close(fd);
+    }
+    free(tmp);
+    free(records);
+    editor_swap_fail(swap, "mkstemp");
+    return;
+  }
+
+  if (swap->fd != -1)
+    close(swap->fd);
+  editor_swap_start(swap, fd, buf->file, size);
+  if (swap->fd != -1 &&
+      (write(fd, records, len) != (ssize_t)len || fsync(fd) == -1 ||
+       rename(tmp, swap->path) == -1)) {
+    unlink(tmp);
+    editor_swap_fail(swap, "write");
+  } else if (swap->fd != -1) {
+    swap->logged = swap->written = len;
+    swap->unsynced = false;
+  }
+
+  free(tmp);
+  free(records);
+}
+
+/* Remove the swap file on the way out; the text has been saved or dropped. */
+static void editor_swap_release(struct editor_swap *swap) {
+  if (swap->fd != -1) {
+    unlink(swap->path);
+    close(swap->fd);
+  }
+  free(swap->path);
+  sbuf_delete(swap->buf);
+}
+
+static struct editor_buffer *editor_buffer_new(void) {
+  struct editor_buffer *buf = malloc(sizeof(*buf));
+
+  if (buf == NULL)
+    die("malloc");
+
+  buf->file = buf->path = NULL;
+  buf->dirty = 0;
+  buf->version = 0;
+  buf->syntax = NULL;
+  buf->text.rows = NULL;
+  buf->text.num_rows = buf->text.capacity = buf->text.gap = 0;
+  buf->text.base = NULL;
+  buf->text.base_len = 0;
+  buf->text.base_mapped = false;
+  buf->text.hl_valid = 0;
+  arena_init(&buf->text.arena);
+  buf->journal.edits = NULL;
+  buf->journal.first = buf->journal.pos = buf->journal.num = 0;
+  buf->journal.capacity = 0;
+  buf->journal.bytes = 0;
+  buf->journal.end_y = buf->journal.end_x = 0;
+  buf->journal.last.tv_sec = buf->journal.last.tv_nsec = 0;
+  buf->journal.sealed = buf->journal.replaying = false;
+  arena_init(&buf->journal.arena);
+  buf->swap.path = NULL;
+  buf->swap.fd = -1;
+  buf->swap.logged = buf->swap.written = 0;
+  buf->swap.unsynced = buf->swap.failed = false;
+  if ((buf->swap.buf = sbuf_new_auto()) == NULL)
+    die("sbuf_new_auto");
+  buf->follow.fd = -1;
+  buf->follow.offset = 0;
+  buf->follow.partial = false;
+  buf->pager = NULL;
+
+  TAILQ_INSERT_TAIL(&editor.buffers, buf, link);
+  return (buf);
+}
+
+/* The buffer that already has `file` open, if any. */
+static struct editor_buffer *editor_buffer_find(const char *file) {
+  struct editor_buffer *buf;
+  char *path = realpath(file, NULL);
+
+  if (path == NULL)
+    return (NULL);
+
+  TAILQ_FOREACH(buf, &editor.buffers, link) {
+    if (buf->path != NULL && strcmp(buf->path, path) == 0)
+      break;
+  }
+  free(path);
+
+  return (buf);
+}
+
+static void editor_buffer_free(struct editor_buffer *buf) {
+  struct editor_buffer *cur = editor.buf;
+
+  editor.buf = buf;
+  editor_follow_close(buf);
+  if (buf->pager != NULL)
+    editor_pager_close(buf->pager);
+  editor_swap_release(&buf->swap);
+  text_store_free(&buf->text);
+  editor_journal_release();
+  editor.buf = cur;
+
+  TAILQ_REMOVE(&editor.buffers, buf, link);
+  free(buf->file);
+  free(buf->path);
+  free(buf);
+}
+
+/*
+ * Show a file in the current window, in the buffer that has it open already
+ * or in a new one.  Only files that exist can be opened.
+ */
+static void editor_buffer_open(void) {
+  struct editor_buffer *buf, *cur = editor.buf;
+  char *file = editor_prompt("Open: %s", NULL);
+  int fd;
+
+  if (file == NULL)
+    return;
+
+  if ((buf = editor_buffer_find(file)) == NULL) {
+    if ((fd = editor_open_file(file)) == -1) {
+      editor_set_status_message("Can't open %s: %s", file, strerror(errno));
+      free(file);
+      return;
+    }
+
+    buf = editor.buf = editor_buffer_new();
+    if (!editor_open(file, fd)) {
+      editor_set_status_message("Can't open %s: %s", file, strerror(errno));
+      editor_buffer_free(buf);
+      editor.buf = cur;
+      free(file);
+      return;
+    }
+  }
+  free(file);
+
+  editor_window_show(editor.win, buf);
+}
+
+/* Show the next or previous buffer in the current window. */
+static void editor_buffer_cycle(bool forward) {
+  struct editor_buffer *buf = editor.win->buf;
+
+  buf = forward ? TAILQ_NEXT(buf, link)
+                : TAILQ_PREV(buf, editor_buffer_list, link);
+  if (buf == NULL)
+    buf = forward ? TAILQ_FIRST(&editor.buffers)
+                  : TAILQ_LAST(&editor.buffers, editor_buffer_list);
+
+  editor_window_show(editor.win, buf);
+}
+
+/*
+ * Open `file` for editor_open(), or return -1 with errno set if it can't be
+ * read or isn't a regular file.
+ */
+static int editor_open_file(const char *file) {
+  struct stat st;
+  int fd = open(file, O_RDONLY), saved_errno;
+
+  if (fd == -1)
+    return (-1);
+
+  if (fstat(fd, &st) == 0) {
+    if (S_ISREG(st.st_mode))
+      return (fd);
+    errno = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+  }
+
+  saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return (-1);
+}
+
+/*
+ * Load `file` from `fd`, which is closed, into the current buffer.  Returns
+ * false with errno set and the buffer left empty if it can't be mapped.
+ */
+static bool editor_open(const char *file, int fd) {
+  struct stat st;
+  char *p, *end;
+  int num_rows = 0, saved_errno;
+
+  if (fstat(fd, &st) == -1)
+    goto fail;
+
+  if (st.st_size != 0) {
+    editor.buf->text.base =
+        mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (editor.buf->text.base == MAP_FAILED) {
+      editor.buf->text.base = NULL;
+      goto fail;
+    }
+
+    editor.buf->text.base_len = st.st_size;
+    editor.buf->text.base_mapped = true;
+    posix_madvise(editor.buf->text.base, st.st_size, POSIX_MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  editor.buf->file = strdup(file);
+  editor.buf->path = realpath(file, NULL);
+
+  p = editor.buf->text.base;
+  end = editor.buf->text.base + editor.buf->text.base_len;
+  for (char *nl = p; nl < end && (nl = memchr(nl, '\n', end - nl)) != NULL;
+       nl++)
+    num_rows++;
+  if (end > p && end[-1] != '\n')
+    num_rows++;
+
+  text_store_reserve(&editor.buf->text, num_rows);
+
+  while (p < end) {
+    struct editor_row *row;
+    char *nl = memchr(p, '\n', end - p);
+    size_t line_len = (nl == NULL ? end : nl) - p;
+
+    while (line_len > 0 && p[line_len - 1] == '\r')
+      line_len--;
+
+    row = text_store_insert(&editor.buf->text, editor.buf->text.num_rows);
+    editor_row_init(row, p, line_len, 0);
+
+    p = nl == NULL ? end : nl + 1;
+  }
+
+  editor_select_syntax_highlight();
+  editor_swap_open(&st);
+  if (editor.buf->swap.logged == 0)
+    editor.buf->dirty = 0;
+
+  editor.buf->follow.offset = st.st_size;
+  editor.buf->follow.partial = end > editor.buf->text.base && end[-1] != '\n';
+  return (true);
+
+fail:
+  saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return (false);
+}
+
+/* Start or stop following the file, see struct editor_follow. */
+static void editor_follow_toggle(void) {
+  struct editor_buffer *buf = editor.buf;
+
+  if (buf->follow.fd != -1) {
+    editor_follow_close(buf);
+    editor_set_status_message("Stopped following %s", buf->file);
+    return;
+  }
+
+  if (buf->file == NULL) {
+    editor_set_status_message("No file to follow");
+    return;
+  }
+  if (buf->dirty != 0) {
+    editor_set_status_message("Save the changes before following the file");
+    return;
+  }
+  if (editor.save.running && editor.save.buf == buf) {
+    editor_set_status_message("Wait for the save before following the file");
+    return;
+  }
+
+  if (!editor_follow_open(buf))
+    return;
+  editor_set_status_message("Following %s", buf->file);
+  editor_follow_read(buf, 0);
+}
+
+/*
+ * The event carries the buffer, as it may not be the one being edited.  The
+ * rows stop borrowing from the file, which others may now truncate.
+ */
+static bool editor_follow_open(struct editor_buffer *buf) {
+  struct kevent event;
+  int fd;
+
+  if ((fd = open(buf->file, O_RDONLY)) == -1) {
+    editor_set_status_message("Can't follow %s: %s", buf->file,
+                              strerror(errno));
+    return (false);
+  }
+  text_store_own(&buf->text);
+
+  EV_SET(&event, fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+         NOTE_EXTEND | NOTE_WRITE | NOTE_DELETE | NOTE_RENAME, 0, buf);
+  if (kevent(editor.kq, &event, 1, NULL, 0, NULL) == -1)
+    die("kevent register");
+
+  buf->follow.fd = fd;
+  return (true);
+}
+
+/* Closing the descriptor also removes its event. */
+static void editor_follow_close(struct editor_buffer *buf) {
+  if (buf->follow.fd == -1)
+    return;
+
+  close(buf->follow.fd);
+  buf->follow.fd = -1;
+}
+
+/*
+ * Add whatever was appended to the file since the last time.  A file that
+ * went away or shrank can't be followed any further; only a save of our own
+ * replaces it, and editor_save_finish follows the new one.  The text being
+ * searched has to stay put, so it is caught up once the search is over.
+ */
+static void editor_follow_read(struct editor_buffer *buf,
+                               unsigned int fflags) {
+  struct editor_follow *follow = &buf->follow;
+  struct stat st;
+  char *data;
+  ssize_t n;
+
+  if (follow->fd == -1)
+    return;
+
+  if (fflags & (NOTE_DELETE | NOTE_RENAME)) {
+    if (!editor.save.running || editor.save.buf != buf) {
+      editor_follow_close(buf);
+      editor_set_status_message("%s was moved, stopped following",
+                                buf->file);
+    }
+    return;
+  }
+
+  if (editor.search.active && buf == editor.win->buf)
+    return;
+
+  if (fstat(follow->fd, &st) == -1)
+    die("fstat");
+  if (st.st_size < follow->offset) {
+    editor_follow_close(buf);
+    editor_set_status_message("%s was truncated, stopped following",
+                              buf->file);
+    return;
+  }
+
+  if ((data = malloc(KILO_FOLLOW_CHUNK)) == NULL)
+    die("malloc");
+
+  for (;;) {
+    size_t used;
+
+    if ((n = pread(follow->fd, data, KILO_FOLLOW_CHUNK, follow->offset)) ==
+        -1) {
+      if (errno == EINTR)
+        continue;
+      editor_follow_close(buf);
+      editor_set_status_message("Can't read %s: %s", buf->file,
+                                strerror(errno));
+      break;
+    }
+
+    used = editor_follow_append(buf, data, n);
+    follow->offset += used;
+    if (used == 0 || n < KILO_FOLLOW_CHUNK)
+      break;
+  }
+
+  free(data);
+}
+
+/*
+ * Add the lines in `data` as rows of `buf`, without counting them as edits,
+ * and return how many bytes were used.  Carriage returns at the end are left
+ * for the next time, as they may be half of a CRLF.  The cursors on the last
+ * row or below it stay at the bottom.
+ */
+static size_t editor_follow_append(struct editor_buffer *buf,
+                                   const char *data, size_t len) {
+  struct editor_follow *follow = &buf->follow;
+  struct editor_buffer *cur = editor.buf;
+  const char *p = data, *end = data + len;
+  int dirty = buf->dirty, num_rows = buf->text.num_rows;
+
+  while (end > p && end[-1] == '\r')
+    end--;
+
+  editor.buf = buf;
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    size_t line_len = (nl == NULL ? end : nl) - p;
+
+    while (nl != NULL && line_len > 0 && p[line_len - 1] == '\r')
+      line_len--;
+
+    if (follow->partial && buf->text.num_rows > 0)
+      editor_row_append_string(buf->text.num_rows - 1, p, line_len);
+    else
+      editor_insert_row(buf->text.num_rows, p, line_len);
+
+    follow->partial = nl == NULL;
+    p = nl == NULL ? end : nl + 1;
+  }
+  editor.buf = cur;
+  buf->dirty = dirty;
+
+  for (struct editor_window *w = editor_window_first(editor.root); w != NULL;
+       w = editor_window_next(w)) {
+    if (w->buf == buf && w->cursor_y >= num_rows - 1 &&
+        buf->text.num_rows > num_rows) {
+      w->cursor_y += buf->text.num_rows - num_rows;
+      w->cursor_x = 0;
+    }
+  }
+  if (end > data)
+    editor.follow_updated = true;
+
+  return (end - data);
+}
+
+/*
+ * Open `file` in the current buffer as a pager, see struct editor_pager.
+ * Nothing is read from it until the first screen is drawn.
+ */
+static void editor_pager_open(const char *file) {
+  struct editor_pager *pager = calloc(1, sizeof(*pager));
+  const char *limit = getenv("KILO_PAGER_MB");
+  long mb = limit == NULL ? 0 : strtol(limit, NULL, 10);
+  struct stat st;
+
+  if (pager == NULL)
+    die("calloc");
+
+  if ((pager->fd = open(file, O_RDONLY)) == -1)
+    die("open");
+
+  if (fstat(pager->fd, &st) == -1)
+    die("fstat");
+
+  if (mb <= 0)
+    mb = KILO_PAGER_CACHE;
+  pager->size = st.st_size;
+  pager->num_blocks = MIN(MAX((int64_t)mb * 1024 * 1024 / KILO_PAGER_BLOCK,
+                              2 * KILO_PAGER_READAHEAD),
+                          INT_MAX / 2);
+  for (pager->num_buckets = 1; pager->num_buckets < pager->num_blocks;)
+    pager->num_buckets *= 2;
+
+  if ((pager->blocks = calloc(pager->num_blocks, sizeof(*pager->blocks))) ==
+          NULL ||
+      (pager->data = malloc((size_t)pager->num_blocks * KILO_PAGER_BLOCK)) ==
+          NULL ||
+      (pager->buckets =
+           malloc(pager->num_buckets * sizeof(*pager->buckets))) == NULL ||
+      (pager->index.offsets = malloc(KILO_PAGER_INDEX_MAX *
+                                     sizeof(*pager->index.offsets))) == NULL ||
+      (pager->index_buf = malloc(KILO_PAGER_INDEX_CHUNK)) == NULL ||
+      (pager->search_line = malloc(2 * KILO_PAGER_LINE_MAX)) == NULL ||
+      (pager->line = malloc(2 * KILO_PAGER_LINE_MAX)) == NULL)
+    die("malloc");
+
+  TAILQ_INIT(&pager->lru);
+  for (int i = 0; i < pager->num_buckets; i++)
+    LIST_INIT(&pager->buckets[i]);
+  for (int i = 0; i < pager->num_blocks; i++) {
+    pager->blocks[i].data = &pager->data[(size_t)i * KILO_PAGER_BLOCK];
+    TAILQ_INSERT_TAIL(&pager->lru, &pager->blocks[i], lru);
+  }
+
+  pthread_mutex_init(&pager->lock, NULL);
+  pthread_cond_init(&pager->ready, NULL);
+  pthread_cond_init(&pager->work, NULL);
+  atomic_init(&pager->quit, false);
+  atomic_init(&pager->cancel, false);
+  pager->prefetch = -1;
+  pager->direction = pager->prefetch_direction = 1;
+  pager->index.offsets[0] = 0;
+  pager->index.num = 1;
+  pager->index.stride = 1;
+  pager->search_state = PAGER_SEARCH_IDLE;
+  pager->shown = -1;
+  editor_row_init(&pager->row, pager->line, 0, 0);
+
+  editor.buf->file = strdup(file);
+  editor.buf->path = realpath(file, NULL);
+  editor.buf->pager = pager;
+  editor_select_syntax_highlight();
+
+  if ((errno = pthread_create(&pager->worker, NULL, editor_pager_worker,
+                              pager)) != 0 ||
+      (errno = pthread_create(&pager->indexer, NULL, editor_pager_indexer,
+                              pager)) != 0)
+    die("pthread_create");
+}
+
+/*
+ * Stop the threads of `pager` and free it.  The scratch row renders from the
+ * arena of the current buffer, which must be the one `pager` belongs to.
+ */
+static void editor_pager_close(struct editor_pager *pager) {
+  pthread_mutex_lock(&pager->lock);
+  atomic_store(&pager->quit, true);
+  atomic_store(&pager->cancel, true);
+  pthread_cond_signal(&pager->work);
+  pthread_mutex_unlock(&pager->lock);
+
+  pthread_join(pager->worker, NULL);
+  pthread_join(pager->indexer, NULL);
+  pthread_cond_destroy(&pager->work);
+  pthread_cond_destroy(&pager->ready);
+  pthread_mutex_destroy(&pager->lock);
+  close(pager->fd);
+
+  free(pager->blocks);
+  free(pager->data);
+  free(pager->buckets);
+  free(pager->index.offsets);
+  free(pager->index_buf);
+  free(pager->query);
+  free(pager->search_line);
+  editor_free_row(&pager->row);
+  free(pager->line);
+  free(pager);
+}
+
+/* Wake up the main thread to show what the worker or the indexer did. */
+static void pager_notify(void) {
+  struct kevent event;
+
+  EV_SET(&event, KILO_PAGER_EVENT, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+  if (kevent(editor.kq, &event, 1, NULL, 0, NULL) == -1)
+    die("kevent trigger");
+}
+
+/* The cached block `index` of the file, if any.  Called with the lock held. */
+static struct pager_block *pager_lookup(struct editor_pager *pager,
+                                        off_t index) {
+  struct pager_block *block;
+
+  LIST_FOREACH(block, &pager->buckets[index & (pager->num_buckets - 1)],
+               hash) {
+    if (block->index == index)
+      break;
+  }
+
+  return (block);
+}
+
+/*
+ * Take the least recently used block for block `index` of the file, pinned
+ * and yet to be read, or NULL if all of them are in use.  A `cold` block goes
+ * first again once put back.  Called with the lock held.
+ */
+static struct pager_block *pager_claim(struct editor_pager *pager, off_t index,
+                                       bool cold) {
+  struct pager_block *block = TAILQ_LAST(&pager->lru, pager_lru);
+
+  if (block == NULL)
+    return (NULL);
+
+  TAILQ_REMOVE(&pager->lru, block, lru);
+  if (block->hashed)
+    LIST_REMOVE(block, hash);
+
+  block->index = index;
+  block->len = 0;
+  block->pins = 1;
+  block->hashed = true;
+  block->ready = false;
+  block->cold = cold;
+  LIST_INSERT_HEAD(&pager->buckets[index & (pager->num_buckets - 1)], block,
+                   hash);
+
+  return (block);
+}
+
+/* preadv(2) all of `iov`, unless the file ends first. */
+static ssize_t pager_preadv(int fd, struct iovec *iov, int n, off_t offset) {
+  ssize_t total = 0, nread;
+
+  while (n > 0) {
+    if ((nread = preadv(fd, iov, n, offset)) == -1) {
+      if (errno == EINTR)
+        continue;
+      return (-1);
+    }
+    if (nread == 0)
+      break;
+
+    total += nread;
+    offset += nread;
+    for (; n > 0 && (size_t)nread >= iov->iov_len; iov++, n--)
+      nread -= iov->iov_len;
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + nread;
+      iov->iov_len -= nread;
+    }
+  }
+
+  return (total);
+}
+
+/*
+ * Read the `n` consecutive blocks claimed in `blocks` with a single preadv(2)
+ * and mark them ready.  After a read error they are left empty, and out of
+ * the cache so that the next look at them tries again.
+ */
+static void pager_read(struct editor_pager *pager, struct pager_block **blocks,
+                       int n) {
+  struct iovec iov[KILO_PAGER_READAHEAD];
+  ssize_t nread;
+  int error = 0;
+
+  for (int i = 0; i < n; i++) {
+    iov[i].iov_base = blocks[i]->data;
+    iov[i].iov_len = KILO_PAGER_BLOCK;
+  }
+  if ((nread = pager_preadv(pager->fd, iov, n,
+                            blocks[0]->index * KILO_PAGER_BLOCK)) == -1) {
+    error = errno;
+    nread = 0;
+  }
+
+  pthread_mutex_lock(&pager->lock);
+  for (int i = 0; i < n; i++) {
+    ssize_t left = nread - (ssize_t)i * KILO_PAGER_BLOCK;
+
+    blocks[i]->len = left <= 0 ? 0 : MIN(left, KILO_PAGER_BLOCK);
+    blocks[i]->ready = true;
+    if (error != 0) {
+      LIST_REMOVE(blocks[i], hash);
+      blocks[i]->hashed = false;
+    }
+  }
+  if (error != 0)
+    pager->error = error;
+  pthread_cond_broadcast(&pager->ready);
+  pthread_mutex_unlock(&pager->lock);
+}
+
+/*
+ * Block `index` of the file, pinned until it is put back.  A block that is
+ * not cached is read right away, and one that is being read is waited for.
+ */
+static struct pager_block *pager_get(struct editor_pager *pager, off_t index,
+                                     bool cold) {
+  struct pager_block *block;
+
+  pthread_mutex_lock(&pager->lock);
+  while ((block = pager_lookup(pager, index)) == NULL || !block->ready) {
+    if (block == NULL && (block = pager_claim(pager, index, cold)) != NULL) {
+      pthread_mutex_unlock(&pager->lock);
+      pager_read(pager, &block, 1);
+      return (block);
+    }
+    pthread_cond_wait(&pager->ready, &pager->lock);
+  }
+
+  if (block->pins++ == 0)
+    TAILQ_REMOVE(&pager->lru, block, lru);
+  if (!cold)
+    block->cold = false;
+  pthread_mutex_unlock(&pager->lock);
+
+  return (block);
+}
+
+static void pager_put(struct editor_pager *pager, struct pager_block *block) {
+  pthread_mutex_lock(&pager->lock);
+  if (--block->pins == 0) {
+    if (block->cold)
+      TAILQ_INSERT_TAIL(&pager->lru, block, lru);
+    else
+      TAILQ_INSERT_HEAD(&pager->lru, block, lru);
+    pthread_cond_broadcast(&pager->ready);
+  }
+  pthread_mutex_unlock(&pager->lock);
+}
+
+/*
+ * Read the KILO_PAGER_READAHEAD blocks from `first` on in `direction` that
+ * aren't cached yet, each run of consecutive ones with a single preadv(2).
+ * Blocks in use are never taken for it, so it may fall short.
+ */
+static void pager_read_ahead(struct editor_pager *pager, off_t first,
+                             int direction) {
+  struct pager_block *run[KILO_PAGER_READAHEAD];
+  off_t from = MAX(direction < 0 ? first - KILO_PAGER_READAHEAD + 1 : first, 0);
+  off_t to = MIN(from + KILO_PAGER_READAHEAD,
+                 (pager->size + KILO_PAGER_BLOCK - 1) / KILO_PAGER_BLOCK);
+  int n = 0;
+
+  for (off_t i = from; i <= to; i++) {
+    pthread_mutex_lock(&pager->lock);
+    if (i < to && pager_lookup(pager, i) == NULL &&
+        (run[n] = pager_claim(pager, i, false)) != NULL) {
+      pthread_mutex_unlock(&pager->lock);
+      n++;
+      continue;
+    }
+    pthread_mutex_unlock(&pager->lock);
+
+    if (n > 0) {
+      pager_read(pager, run, n);
+      for (int j = 0; j < n; j++)
+        pager_put(pager, run[j]);
+      n = 0;
+    }
+  }
+}
+
+/*
+ * The offset of the first newline in `[from, to)` of the file, or of the
+ * last one if `backward`, or -1 if there is none.
+ */
+static off_t pager_find_eol(struct editor_pager *pager, off_t from, off_t to,
+                            bool backward, bool cold) {
+  while (from < to) {
+    off_t index = (backward ? to - 1 : from) / KILO_PAGER_BLOCK;
+    off_t base = index * KILO_PAGER_BLOCK;
+    struct pager_block *block = pager_get(pager, index, cold);
+    off_t lo = MAX(from, base), hi = MIN(to, base + (off_t)block->len);
+    const char *p = NULL;
+    off_t eol;
+
+    if (hi > lo)
+      p = backward ? memrchr(&block->data[lo - base], '\n', hi - lo)
+                   : memchr(&block->data[lo - base], '\n', hi - lo);
+    eol = p == NULL ? -1 : base + (p - block->data);
+    pager_put(pager, block);
+
+    if (eol != -1)
+      return (eol);
+    if (backward)
+      to = base;
+    else
+      from = base + KILO_PAGER_BLOCK;
+  }
+
+  return (-1);
+}
+
+/* Copy the `len` bytes of the file at `offset` to `buf`. */
+static void pager_copy(struct editor_pager *pager, off_t offset, char *buf,
+                       int len, bool cold) {
+  while (len > 0) {
+    off_t index = offset / KILO_PAGER_BLOCK;
+    size_t at = offset - index * KILO_PAGER_BLOCK;
+    struct pager_block *block = pager_get(pager, index, cold);
+    int n = MIN(len, KILO_PAGER_BLOCK - (int)at);
+    size_t have = at < block->len ? MIN((size_t)n, block->len - at) : 0;
+
+    memcpy(buf, &block->data[at], have);
+    memset(&buf[have], '\0', n - have);
+    pager_put(pager, block);
+
+    buf += n;
+    offset += n;
+    len -= n;
+  }
+}
+
+/*
+ * Where the line at `offset` goes on as another if it has no newline before.
+ * Lines longer than KILO_PAGER_LINE_MAX are shown as several, continued at
+ * multiples of it that have no newline in the KILO_PAGER_LINE_MAX bytes
+ * before, so that the start or the end of any of them is found within a few
+ * blocks, scanning forward or back.
+ */
+static off_t pager_line_cut(struct editor_pager *pager, off_t offset) {
+  off_t cut = ((offset + KILO_PAGER_LINE_MAX - 1) / KILO_PAGER_LINE_MAX + 1) *
+              KILO_PAGER_LINE_MAX;
+
+  return (MIN(cut, pager->size));
+}
+
+/*
+ * Copy the line at `offset` to `buf`, which holds 2 * KILO_PAGER_LINE_MAX
+ * bytes, and return its length without its line end.  `*next` is set to
+ * where the next line starts, or to -1 after the last one.
+ */
+static int pager_line(struct editor_pager *pager, off_t offset, char *buf,
+                      off_t *next, bool cold) {
+  off_t end = pager_line_cut(pager, offset);
+  off_t eol = pager_find_eol(pager, offset, end, false, cold);
+  int len = (eol == -1 ? end : eol) - offset;
+
+  pager_copy(pager, offset, buf, len, cold);
+  if (eol != -1 || end == pager->size) {
+    while (len > 0 && buf[len - 1] == '\r')
+      len--;
+  }
+
+  *next = eol == -1 ? end : eol + 1;
+  if (*next >= pager->size)
+    *next = -1;
+  return (len);
+}
+
+/*
+ * Where the line with the byte at `offset` starts, see pager_line_cut().  The
+ * scan back goes no further than the closest line the index knows of.
+ */
+static off_t pager_line_start(struct editor_pager *pager, off_t offset,
+                              bool cold) {
+  off_t cut = offset / KILO_PAGER_LINE_MAX * KILO_PAGER_LINE_MAX;
+  off_t from = MAX(cut - KILO_PAGER_LINE_MAX, 0), entry, eol;
+
+  pthread_mutex_lock(&pager->lock);
+  entry = pager_index_floor(pager, offset, NULL);
+  pthread_mutex_unlock(&pager->lock);
+
+  if ((eol = pager_find_eol(pager, MAX(from, entry), offset, true, cold)) !=
+      -1)
+    return (eol + 1);
+  return (entry > cut - KILO_PAGER_LINE_MAX ? entry : cut);
+}
+
+/* Where the line after the one at `offset` starts, or -1 if it is the last. */
+static off_t pager_next_line(struct editor_pager *pager, off_t offset) {
+  off_t end = pager_line_cut(pager, offset);
+  off_t eol = pager_find_eol(pager, offset, end, false, false);
+  off_t next = eol == -1 ? end : eol + 1;
+
+  return (next >= pager->size ? -1 : next);
+}
+
+/* Whether the line before the one at `offset` ended, or goes on there. */
+static bool pager_ends_line(struct editor_pager *pager, off_t offset) {
+  char c;
+
+  pager_copy(pager, offset - 1, &c, 1, false);
+  return (c == '\n');
+}
+
+/* Note that line `index->lines` starts at `offset`, if it is due an entry. */
+static void pager_index_add(struct pager_index *index, off_t offset) {
+  if (index->num == KILO_PAGER_INDEX_MAX) {
+    for (int i = 0; i < index->num / 2; i++)
+      index->offsets[i] = index->offsets[2 * i];
+    index->num /= 2;
+    index->stride *= 2;
+
+    if (index->lines % index->stride != 0)
+      return;
+  }
+
+  index->offsets[index->num++] = offset;
+}
+
+/*
+ * The start of the last line the index knows of at or before `offset`, and
+ * its number in `*line` unless that is NULL.  Called with the lock held.
+ */
+static off_t pager_index_floor(struct editor_pager *pager, off_t offset,
+                               long *line) {
+  struct pager_index *index = &pager->index;
+  int lo = 0, hi = index->num;
+
+  while (hi - lo > 1) {
+    int mid = lo + (hi - lo) / 2;
+
+    if (index->offsets[mid] <= offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  if (line != NULL)
+    *line = lo * index->stride;
+
+  return (index->offsets[lo]);
+}
+
+/*
+ * The number of the line with the byte at `offset`, counted from 0, or -1 if
+ * the index has not got that far yet.  The lines after the closest entry
+ * before it are counted through the cache, as cold blocks.
+ */
+static long pager_line_number(struct editor_pager *pager, off_t offset) {
+  long line;
+  off_t from;
+
+  pthread_mutex_lock(&pager->lock);
+  if (!pager->index.done && pager->index.scanned < offset) {
+    pthread_mutex_unlock(&pager->lock);
+    return (-1);
+  }
+  from = pager_index_floor(pager, offset, &line);
+  pthread_mutex_unlock(&pager->lock);
+
+  for (off_t eol; (eol = pager_find_eol(pager, from, offset, false, true)) !=
+                  -1;
+       from = eol + 1)
+    line++;
+
+  return (line);
+}
+
+/*
+ * Count the lines of the file into the index, with reads of its own so that
+ * the cache is left to the screen.  The main thread hears of the progress
+ * every KILO_PAGER_INDEX_NOTIFY bytes and at the end.
+ */
+static void *editor_pager_indexer(void *arg) {
+  struct editor_pager *pager = arg;
+  struct pager_index *index = &pager->index;
+  char *buf = pager->index_buf, last = '\n';
+  off_t offset = 0, notified = 0;
+  ssize_t nread = 0;
+
+  while (offset < pager->size && !atomic_load(&pager->quit)) {
+    nread = pread(pager->fd, buf,
+                  MIN(KILO_PAGER_INDEX_CHUNK, pager->size - offset), offset);
+    if (nread == -1 && errno == EINTR)
+      continue;
+    if (nread <= 0)
+      break;
+
+    pthread_mutex_lock(&pager->lock);
+    for (char *p = buf, *end = buf + nread;
+         (p = memchr(p, '\n', end - p)) != NULL; p++) {
+      if (++index->lines % index->stride == 0)
+        pager_index_add(index, offset + (p - buf) + 1);
+    }
+    index->scanned = offset + nread;
+    pthread_mutex_unlock(&pager->lock);
+
+    last = buf[nread - 1];
+    offset += nread;
+    if (offset - notified >= KILO_PAGER_INDEX_NOTIFY) {
+      notified = offset;
+      pager_notify();
+    }
+  }
+
+  if (atomic_load(&pager->quit))
+    return (NULL);
+
+  pthread_mutex_lock(&pager->lock);
+  if (offset == pager->size) {
+    index->done = true;
+    if (last != '\n')
+      index->lines++;
+  } else
+    pager->error = nread == -1 ? errno : EIO;
+  pthread_mutex_unlock(&pager->lock);
+  pager_notify();
+
+  return (NULL);
+}
+
+/*
+ * Look for `query` from `from` on, line by line and around from the start of
+ * the file, and return whether it was found, at `*match`.  Long lines are
+ * continued as they are when drawn, and the blocks read for them are the
+ * first to go from the cache again.  Cancelling gives up with
+ * PAGER_SEARCH_RUNNING.
+ */
+static enum pager_search_state pager_search_run(struct editor_pager *pager,
+                                                const char *query,
+                                                bool use_regex, off_t from,
+                                                off_t *match, int *match_len) {
+  enum pager_search_state state = PAGER_SEARCH_MISSING;
+  struct regex *re = NULL;
+  char *buf = pager->search_line;
+  size_t query_len = strlen(query);
+  off_t start, line, next;
+  int x, len, at;
+
+  if (use_regex && (re = regex_compile(query)) == NULL)
+    return (PAGER_SEARCH_BAD_REGEX);
+
+  if (from >= pager->size)
+    from = 0;
+  line = start = pager_line_start(pager, from, true);
+  x = from - start;
+
+  for (bool wrapped = false;;) {
+    const char *p;
+
+    if (atomic_load(&pager->cancel)) {
+      state = PAGER_SEARCH_RUNNING;
+      break;
+    }
+
+    len = pager_line(pager, line, buf, &next, true);
+    if (x <= len && re != NULL && regex_find(re, buf, len, x, &at, match_len))
+      state = PAGER_SEARCH_FOUND;
+    else if (x <= len && re == NULL &&
+             (p = search_memmem(&buf[x], len - x, query, query_len)) != NULL) {
+      at = p - buf;
+      *match_len = query_len;
+      state = PAGER_SEARCH_FOUND;
+    }
+    if (state == PAGER_SEARCH_FOUND) {
+      *match = line + at;
+      break;
+    }
+
+    x = 0;
+    if (next == -1) {
+      if (wrapped)
+        break;
+      wrapped = true;
+      next = 0;
+    }
+    line = next;
+    if (wrapped && line > start)
+      break;
+  }
+  regex_free(re);
+
+  return (state);
+}
+
+/*
+ * Run what the main thread asks for: the search it started last, and the
+ * reading ahead after each frame.  A result is only posted if no other
+ * search was started meanwhile.
+ */
+static void *editor_pager_worker(void *arg) {
+  struct editor_pager *pager = arg;
+
+  pthread_mutex_lock(&pager->lock);
+  while (!atomic_load(&pager->quit)) {
+    if (pager->search_pending) {
+      char *query = pager->query;
+      bool use_regex = pager->use_regex;
+      off_t from = pager->search_from, match = -1;
+      unsigned long generation = pager->generation;
+      enum pager_search_state state;
+      int match_len = 0;
+
+      pager->query = NULL;
+      pager->search_pending = false;
+      atomic_store(&pager->cancel, false);
+      pthread_mutex_unlock(&pager->lock);
+
+      state = pager_search_run(pager, query, use_regex, from, &match,
+                               &match_len);
+      free(query);
+
+      pthread_mutex_lock(&pager->lock);
+      if (generation == pager->generation && state != PAGER_SEARCH_RUNNING) {
+        pager->search_state = state;
+        pager->match = match;
+        pager->match_len = match_len;
+        pager_notify();
+      }
+    } else if (pager->prefetch != -1) {
+      off_t first = pager->prefetch;
+      int direction = pager->prefetch_direction;
+
+      pager->prefetch = -1;
+      pthread_mutex_unlock(&pager->lock);
+      pager_read_ahead(pager, first, direction);
+      pthread_mutex_lock(&pager->lock);
+    } else
+      pthread_cond_wait(&pager->work, &pager->lock);
+  }
+  pthread_mutex_unlock(&pager->lock);
+
+  return (NULL);
+}
+
+/* Have the worker search for `query` from `from` on, or stop if it is NULL. */
+static void editor_pager_search(struct editor_pager *pager, const char *query,
+                                off_t from) {
+  pthread_mutex_lock(&pager->lock);
+  free(pager->query);
+  pager->query = NULL;
+  if (query != NULL && *query != '\0' &&
+      (pager->query = strdup(query)) == NULL)
+    die("strdup");
+
+  pager->use_regex = editor.search.use_regex;
+  pager->search_from = from;
+  pager->search_pending = pager->query != NULL;
+  pager->search_state =
+      pager->search_pending ? PAGER_SEARCH_RUNNING : PAGER_SEARCH_IDLE;
+  pager->generation++;
+  atomic_store(&pager->cancel, true);
+  pthread_cond_signal(&pager->work);
+  pthread_mutex_unlock(&pager->lock);
+}
+
+/* Render the line at `offset` in the scratch row, see pager_line(). */
+static struct editor_row *editor_pager_render(struct editor_pager *pager,
+                                              off_t offset, off_t *next) {
+  struct editor_row *row = &pager->row;
+
+  row->size = pager_line(pager, offset, pager->line, next, false);
+  row->num_hl_spans = 0;
+  editor_row_render_from(row, 0);
+
+  return (row);
+}
+
+/*
+ * Move the top of `w` down `n` lines, or up for a negative `n`, as far as
+ * the file goes.  The lines a long one is continued on only count as one
+ * for the line number.
+ */
+static void editor_pager_scroll(struct editor_window *w, long n) {
+  struct editor_pager *pager = w->buf->pager;
+  off_t top = w->top_offset, next;
+  long moved = 0, lines = 0;
+
+  for (; moved < n && (next = pager_next_line(pager, top)) != -1; moved++) {
+    top = next;
+    lines += pager_ends_line(pager, top);
+  }
+  for (; moved > n && top > 0; moved--) {
+    lines -= pager_ends_line(pager, top);
+    top = pager_line_start(pager, top - 1, false);
+  }
+
+  w->top_offset = top;
+  if (w->top_line != -1)
+    w->top_line += lines;
+  if (moved != 0)
+    pager->direction = moved < 0 ? -1 : 1;
+}
+
+/* Show the last screen of the file in `w`. */
+static void editor_pager_end(struct editor_window *w) {
+  struct editor_pager *pager = w->buf->pager;
+
+  if (pager->size == 0)
+    return;
+
+  w->top_offset = pager_line_start(pager, pager->size - 1, false);
+  pthread_mutex_lock(&pager->lock);
+  w->top_line = pager->index.done ? pager->index.lines - 1 : -1;
+  pthread_mutex_unlock(&pager->lock);
+
+  editor_pager_scroll(w, -(w->rows - 1));
+  pager->direction = -1;
+}
+
+/*
+ * Show the line number typed at the prompt, or the last line, at the top of
+ * the window.  The index gets close to it in one step, and the rest of the
+ * way is counted through the cache.  Lines the index has not reached yet
+ * can't be jumped to.
+ */
+static void editor_pager_goto_line(void) {
+  struct editor_window *w = editor.win;
+  struct editor_pager *pager = w->buf->pager;
+  struct pager_index *index = &pager->index;
+  char *input = editor_prompt("Go to line: %s (ESC to cancel)", NULL);
+  char *end;
+  long line, at;
+  off_t offset;
+  int i;
+
+  if (input == NULL)
+    return;
+
+  errno = 0;
+  line = strtol(input, &end, 10);
+  if (errno != 0 || end == input || *end != '\0' || line < 1) {
+    editor_set_status_message("Not a line number: %s", input);
+    free(input);
+    return;
+  }
+  free(input);
+
+  pthread_mutex_lock(&pager->lock);
+  if (!index->done && line - 1 > index->lines) {
+    editor_set_status_message("Only %ld lines are indexed so far",
+                              index->lines);
+    pthread_mutex_unlock(&pager->lock);
+    return;
+  }
+  if (index->done)
+    line = MIN(line, MAX(index->lines, 1));
+  i = MIN((line - 1) / index->stride, index->num - 1);
+  at = i * index->stride;
+  offset = index->offsets[i];
+  pthread_mutex_unlock(&pager->lock);
+
+  for (off_t next; at < line - 1 && (next = pager_next_line(pager, offset)) !=
+                                      -1;
+       offset = next)
+    at += pager_ends_line(pager, next);
+
+  w->top_offset = offset;
+  w->top_line = at;
+  w->col_offset = 0;
+  pager->direction = 1;
+}
+
+/*
+ * Search the pager from the top of the window on.  The worker does it, so
+ * that the prompt stays responsive however large the file is.  Arrows go on
+ * to the next match and ESC goes back to where the search started.
+ */
+static void editor_pager_find(void) {
+  struct editor_window *w = editor.win;
+  struct editor_pager *pager = w->buf->pager;
+  off_t saved_top_offset = w->top_offset;
+  long saved_top_line = w->top_line;
+  int saved_col_offset = w->col_offset;
+  char *query;
+
+  pager->origin = w->top_offset;
+  query = editor_prompt("Search: %s (ESC/Arrows/Enter, ^R regex)",
+                        editor_pager_find_callback);
+  editor_pager_search(pager, NULL, 0);
+  pager->shown = -1;
+
+  if (query == NULL) {
+    w->top_offset = saved_top_offset;
+    w->top_line = saved_top_line;
+    w->col_offset = saved_col_offset;
+  } else
+    free(query);
+}
+
+static void editor_pager_find_callback(const char *query, int key) {
+  struct editor_window *w = editor.win;
+  struct editor_pager *pager = w->buf->pager;
+  off_t match = -1, next;
+  int match_len = 0, render_x;
+
+  if (key == '\r' || key == ESC_CHAR || key == ARROW_LEFT || key == ARROW_UP)
+    return;
+
+  if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    if (pager->shown != -1)
+      editor_pager_search(pager, query, pager->shown + 1);
+    return;
+  } else if (key == CTRL('r')) {
+    editor.search.use_regex = !editor.search.use_regex;
+    editor_pager_search(pager, query, pager->origin);
+    return;
+  } else if (key != PAGER_UPDATE) {
+    if (key != SEARCH_UPDATE && key != SAVE_UPDATE && key != FOLLOW_UPDATE &&
+        key != RESIZE_UPDATE) {
+      pager->shown = -1;
+      editor_pager_search(pager, query, pager->origin);
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&pager->lock);
+  if (pager->search_state == PAGER_SEARCH_FOUND) {
+    match = pager->match;
+    match_len = pager->match_len;
+  }
+  pthread_mutex_unlock(&pager->lock);
+
+  if (match == -1 || match == pager->shown)
+    return;
+
+  w->top_offset = pager_line_start(pager, match, false);
+  w->top_line = -1;
+  render_x = editor_row_cx_to_rx(editor_pager_render(pager, w->top_offset,
+                                                     &next),
+                                 match - w->top_offset);
+  w->col_offset = render_x < w->cols ? 0 : render_x - w->cols / 2;
+  pager->shown = match;
+  pager->shown_len = match_len;
+  pager->direction = 1;
+}
+
+/*
+ * Act on `key` in a pager, which moves the view instead of a cursor and
+ * refuses to edit, or return false for the keys that do the same as in any
+ * other buffer.
+ */
+static bool editor_pager_key(int key) {
+  struct editor_window *w = editor.win;
+
+  switch (key) {
+  case ARROW_UP:
+  case ARROW_DOWN:
+    editor_pager_scroll(w, key == ARROW_UP ? -1 : 1);
+    break;
+  case PAGE_UP:
+  case PAGE_DOWN:
+    editor_pager_scroll(w, key == PAGE_UP ? -w->rows : w->rows);
+    break;
+  case ARROW_LEFT:
+    w->col_offset = MAX(w->col_offset - 1, 0);
+    break;
+  case ARROW_RIGHT:
+    w->col_offset++;
+    break;
+  case HOME_KEY:
+    w->top_offset = w->top_line = 0;
+    w->col_offset = 0;
+    w->buf->pager->direction = 1;
+    break;
+  case END_KEY:
+    editor_pager_end(w);
+    break;
+  case CTRL('f'):
+    editor_pager_find();
+    break;
+  case CTRL('g'):
+    editor_pager_goto_line();
+    break;
+  case CTRL('q'):
+  case CTRL('o'):
+  case CTRL('w'):
+  case CTRL('l'):
+  case PASTE_END:
+  case SEARCH_UPDATE:
+  case SAVE_UPDATE:
+  case FOLLOW_UPDATE:
+  case PAGER_UPDATE:
+  case RESIZE_UPDATE:
+  case ESC_CHAR:
+    return (false);
+  default:
+    editor_set_status_message("%s is open read-only", w->buf->file);
+    break;
+  }
+
+  return (true);
+}
+
+/*
+ * Draw the lines of a pager from the top of `w` on, pulled through the
+ * cache, and have the worker read ahead in the direction of the last scroll.
+ * Each screen is lexed from outside of a comment, as the state where it
+ * starts isn't known.
+ */
+static void editor_pager_draw_rows(struct editor_window *w) {
+  struct editor_screen *scr = &editor.screen;
+  struct editor_pager *pager = w->buf->pager;
+  off_t offset = w->top_offset, next, end = offset;
+  int from = w->col_offset;
+  bool in_comment = false;
+
+  for (int y = 0; y < w->rows; y++) {
+    struct editor_row *row;
+    enum editor_highlight *hl;
+    uint32_t *cell;
+    unsigned char *attr;
+    int len;
+
+    screen_clear(w->top + y, w->left, w->cols, HL_NORMAL);
+    if (offset == -1 || offset >= pager->size) {
+      screen_put(w->top + y, w->left, "~", 1, HL_NORMAL);
+      offset = -1;
+      continue;
+    }
+
+    row = editor_pager_render(pager, offset, &next);
+    hl = editor_hl_buf(row->render_size);
+    in_comment =
+        editor_lex(row->render, row->render_size, in_comment, hl, INT_MAX);
+    editor_row_hl_encode(row, hl, row->render_size);
+
+    len = MIN(MAX(row->render_size - from, 0), w->cols);
+    cell = &scr->chars[(w->top + y) * scr->cols + w->left];
+    attr = &scr->attrs[(w->top + y) * scr->cols + w->left];
+
+    editor_draw_highlight(row, from, attr, len);
+    if (pager->shown >= offset && pager->shown < offset + row->size) {
+      int x = pager->shown - offset;
+      int start = MAX(editor_row_cx_to_rx(row, x) - from, 0);
+      int stop = editor_row_cx_to_rx(
+                     row, MIN(x + pager->shown_len, row->size)) -
+                 from;
+
+      if (start < len && stop > start)
+        memset(&attr[start], HL_MATCH, MIN(stop, len) - start);
+    }
+    editor_draw_cells(row, from, cell, attr, len);
+
+    offset = next;
+    end = next == -1 ? pager->size : next;
+  }
+
+  pthread_mutex_lock(&pager->lock);
+  if (pager->direction < 0 && w->top_offset > 0)
+    pager->prefetch = (w->top_offset - 1) / KILO_PAGER_BLOCK;
+  else if (pager->direction > 0 && end < pager->size)
+    pager->prefetch = end / KILO_PAGER_BLOCK;
+  pager->prefetch_direction = pager->direction;
+  pthread_cond_signal(&pager->work);
+  pthread_mutex_unlock(&pager->lock);
+}
+
+/*
+ * The status bar of a pager, with the line at the top of the window and the
+ * number of lines, which has a + while the index is still counting them.
+ */
+static void editor_pager_draw_status_bar(struct editor_window *w) {
+  struct editor_buffer *buf = w->buf;
+  struct editor_pager *pager = buf->pager;
+  static const char *searching[] = {
+      [PAGER_SEARCH_IDLE] = "",
+      [PAGER_SEARCH_RUNNING] = "searching | ",
+      [PAGER_SEARCH_FOUND] = "",
+      [PAGER_SEARCH_MISSING] = "not found | ",
+      [PAGER_SEARCH_BAD_REGEX] = "bad regex | ",
+  };
+  char status[80], status_right[80], top[24] = "?";
+  enum pager_search_state state;
+  int y = w->top + w->rows, len, rlen, error;
+  long lines;
+  bool done;
+
+  if (w->top_line == -1)
+    w->top_line = pager_line_number(pager, w->top_offset);
+  if (w->top_line != -1)
+    snprintf(top, sizeof(top), "%ld", w->top_line + 1);
+
+  pthread_mutex_lock(&pager->lock);
+  lines = pager->index.lines;
+  done = pager->index.done;
+  error = pager->error;
+  state = pager->search_state;
+  pthread_mutex_unlock(&pager->lock);
+
+  len = snprintf(status, sizeof(status), "%.20s - %ld%s lines (read-only)",
+                 buf->file, lines, done ? "" : "+");
+  rlen = snprintf(status_right, sizeof(status_right),
+                  "%s%spager | %s | %s/%ld%s",
+                  error != 0 ? "read error | " : "",
+                  w == editor.win ? searching[state] : "",
+                  buf->syntax == NULL ? "no ft" : buf->syntax->file_type, top,
+                  lines, done ? "" : "+");
+
+  if (len > w->cols)
+    len = w->cols;
+
+  screen_clear(y, w->left, w->cols, ATTR_INVERT);
+  screen_put(y, w->left, status, len, ATTR_INVERT);
+
+  if (w->cols - len >= rlen)
+    screen_put(y, w->left + w->cols - rlen, status_right, rlen, ATTR_INVERT);
+}
+
+/* Start saving the text in the background, see struct editor_save. */
+static void editor_save(void) {
+  struct editor_save *save = &editor.save;
+
+  if (save->running) {
+    editor_set_status_message("A save is already in progress");
+    return;
+  }
+
+  if (editor.buf->file == NULL) {
+    editor.buf->file = editor_prompt("Save as: %s", NULL);
+
+    if (editor.buf->file == NULL) {
+      editor_set_status_message("Save aborted");
+      return;
+    }
+
+    editor_select_syntax_highlight();
+  }
+
+  if (asprintf(&save->tmp, "%s.XXXXXX", editor.buf->file) == -1)
+    die("asprintf");
+
+  save->buf = editor.buf;
+  editor_save_snapshot(save);
+  save->dirty = editor.buf->dirty;
+  save->swap_mark = editor.buf->swap.logged;
+  save->follow_offset = editor.buf->follow.offset;
+  save->error = 0;
+  atomic_store(&save->written, 0);
+  atomic_store(&save->done, false);
+  if ((errno = pthread_create(&save->worker, NULL, editor_save_worker,
+                              save)) != 0)
+    die("pthread_create");
+  save->running = true;
+}
+
+/* Queue `len` bytes at `p`, extending the last entry if they follow it. */
+static void editor_save_add(struct editor_save *save, char *p, size_t len) {
+  if (len == 0)
+    return;
+
+  save->total += len;
+  if (save->num_iov != 0) {
+    struct iovec *last = &save->iov[save->num_iov - 1];
+
+    if ((char *)last->iov_base + last->iov_len == p &&
+        last->iov_len + len <= KILO_SAVE_CHUNK) {
+      last->iov_len += len;
+      return;
+    }
+  }
+
+  if (save->num_iov == save->iov_capacity) {
+    save->iov_capacity = save->iov_capacity == 0 ? 64 : save->iov_capacity * 2;
+    save->iov = realloc(save->iov, sizeof(*save->iov) * save->iov_capacity);
+    if (save->iov == NULL)
+      die("realloc");
+  }
+
+  save->iov[save->num_iov].iov_base = p;
+  save->iov[save->num_iov].iov_len = len;
+  save->num_iov++;
+}
+
+static void editor_save_snapshot(struct editor_save *save) {
+  static char newline = '\n';
+  struct text_store *ts = &editor.buf->text;
+  size_t copy_len = 0;
+  char *copy;
+
+  for (int i = 0; i < ts->num_rows; i++) {
+    struct editor_row *row = editor_row_at(i);
+
+    if (row->capacity != 0)
+      copy_len += row->size + 1;
+  }
+
+  if ((save->copy = copy = malloc(MAX(copy_len, 1))) == NULL)
+    die("malloc");
+
+  save->num_iov = 0;
+  save->total = 0;
+  for (int i = 0; i < ts->num_rows; i++) {
+    struct editor_row *row = editor_row_at(i);
+
+    if (row->capacity != 0) {
+      memcpy(copy, row->chars, row->size);
+      copy[row->size] = '\n';
+      editor_save_add(save, copy, row->size + 1);
+      copy += row->size + 1;
+    } else if (&row->chars[row->size] < &ts->base[ts->base_len] &&
+               row->chars[row->size] == '\n') {
+      editor_save_add(save, row->chars, row->size + 1);
+    } else {
+      editor_save_add(save, row->chars, row->size);
+      editor_save_add(save, &newline, 1);
+    }
+  }
+}
+
+static void *editor_save_worker(void *arg) {
+  struct editor_save *save = arg;
+  const char *file = save->buf->file;
+  mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+  struct stat st;
+  int fd;
+
+  if (stat(file, &st) == 0)
+    mode = st.st_mode & ALLPERMS;
+
+  if ((fd = mkstemp(save->tmp)) == -1) {
+    save->error = errno;
+  } else {
+    if (fchmod(fd, mode) == -1 || editor_save_write(save, fd) == -1 ||
+        fsync(fd) == -1)
+      save->error = errno;
+    if (close(fd) == -1 && save->error == 0)
+      save->error = errno;
+    if (save->error == 0 && rename(save->tmp, file) == -1)
+      save->error = errno;
+    if (save->error != 0)
+      unlink(save->tmp);
+  }
+
+  atomic_store(&save->done, true);
+  editor_save_notify();
+
+  return (NULL);
+}
+
+/* Write out all of `iov`, KILO_SAVE_BATCH entries at a time. */
+static int editor_save_write(struct editor_save *save, int fd) {
+  struct iovec *iov = save->iov;
+  int left = save->num_iov;
+
+  while (left > 0) {
+    ssize_t n = writev(fd, iov, MIN(left, KILO_SAVE_BATCH));
+
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return (-1);
+    }
+
+    atomic_fetch_add(&save->written, n);
+    editor_save_notify();
+
+    for (; left > 0 && (size_t)n >= iov->iov_len; iov++, left--)
+      n -= iov->iov_len;
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  return (0);
+}
+
+static void editor_save_notify(void) {
+  struct kevent event;
+
+  EV_SET(&event, KILO_SAVE_EVENT, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+  if (kevent(editor.kq, &event, 1, NULL, 0, NULL) == -1)
+    die("kevent trigger");
+}
+
+/* Redraw the progress, and wrap up once the worker is done. */
+static void editor_save_collect(void) {
+  struct editor_save *save = &editor.save;
+
+  if (!save->running)
+    return;
+
+  save->updated = true;
+  if (atomic_load(&save->done))
+    editor_save_finish(save);
+}
+
+/* Wait for the worker and report how the save went. */
+static void editor_save_finish(struct editor_save *save) {
+  struct editor_buffer *buf = save->buf;
+
+  if ((errno = pthread_join(save->worker, NULL)) != 0)
+    die("pthread_join");
+  save->running = false;
+
+  if (save->error != 0)
+    editor_set_status_message("Can't save! I/O error %s",
+                              strerror(save->error));
+  else {
+    editor_set_status_message("%zu bytes written to disk", save->total);
+    buf->dirty -= save->dirty;
+    editor_swap_rebase(buf, save->swap_mark, save->total);
+    if (buf->path == NULL)
+      buf->path = realpath(buf->file, NULL);
+
+    /*
+     * The saved file ends with a newline, so only a line appended since the
+     * snapshot can still be open.
+     */
+    if (buf->follow.offset == save->follow_offset)
+      buf->follow.partial = false;
+    buf->follow.offset =
+        save->total + (buf->follow.offset - save->follow_offset);
+    if (buf->follow.fd != -1) {
+      editor_follow_close(buf);
+      editor_follow_open(buf);
+    }
+  }
+
+  if (buf->swap.path == NULL)
+    sbuf_clear(buf->swap.buf);
+
+  free(save->tmp);
+  free(save->copy);
+  save->tmp = save->copy = NULL;
+}
+
+/*
+ * Compile `pattern` into an NFA.  The syntax is a small subset of POSIX
+ * extended regular expressions: literals, `.`, bracket expressions with
+ * ranges, `\d`, `\w` and `\s`, the `*`, `+` and `?` repetitions,
+ * alternation, groups and the `^` and `$` anchors.
+ */
+static struct regex *regex_compile(const char *pattern) {
+  struct regex *re = calloc(1, sizeof(*re));
+  struct regex_frag frag;
+  const char *p = pattern;
+  int match;
+
+  if (re == NULL)
+    die("calloc");
+  if ((re->pattern = strdup(pattern)) == NULL)
+    die("strdup");
+
+  frag = regex_parse_alt(re, &p);
+  if (re->error || *p != '\0') {
+    regex_free(re);
+    return (NULL);
+  }
+
+  match = regex_node(re, RE_MATCH, -1, -1);
+  re->nodes[frag.end].out = match;
+  re->start = frag.start;
+
+  p = pattern;
+  re->reverse = true;
+  frag = regex_parse_alt(re, &p);
+  re->nodes[frag.end].out = match;
+  re->reverse_start = frag.start;
+
+  if ((re->mark = calloc(re->num_nodes, sizeof(*re->mark))) == NULL ||
+      (re->list = malloc(sizeof(*re->list) * re->num_nodes)) == NULL ||
+      (re->seeds = malloc(sizeof(*re->seeds) * (re->num_nodes + 1))) == NULL)
+    die("malloc");
+
+  for (size_t i = 0; i < nitems(re->dfa); i++) {
+    struct regex_dfa *dfa = &re->dfa[i];
+
+    dfa->unanchored = i == 1;
+    dfa->root = i == 1 ? re->reverse_start : re->start;
+    for (size_t j = 0; j < nitems(dfa->table); j++)
+      dfa->table[j] = -1;
+    dfa->start[0] = dfa->start[1] = -1;
+  }
+
+  return (re);
+}
+
+static void regex_free(struct regex *re) {
+  if (re == NULL)
+    return;
+
+  for (size_t i = 0; i < nitems(re->dfa); i++) {
+    regex_dfa_flush(&re->dfa[i]);
+    free(re->dfa[i].states);
+  }
+
+  free(re->pattern);
+  free(re->nodes);
+  free(re->mark);
+  free(re->list);
+  free(re->seeds);
+  free(re->starts);
+  free(re);
+}
+
+static int regex_node(struct regex *re, enum regex_op op, int out, int out1) {
+  struct regex_node *node;
+
+  if (re->num_nodes == re->capacity) {
+    re->capacity = re->capacity == 0 ? 32 : re->capacity * 2;
+    re->nodes = realloc(re->nodes, sizeof(*re->nodes) * re->capacity);
+    if (re->nodes == NULL)
+      die("realloc");
+  }
+
+  node = &re->nodes[re->num_nodes];
+  node->op = op;
+  node->out = out;
+  node->out1 = out1;
+  memset(node->set, 0, sizeof(node->set));
+
+  return (re->num_nodes++);
+}
+
+/* A fragment ends in an empty node whose `out` is filled in later. */
+static struct regex_frag regex_frag(struct regex *re, enum regex_op op) {
+  struct regex_frag frag;
+
+  frag.end = regex_node(re, RE_EPS, -1, -1);
+  frag.start = op == RE_EPS ? frag.end : regex_node(re, op, frag.end, -1);
+
+  return (frag);
+}
+
+static void regex_set_add(unsigned char *set, int from, int to) {
+  for (int c = from; c <= to; c++)
+    set[c >> 3] |= 1 << (c & 7);
+}
+
+/* Add the class named by the escape `c` to `set`, if it names one. */
+static bool regex_set_escape(unsigned char *set, char c) {
+  switch (c) {
+  case 'd':
+    regex_set_add(set, '0', '9');
+    return (true);
+  case 'w':
+    regex_set_add(set, '0', '9');
+    regex_set_add(set, 'A', 'Z');
+    regex_set_add(set, 'a', 'z');
+    regex_set_add(set, '_', '_');
+    return (true);
+  case 's':
+    regex_set_add(set, '\t', '\r');
+    regex_set_add(set, ' ', ' ');
+    return (true);
+  }
+
+  return (false);
+}
+
+static struct regex_frag regex_parse_alt(struct regex *re, const char **p) {
+  struct regex_frag frag = regex_parse_concat(re, p);
+
+  while (!re->error && **p == '|') {
+    struct regex_frag alt;
+    int split, end;
+
+    (*p)++;
+    alt = regex_parse_concat(re, p);
+    split = regex_node(re, RE_SPLIT, frag.start, alt.start);
+    end = regex_node(re, RE_EPS, -1, -1);
+    re->nodes[frag.end].out = re->nodes[alt.end].out = end;
+    frag.start = split;
+    frag.end = end;
+  }
+
+  return (frag);
+}
+
+/* Pieces are chained in the order they come, or the other way round. */
+static struct regex_frag regex_parse_concat(struct regex *re, const char **p) {
+  struct regex_frag frag = regex_frag(re, RE_EPS);
+
+  while (!re->error && **p != '\0' && **p != '|' && **p != ')') {
+    struct regex_frag next = regex_parse_repeat(re, p);
+
+    if (re->reverse) {
+      re->nodes[next.end].out = frag.start;
+      frag.start = next.start;
+    } else {
+      re->nodes[frag.end].out = next.start;
+      frag.end = next.end;
+    }
+  }
+
+  return (frag);
+}
+
+static struct regex_frag regex_parse_repeat(struct regex *re, const char **p) {
+  struct regex_frag frag = regex_parse_atom(re, p);
+
+  while (!re->error && (**p == '*' || **p == '+' || **p == '?')) {
+    int end = regex_node(re, RE_EPS, -1, -1);
+    int split = regex_node(re, RE_SPLIT, frag.start, end);
+
+    re->nodes[frag.end].out = **p == '?' ? end : split;
+    if (**p != '+')
+      frag.start = split;
+    frag.end = end;
+    (*p)++;
+  }
+
+  return (frag);
+}
+
+static struct regex_frag regex_parse_atom(struct regex *re, const char **p) {
+  struct regex_frag frag;
+  unsigned char *set;
+  char c = *(*p)++;
+
+  switch (c) {
+  case '(':
+    frag = regex_parse_alt(re, p);
+    if (**p != ')')
+      re->error = true;
+    else
+      (*p)++;
+    return (frag);
+  case '^':
+    return (regex_frag(re, re->reverse ? RE_EOL : RE_BOL));
+  case '$':
+    return (regex_frag(re, re->reverse ? RE_BOL : RE_EOL));
+  case '*':
+  case '+':
+  case '?':
+    re->error = true;
+    return (regex_frag(re, RE_EPS));
+  }
+
+  frag = regex_frag(re, RE_SET);
+  set = re->nodes[frag.start].set;
+
+  if (c == '.') {
+    regex_set_add(set, 0, UCHAR_MAX);
+  } else if (c == '\\') {
+    if (**p == '\0')
+      re->error = true;
+    else if (!regex_set_escape(set, **p))
+      regex_set_add(set, (unsigned char)**p, (unsigned char)**p);
+    (*p)++;
+  } else if (c == '[') {
+    bool negate = **p == '^';
+
+    if (negate)
+      (*p)++;
+
+    for (bool first = true; first || **p != ']'; first = false) {
+      unsigned char from = *(*p)++, to;
+
+      if (from == '\0') {
+        re->error = true;
+        return (frag);
+      }
+
+      if (from == '\\' && **p != '\0') {
+        if (regex_set_escape(set, **p)) {
+          (*p)++;
+          continue;
+        }
+        from = *(*p)++;
+      }
+
+      to = from;
+      if ((*p)[0] == '-' && (*p)[1] != ']' && (*p)[1] != '\0') {
+        to = (*p)[1];
+        *p += 2;
+      }
+
+      if (to >= from)
+        regex_set_add(set, from, to);
+    }
+    (*p)++;
+
+    if (negate) {
+      for (size_t i = 0; i < sizeof(re->nodes[frag.start].set); i++)
+        set[i] = ~set[i];
+    }
+  } else
+    regex_set_add(set, (unsigned char)c, (unsigned char)c);
+
+  return (frag);
+}
+
+/*
+ * Add `node` and everything reachable from it through empty transitions to
+ * `re->list`.  Only the nodes that consume input, the `$` anchors and the
+ * final node are kept, as they are all that tells states apart.
+ */
+static void regex_closure(struct regex *re, int node, bool at_bol) {
+  struct regex_node *n;
+
+  if (node < 0 || re->mark[node] == re->generation)
+    return;
+
+  re->mark[node] = re->generation;
+  n = &re->nodes[node];
+
+  switch (n->op) {
+  case RE_EPS:
+    regex_closure(re, n->out, at_bol);
+    break;
+  case RE_SPLIT:
+    regex_closure(re, n->out, at_bol);
+    regex_closure(re, n->out1, at_bol);
+    break;
+  case RE_BOL:
+    if (at_bol)
+      regex_closure(re, n->out, at_bol);
+    break;
+  case RE_SET:
+  case RE_EOL:
+  case RE_MATCH:
+    re->list[re->num_list++] = node;
+    break;
+  }
+}
+
+/* Whether the end of the line can be matched from a `$` node. */
+static bool regex_accepts_eol(struct regex *re, int node) {
+  struct regex_node *n;
+
+  if (node < 0 || re->mark[node] == re->generation)
+    return (false);
+
+  re->mark[node] = re->generation;
+  n = &re->nodes[node];
+
+  switch (n->op) {
+  case RE_MATCH:
+    return (true);
+  case RE_EPS:
+  case RE_EOL:
+    return (regex_accepts_eol(re, n->out));
+  case RE_SPLIT:
+    return (regex_accepts_eol(re, n->out) || regex_accepts_eol(re, n->out1));
+  default:
+    return (false);
+  }
+}
+
+static int compare_int(const void *a, const void *b) {
+  return (*(const int *)a - *(const int *)b);
+}
+
+static unsigned int regex_hash(const int *nodes, int n) {
+  unsigned int h = 2166136261u;
+
+  for (int i = 0; i < n; i++)
+    h = (h ^ (unsigned int)nodes[i]) * 16777619u;
+
+  return (h);
+}
+
+/*
+ * Compute the closure of the `n` seeds and return the DFA state for it,
+ * creating it if needed, or -1 if the DFA is full.
+ */
+static int regex_dfa_state(struct regex *re, struct regex_dfa *dfa,
+                           const int *seeds, int n, bool at_bol) {
+  struct regex_state *state;
+  unsigned int h;
+
+  re->generation++;
+  re->num_list = 0;
+  for (int i = 0; i < n; i++)
+    regex_closure(re, seeds[i], at_bol);
+  qsort(re->list, re->num_list, sizeof(*re->list), compare_int);
+
+  h = regex_hash(re->list, re->num_list) & (nitems(dfa->table) - 1);
+  for (; dfa->table[h] != -1; h = (h + 1) & (nitems(dfa->table) - 1)) {
+    state = &dfa->states[dfa->table[h]];
+    if (state->num_nodes == re->num_list &&
+        memcmp(state->nodes, re->list, sizeof(*re->list) * re->num_list) == 0)
+      return (dfa->table[h]);
+  }
+
+  if (dfa->num_states == KILO_REGEX_STATES)
+    return (-1);
+
+  if (dfa->num_states == dfa->capacity) {
+    dfa->capacity = dfa->capacity == 0 ? 16 : dfa->capacity * 2;
+    dfa->states = realloc(dfa->states, sizeof(*dfa->states) * dfa->capacity);
+    if (dfa->states == NULL)
+      die("realloc");
+  }
+
+  state = &dfa->states[dfa->num_states];
+  state->num_nodes = re->num_list;
+  if ((state->nodes = malloc(sizeof(*re->list) * (re->num_list + 1))) == NULL)
+    die("malloc");
+  memcpy(state->nodes, re->list, sizeof(*re->list) * re->num_list);
+  for (size_t c = 0; c < nitems(state->next); c++)
+    state->next[c] = -1;
+
+  state->accept = state->accept_eol = false;
+  for (int i = 0; i < state->num_nodes; i++) {
+    struct regex_node *node = &re->nodes[state->nodes[i]];
+
+    if (node->op == RE_MATCH)
+      state->accept = state->accept_eol = true;
+  }
+  for (int i = 0; i < state->num_nodes && !state->accept_eol; i++) {
+    if (re->nodes[state->nodes[i]].op == RE_EOL) {
+      re->generation++;
+      state->accept_eol = regex_accepts_eol(re, state->nodes[i]);
+    }
+  }
+
+  dfa->table[h] = dfa->num_states;
+
+  return (dfa->num_states++);
+}
+
+/* Drop all the states of a DFA that grew too large. */
+static void regex_dfa_flush(struct regex_dfa *dfa) {
+  for (int i = 0; i < dfa->num_states; i++)
+    free(dfa->states[i].nodes);
+
+  dfa->num_states = 0;
+  for (size_t i = 0; i < nitems(dfa->table); i++)
+    dfa->table[i] = -1;
+  dfa->start[0] = dfa->start[1] = -1;
+}
+
+static int regex_dfa_start(struct regex *re, struct regex_dfa *dfa,
+                           bool at_bol) {
+  if (dfa->start[at_bol] == -1) {
+    if ((dfa->start[at_bol] = regex_dfa_state(re, dfa, &dfa->root, 1,
+                                              at_bol)) == -1) {
+      regex_dfa_flush(dfa);
+      dfa->start[at_bol] = regex_dfa_state(re, dfa, &dfa->root, 1, at_bol);
+    }
+  }
+
+  return (dfa->start[at_bol]);
+}
+
+/* Seeds for the state following the `n` nodes on `c`. */
+static int regex_dfa_seeds(struct regex *re, struct regex_dfa *dfa,
+                           const int *nodes, int n, unsigned char c) {
+  int num_seeds = 0;
+
+  for (int i = 0; i < n; i++) {
+    struct regex_node *node = &re->nodes[nodes[i]];
+
+    if (node->op == RE_SET && (node->set[c >> 3] & (1 << (c & 7))) != 0)
+      re->seeds[num_seeds++] = node->out;
+  }
+
+  if (dfa->unanchored)
+    re->seeds[num_seeds++] = dfa->root;
+
+  return (num_seeds);
+}
+
+/*
+ * Follow the transition on `c` out of `*state`, building the next state the
+ * first time it is taken.  When the DFA is full it is flushed and `*state`
+ * rebuilt, so its index may change.
+ */
+static int regex_dfa_step(struct regex *re, struct regex_dfa *dfa, int *state,
+                          unsigned char c) {
+  struct regex_state *from = &dfa->states[*state];
+  int next, num_seeds;
+
+  if ((next = from->next[c]) != -1)
+    return (next);
+
+  num_seeds = regex_dfa_seeds(re, dfa, from->nodes, from->num_nodes, c);
+  if ((next = regex_dfa_state(re, dfa, re->seeds, num_seeds, false)) == -1) {
+    int n = from->num_nodes, *nodes = malloc(sizeof(*nodes) * (n + 1));
+
+    if (nodes == NULL)
+      die("malloc");
+    memcpy(nodes, from->nodes, sizeof(*nodes) * n);
+    regex_dfa_flush(dfa);
+
+    /* The nodes of a state are their own closure. */
+    *state = regex_dfa_state(re, dfa, nodes, n, false);
+    num_seeds = regex_dfa_seeds(re, dfa, nodes, n, c);
+    next = regex_dfa_state(re, dfa, re->seeds, num_seeds, false);
+    free(nodes);
+  }
+
+  dfa->states[*state].next[c] = next;
+
+  return (next);
+}
+
+/*
+ * Mark every position in `s[0..len]` where a match starts.  The reversed
+ * pattern is run once from the end of the line back, so it accepts wherever
+ * one does.
+ */
+static void regex_starts(struct regex *re, const char *s, int len) {
+  struct regex_dfa *dfa = &re->dfa[1];
+  int state = regex_dfa_start(re, dfa, true), words = len / 64 + 1;
+
+  if (words > re->starts_capacity) {
+    re->starts_capacity = MAX(words, re->starts_capacity * 2);
+    re->starts = realloc(re->starts, sizeof(*re->starts) * re->starts_capacity);
+    if (re->starts == NULL)
+      die("realloc");
+  }
+  memset(re->starts, 0, sizeof(*re->starts) * words);
+
+  for (int i = len;; i--) {
+    struct regex_state *st = &dfa->states[state];
+
+    if (st->accept || (i == 0 && st->accept_eol))
+      re->starts[i / 64] |= UINT64_C(1) << (i % 64);
+    if (i == 0)
+      return;
+
+    state = regex_dfa_step(re, dfa, &state, s[i - 1]);
+  }
+}
+
+/* The first start marked by regex_starts() at or after `from`, or -1. */
+static int regex_next_start(const struct regex *re, int len, int from) {
+  for (int w = from / 64; w <= len / 64; w++) {
+    uint64_t bits = re->starts[w];
+
+    if (w == from / 64)
+      bits &= ~UINT64_C(0) << (from % 64);
+    if (bits != 0)
+      return (w * 64 + ffsll(bits) - 1);
+  }
+
+  return (-1);
+}
+
+/* Length of the longest match starting at `from`, or -1. */
+static int regex_longest(struct regex *re, const char *s, int len, int from) {
+  struct regex_dfa *dfa = &re->dfa[0];
+  int state = regex_dfa_start(re, dfa, from == 0);
+  int longest = -1;
+
+  for (int i = from;; i++) {
+    struct regex_state *st = &dfa->states[state];
+
+    if (st->accept || (i == len && st->accept_eol))
+      longest = i - from;
+    if (i == len || st->num_nodes == 0)
+      return (longest);
+
+    state = regex_dfa_step(re, dfa, &state, s[i]);
+  }
+}
+
+/*
+ * Find the leftmost longest match in `s[from..len)`, which may be empty.  A
+ * pass of the reversed pattern back from the end of the line finds where it
+ * starts, and one of the anchored DFA from there where it ends.  To find all
+ * the matches of a line, mark their starts once with regex_starts() instead.
+ */
+static bool regex_find(struct regex *re, const char *s, int len, int from,
+                       int *start, int *match_len) {
+  regex_starts(re, s, len);
+  if ((*start = regex_next_start(re, len, from)) == -1)
+    return (false);
+
+  *match_len = regex_longest(re, s, len, *start);
+  return (true);
+}
+
+/* Look up a compiled pattern, the most recently used ones coming first. */
+static struct regex *regex_lookup(struct regex **cache, const char *pattern) {
+  struct regex *re = NULL;
+  size_t i;
+
+  for (i = 0; i < KILO_REGEX_CACHE && cache[i] != NULL; i++) {
+    if (strcmp(cache[i]->pattern, pattern) == 0) {
+      re = cache[i];
+      break;
+    }
+  }
+
+  if (re == NULL) {
+    if ((re = regex_compile(pattern)) == NULL)
+      return (NULL);
+    if (i == KILO_REGEX_CACHE)
+      regex_free(cache[--i]);
+  }
+
+  memmove(&cache[1], &cache[0], sizeof(*cache) * i);
+  cache[0] = re;
+
+  return (re);
+}
+
+/*
+ * Locate `needle` in `s`.  Candidate positions are checked 16 at a time
+ * against the first and the last byte of the needle, and only those where
+ * both match are compared in full.  Unlike strstr() this works on text with
+ * NULs in it.
+ */
+static const char *search_memmem(const char *s, size_t len,
+                                 const char *needle, size_t needle_len) {
+  size_t i = 0;
+  char first, last;
+
+  if (needle_len == 0 || needle_len > len)
+    return (NULL);
+
+  if (needle_len == 1)
+    return (memchr(s, needle[0], len));
+
+  first = needle[0];
+  last = needle[needle_len - 1];
+
+#if defined(__SSE2__)
+  {
+    __m128i vfirst = _mm_set1_epi8(first), vlast = _mm_set1_epi8(last);
+
+    for (; i + needle_len - 1 + 16 <= len; i += 16) {
+      __m128i bfirst = _mm_loadu_si128((const __m128i *)&s[i]);
+      __m128i blast =
+          _mm_loadu_si128((const __m128i *)&s[i + needle_len - 1]);
+      int mask = _mm_movemask_epi8(_mm_and_si128(
+          _mm_cmpeq_epi8(vfirst, bfirst), _mm_cmpeq_epi8(vlast, blast)));
+
+      for (; mask != 0; mask &= mask - 1) {
+        size_t at = i + ffs(mask) - 1;
+
+        if (memcmp(&s[at + 1], &needle[1], needle_len - 2) == 0)
+          return (&s[at]);
+      }
+    }
+  }
+#elif defined(__ARM_NEON)
+  {
+    uint8x16_t vfirst = vdupq_n_u8(first), vlast = vdupq_n_u8(last);
+
+    for (; i + needle_len - 1 + 16 <= len; i += 16) {
+      uint8x16_t eq = vandq_u8(
+          vceqq_u8(vfirst, vld1q_u8((const uint8_t *)&s[i])),
+          vceqq_u8(vlast, vld1q_u8((const uint8_t *)&s[i + needle_len - 1])));
+      /* Narrow each byte of the mask to a nibble. */
+      uint64_t mask = vget_lane_u64(
+          vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+
+      for (; mask != 0; mask &= ~(UINT64_C(0xf) << (ffsll(mask) - 1))) {
+        size_t at = i + (ffsll(mask) - 1) / 4;
+
+        if (memcmp(&s[at + 1], &needle[1], needle_len - 2) == 0)
+          return (&s[at]);
+      }
+    }
+  }
+#endif
+
+  while (i + needle_len <= len) {
+    const char *p = memchr(&s[i], first, len - needle_len + 1 - i);
+
+    if (p == NULL)
+      break;
+
+    i = p - s;
+    if (s[i + needle_len - 1] == last &&
+        memcmp(&s[i + 1], &needle[1], needle_len - 2) == 0)
+      return (p);
+    i++;
+  }
+
+  return (NULL);
+}
+
+static void match_append(struct editor_match **list, int *len, int *capacity,
+                         const struct editor_match *m, int n) {
+  if (*len + n > *capacity) {
+    while (*len + n > *capacity)
+      *capacity = *capacity == 0 ? 64 : *capacity * 2;
+    if ((*list = realloc(*list, sizeof(**list) * *capacity)) == NULL)
+      die("realloc");
+  }
+
+  memcpy(&(*list)[*len], m, sizeof(*m) * n);
+  *len += n;
+}
+
+/* Index of the first match at or after the given position. */
+static int editor_search_seek(struct editor_search *search, int row,
+                              int cursor_x) {
+  int lo = 0, hi = search->num_matches;
+
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    struct editor_match *m = &search->matches[mid];
+
+    if (m->row < row || (m->row == row && m->cursor_x < cursor_x))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return (lo);
+}
+
+/*
+ * Pick the current match once there is one at or after the seek position,
+ * or wrap around to the first one when the search is complete.
+ */
+static void editor_search_pick(struct editor_search *search) {
+  int i;
+
+  if (search->current >= 0 || search->num_matches == 0)
+    return;
+
+  i = editor_search_seek(search, search->seek_row, search->seek_x);
+  if (i < search->num_matches)
+    search->current = i;
+  else if (!search->running)
+    search->current = 0;
+}
+
+/* Hand a batch of matches over to the main thread and wake it up. */
+static void editor_search_flush(struct editor_search *search,
+                                const struct editor_match *batch, int n,
+                                bool done) {
+  struct kevent event;
+
+  pthread_mutex_lock(&search->lock);
+  match_append(&search->pending, &search->num_pending,
+               &search->pending_capacity, batch, n);
+  search->done = done;
+  pthread_mutex_unlock(&search->lock);
+
+  EV_SET(&event, KILO_SEARCH_EVENT, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+  if (kevent(editor.kq, &event, 1, NULL, 0, NULL) == -1) {
+    pthread_mutex_lock(&search->lock);
+    if (search->error == 0)
+      search->error = errno;
+    pthread_mutex_unlock(&search->lock);
+    atomic_store(&search->cancel, true);
+  }
+}
+
+/*
+ * Find the next match in `row` at or after `from`.  In regex mode the starts
+ * of the matches in `row` have been marked by regex_starts().
+ */
+static bool editor_search_next(struct editor_search *search,
+                               struct editor_row *row, int from,
+                               struct editor_match *m) {
+  const char *match;
+
+  if (search->regex != NULL) {
+    if ((m->cursor_x = regex_next_start(search->regex, row->size, from)) == -1)
+      return (false);
+    m->len = regex_longest(search->regex, row->chars, row->size, m->cursor_x);
+    return (true);
+  }
+
+  if ((match = search_memmem(&row->chars[from], row->size - from,
+                             search->query, search->query_len)) == NULL)
+    return (false);
+
+  m->cursor_x = match - row->chars;
+  m->len = search->query_len;
+
+  return (true);
+}
+
+/*
+ * The first match is handed over as soon as it is found, so that the prompt
+ * can jump to it right away, and the rest whenever a batch fills up or a
+ * good number of rows have been scanned since the last one.
+ */
+static void *editor_search_worker(void *arg) {
+  struct editor_search *search = arg;
+  struct text_store *ts = &search->snapshot;
+  struct editor_match batch[KILO_SEARCH_BATCH];
+  int n = 0, flushed = 0;
+  bool first = true;
+
+  for (int y = 0; y < ts->num_rows && !atomic_load(&search->cancel); y++) {
+    struct editor_row *row = text_store_at(ts, y);
+    int from = 0;
+
+    if (search->regex != NULL)
+      regex_starts(search->regex, row->chars, row->size);
+    while (from <= row->size &&
+           editor_search_next(search, row, from, &batch[n])) {
+      batch[n].row = y;
+      from = batch[n].cursor_x +
+             (search->regex != NULL ? MAX(batch[n].len, 1) : 1);
+      if (++n == KILO_SEARCH_BATCH || first) {
+        editor_search_flush(search, batch, n, false);
+        n = 0;
+        flushed = y;
+        first = false;
+      }
+    }
+
+    if (n != 0 && y - flushed >= KILO_SEARCH_FLUSH_ROWS) {
+      editor_search_flush(search, batch, n, false);
+      n = 0;
+      flushed = y;
+    }
+  }
+
+  editor_search_flush(search, batch, n, true);
+
+  return (NULL);
+}
+
+/* Stop the worker, if any, and drop what it hasn't handed over yet. */
+static void editor_search_stop(struct editor_search *search) {
+  if (!search->running)
+    return;
+
+  atomic_store(&search->cancel, true);
+  if ((errno = pthread_join(search->worker, NULL)) != 0)
+    die("pthread_join");
+
+  search->running = search->updated = search->done = false;
+  search->num_pending = 0;
+}
+
+static void editor_search_start(struct editor_search *search) {
+  search->num_matches = 0;
+  search->regex = NULL;
+  search->bad_regex = false;
+  if (search->query_len == 0)
+    return;
+
+  if (search->use_regex &&
+      (search->regex = regex_lookup(search->cache, search->query)) == NULL) {
+    search->bad_regex = true;
+    return;
+  }
+
+  search->snapshot = editor.buf->text;
+  search->error = 0;
+  atomic_store(&search->cancel, false);
+  if ((errno = pthread_create(&search->worker, NULL, editor_search_worker,
+                              search)) != 0)
+    die("pthread_create");
+  search->running = true;
+}
+
+/*
+ * Bring the matches up to date with `query`, and keep the current match on
+ * the one it was on, or the next one if that one is gone.
+ */
+static void editor_search_update(const char *query) {
+  struct editor_search *search = &editor.search;
+  size_t len = strlen(query), old_len = search->query_len;
+  bool narrow = !search->use_regex && !search->running && old_len != 0 &&
+                len >= old_len && memcmp(query, search->query, old_len) == 0;
+
+  if (search->current >= 0) {
+    search->seek_row = search->matches[search->current].row;
+    search->seek_x = search->matches[search->current].cursor_x;
+  }
+
+  editor_search_stop(search);
+
+  free(search->query);
+  if ((search->query = strdup(query)) == NULL)
+    die("strdup");
+  search->query_len = len;
+  search->current = -1;
+
+  if (narrow) {
+    int n = 0;
+
+    for (int i = 0; i < search->num_matches; i++) {
+      struct editor_match *m = &search->matches[i];
+      struct editor_row *r = editor_row_at(m->row);
+
+      if ((size_t)(r->size - m->cursor_x) >= len &&
+          memcmp(&r->chars[m->cursor_x + old_len], &query[old_len],
+                 len - old_len) == 0) {
+        m->len = len;
+        search->matches[n++] = *m;
+      }
+    }
+    search->num_matches = n;
+  } else
+    editor_search_start(search);
+
+  editor_search_pick(search);
+}
+
+/* Take over the matches the worker has found so far. */
+static void editor_search_collect(void) {
+  struct editor_search *search = &editor.search;
+  bool done;
+
+  if (!search->running)
+    return;
+
+  pthread_mutex_lock(&search->lock);
+  match_append(&search->matches, &search->num_matches, &search->capacity,
+               search->pending, search->num_pending);
+  search->num_pending = 0;
+  done = search->done;
+  pthread_mutex_unlock(&search->lock);
+
+  if (done) {
+    if ((errno = pthread_join(search->worker, NULL)) != 0)
+      die("pthread_join");
+    search->running = search->done = false;
+  }
+
+  editor_search_pick(search);
+  search->updated = true;
+}
+
+static void editor_search_reset(void) {
+  struct editor_search *search = &editor.search;
+
+  editor_search_stop(search);
+  free(search->query);
+  free(search->matches);
+  search->query = NULL;
+  search->matches = NULL;
+  search->query_len = 0;
+  search->num_matches = search->capacity = 0;
+  search->current = -1;
+  search->seek_row = search->seek_x = 0;
+  search->regex = NULL;
+  search->active = search->bad_regex = false;
+  search->error = 0;
+}
+
+/* Free the compiled patterns on the way out. */
+static void editor_search_release(void) {
+  for (size_t i = 0; i < nitems(editor.search.cache); i++) {
+    regex_free(editor.search.cache[i]);
+    editor.search.cache[i] = NULL;
+  }
+}
+
+static void editor_find(void) {
+  int save_cursor_x = editor.win->cursor_x;
+  int save_cursor_y = editor.win->cursor_y;
+  int saved_col_offset = editor.win->col_offset;
+  int saved_row_offset = editor.win->row_offset;
+  char *query;
+
+  editor.search.active = true;
+  query = editor_prompt("Search: %s (ESC/Arrows/Enter, ^R regex)",
+                        editor_find_callback);
+  editor_search_reset();
+  editor_follow_read(editor.buf, 0);
+
+  if (query == NULL) {
+    editor.win->cursor_x = save_cursor_x;
+    editor.win->cursor_y = save_cursor_y;
+    editor.win->col_offset = saved_col_offset;
+    editor.win->row_offset = saved_row_offset;
+  } else
+    free(query);
+}
+
+static void editor_find_callback(const char *query, int key) {
+  struct editor_search *search = &editor.search;
+  struct editor_window *w = editor.win;
+  struct editor_match *m;
+
+  if (key == '\r' || key == ESC_CHAR)
+    return;
+
+  /* The worker may not have been able to wake us up. */
+  editor_search_collect();
+
+  if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    if (search->num_matches != 0)
+      search->current = (search->current + 1) % search->num_matches;
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    if (search->num_matches != 0)
+      search->current = (search->current + search->num_matches - 1) %
+                        search->num_matches;
+  } else if (key == CTRL('r')) {
+    search->use_regex = !search->use_regex;
+    /* The old matches can't be narrowed down in the other mode. */
+    search->query_len = 0;
+    editor_search_update(query);
+  } else if (key != SEARCH_UPDATE && key != SAVE_UPDATE &&
+             key != FOLLOW_UPDATE && key != PAGER_UPDATE &&
+             key != RESIZE_UPDATE)
+    editor_search_update(query);
+
+  if (search->current < 0)
+    return;
+
+  m = &search->matches[search->current];
+  w->cursor_y = m->row;
+  w->cursor_x = m->cursor_x;
+
+  /* Scroll past the end, so that editor_scroll() puts the match on top. */
+  w->row_offset = editor.buf->text.num_rows;
+  if (w->wrap.enabled) {
+    editor_wrap_validate(w);
+    w->row_offset = editor_wrap_line(w, w->row_offset);
+  }
+}
+
+static char *editor_prompt(const char *prompt,
+                           void (*callback)(const char *, int)) {
+  size_t size = 128, len = 0;
+  char *buf = malloc(size);
+
+  buf[0] = '\0';
+
+  for (;;) {
+    int c;
+
+    editor_set_status_message(prompt, buf);
+    editor_refresh_screen();
+
+    c = editor_read_key();
+    if ((c == DEL_KEY || c == CTRL('h') || c == BACKSPACE) && len != 0) {
+      buf[--len] = '\0';
+    } else if (c == ESC_CHAR) {
+      editor_set_status_message("");
+      if (callback != NULL)
+        callback(buf, c);
+      free(buf);
+      return (NULL);
+    } else if (c == '\r' && len != 0) {
+      editor_set_status_message("");
+      if (callback != NULL)
+        callback(buf, c);
+      return (buf);
+    } else if (!iscntrl(c) && c < 128) {
+      if (len == size - 1) {
+        size *= 2;
+        buf = realloc(buf, size);
+      }
+      buf[len++] = c;
+      buf[len] = '\0';
+    }
+
+    if (callback != NULL)
+      callback(buf, c);
+  }
+}
+
+static void editor_move_cursor(int key) {
+  struct editor_window *w = editor.win;
+  int num_rows = editor.buf->text.num_rows;
+  struct editor_row *row =
+      w->cursor_y >= num_rows ? NULL : editor_row_at(w->cursor_y);
+  int cp;
+
+  switch (key) {
+  case ARROW_LEFT:
+    if (w->cursor_x != 0) {
+      do
+        w->cursor_x = utf8_prev(row->chars, w->cursor_x);
+      while (w->cursor_x > 0 && editor_row_zero_width(row, w->cursor_x));
+    } else if (w->cursor_y > 0)
+      w->cursor_x = editor_row_at(--w->cursor_y)->size;
+    break;
+  case ARROW_RIGHT:
+    if (row != NULL) {
+      if (w->cursor_x < row->size) {
+        do
+          w->cursor_x += utf8_decode(&row->chars[w->cursor_x],
+                                     row->size - w->cursor_x, &cp);
+        while (w->cursor_x < row->size &&
+               editor_row_zero_width(row, w->cursor_x));
+      } else if (w->cursor_x == row->size) {
+        w->cursor_x = 0;
+        w->cursor_y++;
+      }
+    }
+    break;
+  case ARROW_UP:
+    if (w->cursor_y != 0)
+      w->cursor_y--;
+    break;
+  case ARROW_DOWN:
+    if (w->cursor_y < num_rows)
+      w->cursor_y++;
+    break;
+  }
+
+  editor_clamp_cursor(w);
+}
+
+/* Keep the cursor within its row and on the start of a character. */
+static void editor_clamp_cursor(struct editor_window *w) {
+  struct editor_row *row = w->cursor_y >= w->buf->text.num_rows
+                               ? NULL
+                               : text_store_at(&w->buf->text, w->cursor_y);
+  int row_len = row == NULL ? 0 : row->size;
+
+  if (w->cursor_x > row_len)
+    w->cursor_x = row_len;
+  else if (row != NULL)
+    w->cursor_x = utf8_start(row->chars, row->size, w->cursor_x);
+}
+
+/*
+ * Move the cursor a screen up to the top of the previous one, or down to the
+ * bottom of the next one, in one step whatever the size of the file.
+ */
+static void editor_page(bool up) {
+  struct editor_window *w = editor.win;
+
+  if (w->wrap.enabled) {
+    editor_wrap_page(w, up);
+    return;
+  }
+
+  if (up)
+    w->cursor_y = MAX(w->row_offset - w->rows, 0);
+  else
+    w->cursor_y =
+        MIN(w->row_offset + 2 * w->rows - 1, editor.buf->text.num_rows);
+  editor_clamp_cursor(w);
+}
+
+/*
+ * Jump to the start of the line number typed at the prompt, or of the last
+ * line, and show it in the middle of the window.  Only the rows drawn there
+ * get highlighted; those jumped over only have their lexer states caught up.
+ */
+static void editor_goto_line(void) {
+  struct editor_window *w = editor.win;
+  char *input = editor_prompt("Go to line: %s (ESC to cancel)", NULL);
+  char *end;
+  long line;
+
+  if (input == NULL)
+    return;
+
+  errno = 0;
+  line = strtol(input, &end, 10);
+  if (errno != 0 || end == input || *end != '\0' || line < 1) {
+    editor_set_status_message("Not a line number: %s", input);
+    free(input);
+    return;
+  }
+  free(input);
+
+  w->cursor_y = MAX(MIN(line, editor.buf->text.num_rows) - 1, 0);
+  w->cursor_x = 0;
+  if (w->wrap.enabled) {
+    editor_wrap_validate(w);
+    w->row_offset = MAX(editor_wrap_line(w, w->cursor_y) - w->rows / 2, 0);
+  } else
+    w->row_offset = MAX(w->cursor_y - w->rows / 2, 0);
+}
+
+/* Whether the character at `cursor_x` is drawn over the one before it. */
+static bool editor_row_zero_width(struct editor_row *row, int cursor_x) {
+  int cp;
+
+  utf8_decode(&row->chars[cursor_x], row->size - cursor_x, &cp);
+  return (cp != -1 && utf8_width(cp) == 0);
+}
+
+static void editor_process_keypress(void) {
+  static int quit_times = KILO_QUIT_TIMES;
+  struct editor_buffer *buf;
+  int c = editor_read_key();
+
+  if (editor.buf->pager != NULL && editor_pager_key(c)) {
+    quit_times = KILO_QUIT_TIMES;
+    return;
+  }
+
+  switch (c) {
+  case '\r':
+    editor_insert_newline();
+    break;
+  case CTRL('q'):
+    TAILQ_FOREACH(buf, &editor.buffers, link) {
+      if (buf->dirty != 0 && quit_times > 0) {
+        editor_set_status_message("WARNING!!! %s has unsaved changes. "
+                                  "Press Ctrl-Q %d more times to quit.",
+                                  buf->file == NULL ? "[No Name]" : buf->file,
+                                  quit_times--);
+        return;
+      }
+    }
+    if (editor.save.running)
+      editor_save_finish(&editor.save);
+    free(editor.save.iov);
+    while (!TAILQ_EMPTY(&editor.buffers))
+      editor_buffer_free(TAILQ_FIRST(&editor.buffers));
+    editor_search_release();
+    editor_syntax_release();
+    leave_alt_buffer();
+    if (!stats_dump())
+      warn("%s", editor.stats.file);
+    exit(EXIT_SUCCESS);
+    break;
+  case CTRL('s'):
+    editor_save();
+    break;
+  case HOME_KEY:
+    editor.win->cursor_x = 0;
+    break;
+  case END_KEY:
+    if (editor.win->cursor_y < editor.buf->text.num_rows)
+      editor.win->cursor_x = editor_row_at(editor.win->cursor_y)->size;
+    break;
+  case CTRL('f'):
+    editor_find();
+    break;
+  case CTRL('z'):
+    editor_undo();
+    break;
+  case CTRL('y'):
+    editor_redo();
+    break;
+  case CTRL('t'):
+    editor_follow_toggle();
+    break;
+  case CTRL('e'):
+    editor_wrap_toggle();
+    break;
+  case CTRL('g'):
+    editor_goto_line();
+    break;
+  case CTRL('o'):
+    editor_buffer_open();
+    break;
+  case CTRL('w'):
+    editor_window_command();
+    break;
+  case BACKSPACE:
+  case CTRL('h'):
+  case DEL_KEY:
+    if (c == DEL_KEY)
+      editor_move_cursor(ARROW_RIGHT);
+    editor_del_char();
+    break;
+  case PAGE_UP:
+  case PAGE_DOWN:
+    editor_page(c == PAGE_UP);
+    break;
+  case ARROW_UP:
+  case ARROW_DOWN:
+  case ARROW_LEFT:
+  case ARROW_RIGHT:
+    editor_move_cursor(c);
+    break;
+  case CTRL('l'):
+    editor.screen.valid = false;
+    break;
+  case PASTE_BEGIN:
+    editor_paste();
+    break;
+  case PASTE_END:
+  case SEARCH_UPDATE:
+  case SAVE_UPDATE:
+  case FOLLOW_UPDATE:
+  case PAGER_UPDATE:
+  case RESIZE_UPDATE:
+  case ESC_CHAR:
+    break;
+  default:
+    editor_insert_char(c);
+    break;
+  }
+
+  quit_times = KILO_QUIT_TIMES;
+}
+
+static struct editor_window *editor_window_new(struct editor_buffer *buf) {
+  struct editor_window *w = malloc(sizeof(*w));
+
+  if (w == NULL)
+    die("malloc");
+
+  w->parent = w->child[0] = w->child[1] = NULL;
+  w->vertical = false;
+  w->buf = buf;
+  w->cursor_x = w->cursor_y = 0;
+  w->render_x = 0;
+  w->cursor_line = w->cursor_col = 0;
+  w->row_offset = w->col_offset = 0;
+  w->top = w->left = w->rows = w->cols = 0;
+  w->wrap.enabled = false;
+  w->wrap.width = w->wrap.capacity = 0;
+  w->wrap.height = w->wrap.tree = NULL;
+  w->drawn_version = 0;
+  w->drawn_row_offset = w->drawn_col_offset = 0;
+  w->drawn_matches = false;
+  w->damaged = true;
+  w->top_offset = w->top_line = 0;
+
+  return (w);
+}
+
+/* Show `buf` in `w` from the top. */
+static void editor_window_show(struct editor_window *w,
+                               struct editor_buffer *buf) {
+  w->buf = buf;
+  w->cursor_x = w->cursor_y = 0;
+  w->render_x = 0;
+  w->row_offset = w->col_offset = 0;
+  w->wrap.width = 0;
+  w->damaged = true;
+  w->top_offset = w->top_line = 0;
+
+  if (w == editor.win)
+    editor.buf = buf;
+}
+
+static void editor_window_focus(struct editor_window *w) {
+  editor.win = w;
+  editor.buf = w->buf;
+}
+
+/* The first leaf under `w`, and the leaf after `w` in screen order. */
+static struct editor_window *editor_window_first(struct editor_window *w) {
+  while (w->child[0] != NULL)
+    w = w->child[0];
+
+  return (w);
+}
+
+static struct editor_window *editor_window_next(struct editor_window *w) {
+  while (w->parent != NULL && w == w->parent->child[1])
+    w = w->parent;
+
+  return (w->parent == NULL ? NULL : editor_window_first(w->parent->child[1]));
+}
+
+/*
+ * Split the current window in two showing the same buffer at the same spot,
+ * side by side if `vertical`.  The new one gets the focus.
+ */
+static void editor_window_split(bool vertical) {
+  struct editor_window *w = editor.win, *split, *other;
+
+  if (vertical ? w->cols < 3 : w->rows < 3) {
+    editor_set_status_message("The window is too small to split");
+    return;
+  }
+
+  split = editor_window_new(NULL);
+  other = editor_window_new(w->buf);
+  other->cursor_x = w->cursor_x;
+  other->cursor_y = w->cursor_y;
+  other->row_offset = w->row_offset;
+  other->col_offset = w->col_offset;
+  other->wrap.enabled = w->wrap.enabled;
+  other->top_offset = w->top_offset;
+  other->top_line = w->top_line;
+
+  split->parent = w->parent;
+  if (w->parent == NULL)
+    editor.root = split;
+  else
+    w->parent->child[w->parent->child[1] == w] = split;
+  split->vertical = vertical;
+  split->child[0] = w;
+  split->child[1] = other;
+  w->parent = other->parent = split;
+
+  editor_layout(split, w->top, w->left, w->rows + 1, w->cols);
+  editor_window_focus(other);
+}
+
+/* Close the current window and give its space to its sibling. */
+static void editor_window_close(void) {
+  if (editor.win->parent == NULL) {
+    editor_set_status_message("Can't close the last window");
+    return;
+  }
+
+  editor_window_remove(editor.win);
+}
+
+/* Close `w`, which is not the last window, see editor_window_close(). */
+static void editor_window_remove(struct editor_window *w) {
+  struct editor_window *split = w->parent, *other;
+
+  other = split->child[split->child[0] == w];
+  other->parent = split->parent;
+  if (split->parent == NULL)
+    editor.root = other;
+  else
+    split->parent->child[split->parent->child[1] == split] = other;
+
+  editor_layout(other, split->top, split->left, split->rows, split->cols);
+  if (w == editor.win)
+    editor_window_focus(editor_window_first(other));
+  free(split);
+  free(w->wrap.height);
+  free(w->wrap.tree);
+  free(w);
+}
+
+/* Read the key after CTRL-W and act on the windows and buffers. */
+static void editor_window_command(void) {
+  struct editor_window *next;
+  int c;
+
+  editor_set_status_message(
+      "CTRL-W: s/v = split, w = next, c = close, n/p = next/prev buffer");
+  editor_refresh_screen();
+  while ((c = editor_read_key()) == SEARCH_UPDATE || c == SAVE_UPDATE ||
+         c == FOLLOW_UPDATE || c == PAGER_UPDATE || c == RESIZE_UPDATE)
+    editor_refresh_screen();
+  editor_set_status_message("");
+
+  switch (c) {
+  case 's':
+  case 'v':
+    editor_window_split(c == 'v');
+    break;
+  case 'w':
+  case CTRL('w'):
+    next = editor_window_next(editor.win);
+    editor_window_focus(next != NULL ? next : editor_window_first(editor.root));
+    break;
+  case 'c':
+    editor_window_close();
+    break;
+  case 'n':
+  case 'p':
+    editor_buffer_cycle(c == 'n');
+    break;
+  }
+}
+
+/*
+ * Lay the windows under `w` out in the `rows` by `cols` area at `top`,
+ * `left`.  A leaf keeps the last row for its status bar, a split keeps the
+ * whole area, and a vertical split a column between its children.
+ */
+static void editor_layout(struct editor_window *w, int top, int left,
+                          int rows, int cols) {
+  int first;
+
+  w->top = top;
+  w->left = left;
+  w->rows = rows;
+  w->cols = cols;
+  w->damaged = true;
+
+  if (w->child[0] == NULL) {
+    w->rows--;
+    return;
+  }
+
+  if (w->vertical) {
+    first = (cols - 1) / 2;
+    editor_layout(w->child[0], top, left, rows, first);
+    editor_layout(w->child[1], top, left + first + 1, rows, cols - first - 1);
+  } else {
+    first = rows / 2;
+    editor_layout(w->child[0], top, left, first, cols);
+    editor_layout(w->child[1], top + first, left, rows - first, cols);
+  }
+}
+
+/*
+ * Whether editor_layout() leaves every window under `w` at least one text
+ * row and column in a `rows` by `cols` area.
+ */
+static bool editor_layout_fits(const struct editor_window *w, int rows,
+                               int cols) {
+  int first;
+
+  if (w->child[0] == NULL)
+    return (rows >= 2 && cols >= 1);
+
+  if (w->vertical) {
+    first = (cols - 1) / 2;
+    return (editor_layout_fits(w->child[0], rows, first) &&
+            editor_layout_fits(w->child[1], rows, cols - first - 1));
+  }
+
+  first = rows / 2;
+  return (editor_layout_fits(w->child[0], first, cols) &&
+          editor_layout_fits(w->child[1], rows - first, cols));
+}
+
+/*
+ * Fit the screen to the terminal once a burst of SIGWINCH has settled.  Only
+ * TIOCGWINSZ is asked, as a cursor position report would be read back
+ * mixed with the input.  The framebuffer keeps the cells the terminal still
+ * shows and the rows keep their render and highlight, so the next refresh
+ * only sends what the new layout moved or the resize exposed.  Windows that
+ * no longer fit are closed, the last ones on the screen first, and a
+ * terminal too small for even one window is ignored until it grows again.
+ */
+static void editor_resize(void) {
+  struct editor_window *w, *last;
+  struct winsize ws;
+  int rows, cols, closed = 0;
+
+  if (ioctl(editor.tty, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+    return;
+
+  rows = ws.ws_row;
+  cols = ws.ws_col;
+  if ((rows == editor.screen.rows && cols == editor.screen.cols) || rows < 3)
+    return;
+
+  while (!editor_layout_fits(editor.root, rows - 1, cols)) {
+    last = NULL;
+    for (w = editor_window_first(editor.root); w != NULL;
+         w = editor_window_next(w)) {
+      if (w != editor.win)
+        last = w;
+    }
+    editor_window_remove(last);
+    closed++;
+  }
+  if (closed > 0)
+    editor_set_status_message("Closed %d window%s too small for the terminal",
+                              closed, closed == 1 ? "" : "s");
+
+  screen_resize(rows, cols);
+  editor_layout(editor.root, 0, 0, rows - 1, cols);
+  editor.resized = true;
+}
+
+/* The window after `w`, or the first if NULL, with an index over `ts`. */
+static struct editor_window *editor_wrap_next(struct text_store *ts,
+                                              struct editor_window *w) {
+  w = w == NULL ? editor_window_first(editor.root) : editor_window_next(w);
+  while (w != NULL && (w->wrap.width == 0 || &w->buf->text != ts))
+    w = editor_window_next(w);
+
+  return (w);
+}
+
+/* Lines of `width` columns that `row` takes; an empty row still takes one. */
+static int editor_wrap_height(struct editor_row *row, int width) {
+  int cols;
+
+  if (row->render != NULL)
+    cols = row->render_size;
+  else if (memchr(row->chars, '\t', row->size) == NULL &&
+           text_is_ascii(row->chars, row->size))
+    cols = row->size;
+  else
+    cols = render_width(row->chars, 0, row->size, 0);
+
+  return (cols == 0 ? 1 : (cols + width - 1) / width);
+}
+
+/* Index the whole buffer of `w` at its current width. */
+static void editor_wrap_build(struct editor_window *w) {
+  struct editor_wrap *wrap = &w->wrap;
+  struct text_store *ts = &w->buf->text;
+  int gap_end = ts->gap + ts->capacity - ts->num_rows;
+
+  wrap->width = MAX(w->cols, 1);
+  wrap->capacity = ts->capacity;
+  wrap->height = realloc(wrap->height, sizeof(int) * MAX(ts->capacity, 1));
+  wrap->tree = realloc(wrap->tree, sizeof(int) * MAX(ts->capacity, 1));
+  if (wrap->height == NULL || wrap->tree == NULL)
+    die("realloc");
+
+  for (int slot = 0; slot < ts->capacity; slot++)
+    wrap->height[slot] =
+        slot >= ts->gap && slot < gap_end
+            ? 0
+            : editor_wrap_height(&ts->rows[slot], wrap->width);
+  wrap_build(wrap);
+}
+
+/* Build the index of `w` if it has none or the window changed width. */
+static void editor_wrap_validate(struct editor_window *w) {
+  if (w->wrap.width != MAX(w->cols, 1))
+    editor_wrap_build(w);
+}
+
+/*
+ * Wrap the rows of the current window or stop doing so, keeping the row at
+ * the top of the window there.
+ */
+static void editor_wrap_toggle(void) {
+  struct editor_window *w = editor.win;
+  struct editor_wrap *wrap = &w->wrap;
+  int sub;
+
+  if (wrap->enabled) {
+    editor_wrap_validate(w);
+    w->row_offset = editor_wrap_find(w, w->row_offset, &sub);
+    free(wrap->height);
+    free(wrap->tree);
+    wrap->height = wrap->tree = NULL;
+    wrap->width = wrap->capacity = 0;
+    wrap->enabled = false;
+  } else {
+    editor_wrap_build(w);
+    w->row_offset = editor_wrap_line(w, w->row_offset);
+    w->col_offset = 0;
+    wrap->enabled = true;
+  }
+
+  w->damaged = true;
+  editor_set_status_message("Soft wrap %s", wrap->enabled ? "on" : "off");
+}
+
+/* The line that `file_row` starts on, or the number of lines past the end. */
+static int editor_wrap_line(struct editor_window *w, int file_row) {
+  return (wrap_prefix(&w->wrap, text_store_slot(&w->buf->text, file_row)));
+}
+
+/*
+ * The row that `line` falls on, with the line it is of that row in `sub`, or
+ * `num_rows` if `line` is past the end.
+ */
+static int editor_wrap_find(struct editor_window *w, int line, int *sub) {
+  struct editor_wrap *wrap = &w->wrap;
+  struct text_store *ts = &w->buf->text;
+  int slot = 0, step = 1;
+
+  /* Descend the tree to the last slot that starts at or before `line`. */
+  while (step * 2 <= wrap->capacity)
+    step *= 2;
+  for (; step != 0; step /= 2) {
+    if (slot + step <= wrap->capacity && wrap->tree[slot + step - 1] <= line) {
+      slot += step;
+      line -= wrap->tree[slot - 1];
+    }
+  }
+
+  *sub = line;
+  if (slot == wrap->capacity)
+    return (ts->num_rows);
+
+  return (slot < ts->gap ? slot : slot - (ts->capacity - ts->num_rows));
+}
+
+/*
+ * Page by lines instead of rows, to the start of the top line of the previous
+ * screen or of the bottom line of the next one.
+ */
+static void editor_wrap_page(struct editor_window *w, bool up) {
+  int line, sub, render_x;
+  struct editor_row *row;
+
+  editor_wrap_validate(w);
+  line = up ? MAX(w->row_offset - w->rows, 0) : w->row_offset + 2 * w->rows - 1;
+  w->cursor_y = editor_wrap_find(w, line, &sub);
+  w->cursor_x = 0;
+  if (w->cursor_y == w->buf->text.num_rows)
+    return;
+
+  /* The last character that starts at or before the line, not inside a tab. */
+  row = editor_row_prepare(w->cursor_y);
+  render_x = sub * w->wrap.width;
+  w->cursor_x = utf8_start(row->chars, row->size,
+                           MIN(editor_row_rx_to_cx(row, render_x), row->size));
+  while (w->cursor_x > 0 &&
+         (editor_row_cx_to_rx(row, w->cursor_x) > render_x ||
+          editor_row_zero_width(row, w->cursor_x)))
+    w->cursor_x = utf8_prev(row->chars, w->cursor_x);
+}
+
+/*
+ * Account for the row kept in `slot` of `ts` having changed, or for the slot
+ * being left empty if `row` is NULL.
+ */
+static void editor_wrap_update(struct text_store *ts, int slot,
+                               struct editor_row *row) {
+  for (struct editor_window *w = NULL; (w = editor_wrap_next(ts, w)) != NULL;)
+    wrap_set(&w->wrap, slot,
+             row == NULL ? 0 : editor_wrap_height(row, w->wrap.width));
 }
 
-static void editor_row_del_char(struct editor_row *row, int at) {
-  if (at < 0 || at >= row->size)
-    return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editor_update_row(row);
-  editor.dirty++;
+/*
+ * Move the heights along with the rows when the gap of `ts` moves to `at`,
+ * in the order that never overwrites one that is still to be moved.
+ */
+static void editor_wrap_move_gap(struct text_store *ts, int at) {
+  int gap_len = ts->capacity - ts->num_rows;
+
+  for (struct editor_window *w = NULL;
+       (w = editor_wrap_next(ts, w)) != NULL;) {
+    struct editor_wrap *wrap = &w->wrap;
+    int height;
+
+    for (int i = ts->gap - 1; i >= at; i--) {
+      height = wrap->height[i];
+      wrap_set(wrap, i, 0);
+      wrap_set(wrap, i + gap_len, height);
+    }
+    for (int i = ts->gap; i < at; i++) {
+      height = wrap->height[i + gap_len];
+      wrap_set(wrap, i + gap_len, 0);
+      wrap_set(wrap, i, height);
+    }
+  }
 }
 
-static void editor_insert_char(char c) {
-  if (editor.cursor_y == editor.num_rows)
-    editor_insert_row(editor.num_rows, "", 0);
+/*
+ * Grow the indexes over `ts` along with its rows, which moves the tail to the
+ * new end.  Only the tree is built again, the heights are just moved.
+ */
+static void editor_wrap_reserve(struct text_store *ts, int capacity) {
+  int tail = ts->num_rows - ts->gap;
+
+  for (struct editor_window *w = NULL;
+       (w = editor_wrap_next(ts, w)) != NULL;) {
+    struct editor_wrap *wrap = &w->wrap;
+
+    wrap->height = realloc(wrap->height, sizeof(int) * capacity);
+    wrap->tree = realloc(wrap->tree, sizeof(int) * capacity);
+    if (wrap->height == NULL || wrap->tree == NULL)
+      die("realloc");
+
+    memmove(&wrap->height[capacity - tail],
+            &wrap->height[ts->capacity - tail], sizeof(int) * tail);
+    memset(&wrap->height[ts->gap], 0,
+           sizeof(int) * (capacity - tail - ts->gap));
+    wrap->capacity = capacity;
+    wrap_build(wrap);
+  }
+}
+
+/* Build the tree over the heights in O(n), adding each node to its parent. */
+static void wrap_build(struct editor_wrap *wrap) {
+  memcpy(wrap->tree, wrap->height, sizeof(int) * wrap->capacity);
+  for (int i = 1; i <= wrap->capacity; i++) {
+    int parent = i + (i & -i);
 
-  editor_row_insert_char(&editor.rows[editor.cursor_y], editor.cursor_x++, c);
+    if (parent <= wrap->capacity)
+      wrap->tree[parent - 1] += wrap->tree[i - 1];
+  }
 }
 
-static void editor_insert_newline(void) {
-  if (editor.cursor_x == 0) {
-    editor_insert_row(editor.cursor_y, "", 0);
-  } else {
-    struct editor_row *row = &editor.rows[editor.cursor_y];
+static void wrap_add(struct editor_wrap *wrap, int slot, int delta) {
+  for (int i = slot + 1; i <= wrap->capacity; i += i & -i)
+    wrap->tree[i - 1] += delta;
+}
 
-    editor_insert_row(editor.cursor_y + 1, &row->chars[editor.cursor_x],
-                      row->size - editor.cursor_x);
-    row = &editor.rows[editor.cursor_y];
-    row->size = editor.cursor_x;
-    row->chars[row->size] = '\0';
-    editor_update_row(row);
+static void wrap_set(struct editor_wrap *wrap, int slot, int height) {
+  if (wrap->height[slot] != height) {
+    wrap_add(wrap, slot, height - wrap->height[slot]);
+    wrap->height[slot] = height;
   }
-  editor.cursor_y++;
-  editor.cursor_x = 0;
 }
 
-static void editor_del_char(void) {
-  if (editor.cursor_y == editor.num_rows)
-    return;
+/* The lines taken by the slots before `slot`. */
+static int wrap_prefix(const struct editor_wrap *wrap, int slot) {
+  int lines = 0;
 
-  if (editor.cursor_x == 0 && editor.cursor_y == 0)
-    return;
+  for (int i = slot; i > 0; i -= i & -i)
+    lines += wrap->tree[i - 1];
 
-  if (editor.cursor_x > 0) {
-    editor_row_del_char(&editor.rows[editor.cursor_y], editor.cursor_x - 1);
-    editor.cursor_x--;
-  } else {
-    editor.cursor_x = editor.rows[editor.cursor_y - 1].size;
-    editor_row_append_string(&editor.rows[editor.cursor_y - 1],
-                             editor.rows[editor.cursor_y].chars,
-                             editor.rows[editor.cursor_y].size);
-    editor_del_row(editor.cursor_y);
-    editor.cursor_y--;
-  }
+  return (lines);
 }
 
-static char *editor_rows_to_string(int *buflen) {
-  int total_len = 0;
-  char *buf;
-  char *p;
+/*
+ * Whether the text area of `w` may look different from when it was drawn.
+ * Pager windows are drawn every time, as their lines come from the cache.
+ */
+static bool editor_window_damaged(const struct editor_window *w) {
+  bool matches = editor.search.active && w->buf == editor.win->buf;
+
+  return (w->damaged || w->buf->pager != NULL ||
+          w->drawn_version != w->buf->version ||
+          w->drawn_row_offset != w->row_offset ||
+          w->drawn_col_offset != w->col_offset || matches ||
+          w->drawn_matches);
+}
 
-  for (int i = 0; i < editor.num_rows; i++)
-    total_len += editor.rows[i].size + 1;
+static void editor_refresh_screen(void) {
+  struct editor_screen *scr = &editor.screen;
+  struct sbuf *sb = scr->out;
+  struct editor_window *win = editor.win;
+  int64_t frame_start = stats_now(), start;
+
+  if (editor.stats.edit_start != 0) {
+    stats_add(STATS_EDIT, editor.stats.edit_start);
+    frame_start = editor.stats.edit_start;
+    editor.stats.edit_start = 0;
+  }
 
-  *buflen = total_len;
-  buf = malloc(total_len);
-  p = buf;
-  for (int i = 0; i < editor.num_rows; i++) {
-    memcpy(p, editor.rows[i].chars, editor.rows[i].size);
-    p += editor.rows[i].size;
-    *p++ = '\n';
+  sbuf_clear(sb);
+
+  for (struct editor_window *w = editor_window_first(editor.root); w != NULL;
+       w = editor_window_next(w)) {
+    editor.buf = w->buf;
+    editor_scroll(w);
+    editor_draw_window(sb, w);
   }
+  editor.buf = win->buf;
 
-  return (buf);
-}
+  editor_draw_separators(editor.root);
+  editor_draw_message_bar();
 
-static void editor_open(const char *file) {
-  size_t line_cap = 0;
-  ssize_t line_len;
-  char *line = NULL;
-  FILE *fp = fopen(file, "r");
+  screen_flush(sb, win->top + win->cursor_line - win->row_offset,
+               win->left + win->cursor_col - win->col_offset);
 
-  if (fp == NULL)
-    die("fopen");
+  if (sbuf_finish(sb) == -1)
+    die("sbuf_finish");
 
-  editor.file = strdup(file);
+  start = stats_now();
+  if (sbuf_len(sb) != 0 &&
+      write(editor.tty, sbuf_data(sb), sbuf_len(sb)) != sbuf_len(sb))
+    die("write");
+  stats_add(STATS_WRITE, start);
+  stats_add(STATS_FRAME, frame_start);
+  stats_frame(sbuf_len(sb));
+}
 
-  editor_select_syntax_highlight();
+static void editor_set_status_message(const char *fmt, ...) {
+  va_list ap;
 
-  while ((line_len = getline(&line, &line_cap, fp)) != -1) {
-    while (line_len > 0 &&
-           (line[line_len - 1] == '\n' || line[line_len - 1] == '\r'))
-      line_len--;
-    editor_insert_row(editor.num_rows, line, line_len);
-  }
+  va_start(ap, fmt);
+  vsnprintf(editor.statusmsg, sizeof(editor.statusmsg), fmt, ap);
+  va_end(ap);
 
-  free(line);
-  fclose(fp);
-  editor.dirty = 0;
+  editor.statusmsg_time = time(NULL);
 }
 
-static void editor_save(void) {
-  int len;
-  int fd = -1;
-  char *buf = editor_rows_to_string(&len);
+/*
+ * Edits made in another window on the same buffer may have moved the end.
+ * A pager has no cursor to follow, and leaves it in the top left corner.
+ */
+static void editor_scroll(struct editor_window *w) {
+  int num_rows = w->buf->text.num_rows;
 
-  if (editor.file == NULL) {
-    editor.file = editor_prompt("Save as: %s", NULL);
+  if (w->buf->pager != NULL) {
+    w->cursor_line = w->row_offset = 0;
+    w->cursor_col = w->col_offset;
+    return;
+  }
 
-    if (editor.file == NULL) {
-      editor_set_status_message("Save aborted");
-      return;
+  if (w->cursor_y > num_rows)
+    w->cursor_y = num_rows;
+  if (w->cursor_y == num_rows)
+    w->cursor_x = 0;
+  else
+    w->cursor_x = MIN(w->cursor_x, editor_row_at(w->cursor_y)->size);
+
+  w->render_x = 0;
+  if (w->cursor_y < num_rows)
+    w->render_x = editor_row_cx_to_rx(editor_row_at(w->cursor_y), w->cursor_x);
+
+  w->cursor_line = w->cursor_y;
+  w->cursor_col = w->render_x;
+  if (w->wrap.enabled) {
+    struct editor_wrap *wrap = &w->wrap;
+    int sub, slot;
+
+    editor_wrap_validate(w);
+    sub = w->render_x / wrap->width;
+
+    /* The cursor past the end of a full row stays on its last line. */
+    if (w->cursor_y < num_rows) {
+      slot = text_store_slot(&w->buf->text, w->cursor_y);
+      sub = MIN(sub, wrap->height[slot] - 1);
     }
-
-    editor_select_syntax_highlight();
+    w->cursor_line = editor_wrap_line(w, w->cursor_y) + sub;
+    w->cursor_col = MIN(w->render_x - sub * wrap->width, wrap->width - 1);
   }
 
-  fd = open(editor.file, O_RDWR | O_CREAT,
-            S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (w->cursor_line < w->row_offset)
+    w->row_offset = w->cursor_line;
 
-  if (fd == -1) {
-    editor_set_status_message("Can't save! I/O error %s", strerror(errno));
-    goto cleanup;
-  }
+  if (w->cursor_line >= w->row_offset + w->rows)
+    w->row_offset = w->cursor_line - w->rows + 1;
 
-  if (ftruncate(fd, len) == -1) {
-    editor_set_status_message("Can't save! I/O error %s", strerror(errno));
-    goto cleanup;
-  }
+  if (w->cursor_col < w->col_offset)
+    w->col_offset = w->cursor_col;
+
+  if (w->cursor_col >= w->col_offset + w->cols)
+    w->col_offset = w->cursor_col - w->cols + 1;
+}
 
-  if (write(fd, buf, len) != len) {
-    editor_set_status_message("Can't save! I/O error %s", strerror(errno));
-    goto cleanup;
+/*
+ * Draw the text area of `w` if it changed, scrolling the terminal first when
+ * that saves redrawing most of it, and its status bar.  Only a window as wide
+ * as the terminal can be scrolled.
+ */
+static void editor_draw_window(struct sbuf *sb, struct editor_window *w) {
+  struct editor_screen *scr = &editor.screen;
+  int scroll = w->row_offset - w->drawn_row_offset;
+
+  if (editor_window_damaged(w)) {
+    if (scr->valid && !w->damaged && w->cols == scr->cols && scroll != 0 &&
+        abs(scroll) <= w->rows / 2)
+      screen_scroll(sb, w->top, w->rows, scroll);
+
+    editor_draw_rows(w);
+    w->drawn_version = w->buf->version;
+    w->drawn_row_offset = w->row_offset;
+    w->drawn_col_offset = w->col_offset;
+    w->drawn_matches = editor.search.active && w->buf == editor.win->buf;
+    w->damaged = false;
   }
 
-  editor_set_status_message("%d bytes written to disk", len);
-  editor.dirty = 0;
+  if (w->buf->pager != NULL)
+    editor_pager_draw_status_bar(w);
+  else
+    editor_draw_status_bar(w);
+}
 
-cleanup:
-  close(fd);
-  free(buf);
+static void editor_draw_status_bar(struct editor_window *w) {
+  struct editor_buffer *buf = w->buf;
+  char status[80], status_right[80], saving[32] = "", matches[32] = "";
+  const char *following = buf->follow.fd != -1 ? "following | " : "";
+  const char *wrap = w->wrap.enabled ? "wrap | " : "";
+  int y = w->top + w->rows;
+  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+                     buf->file == NULL ? "[No Name]" : buf->file,
+                     buf->text.num_rows, buf->dirty != 0 ? "(modified)" : "");
+  int rlen;
+
+  if (w == editor.win && editor.search.active && editor.search.bad_regex)
+    snprintf(matches, sizeof(matches), "bad regex | ");
+  else if (w == editor.win && editor.search.active &&
+           !editor.search.running && editor.search.error != 0)
+    snprintf(matches, sizeof(matches), "search failed | ");
+  else if (w == editor.win && editor.search.active)
+    snprintf(matches, sizeof(matches), "%s%d/%d%s matches | ",
+             editor.search.use_regex ? "regex " : "",
+             editor.search.current + 1, editor.search.num_matches,
+             editor.search.running ? "+" : "");
+
+  if (editor.save.running && editor.save.buf == buf)
+    snprintf(saving, sizeof(saving), "saving %d%% | ",
+             editor.save.total == 0
+                 ? 100
+                 : (int)(atomic_load(&editor.save.written) * 100 /
+                         editor.save.total));
+
+  rlen = snprintf(status_right, sizeof(status_right), "%s%s%s%s%s | %d/%d",
+                  wrap, following, saving, matches,
+                  buf->syntax == NULL ? "no ft" : buf->syntax->file_type,
+                  w->cursor_y + 1, buf->text.num_rows);
+
+  if (len > w->cols)
+    len = w->cols;
+
+  screen_clear(y, w->left, w->cols, ATTR_INVERT);
+  screen_put(y, w->left, status, len, ATTR_INVERT);
+
+  if (w->cols - len >= rlen)
+    screen_put(y, w->left + w->cols - rlen, status_right, rlen, ATTR_INVERT);
 }
 
-static void editor_find(void) {
-  int save_cursor_x = editor.cursor_x;
-  int save_cursor_y = editor.cursor_y;
-  int saved_col_offset = editor.col_offset;
-  int saved_row_offset = editor.row_offset;
+/* Draw the column between the two sides of each vertical split. */
+static void editor_draw_separators(struct editor_window *w) {
+  if (w->child[0] == NULL)
+    return;
 
-  char *query =
-      editor_prompt("Search: %s (Use ESC/Arrows/Enter)", editor_find_callback);
+  if (w->vertical) {
+    for (int y = w->top; y < w->top + w->rows; y++)
+      screen_put(y, w->left + w->child[0]->cols, "|", 1, ATTR_INVERT);
+  }
 
-  if (query == NULL) {
-    editor.cursor_x = save_cursor_x;
-    editor.cursor_y = save_cursor_y;
-    editor.col_offset = saved_col_offset;
-    editor.row_offset = saved_row_offset;
-  } else
-    free(query);
+  editor_draw_separators(w->child[0]);
+  editor_draw_separators(w->child[1]);
 }
 
-static void editor_find_callback(const char *query, int key) {
-  static int last_match = -1;
-  static int direction = 1;
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
+static void editor_draw_message_bar(void) {
+  struct editor_screen *scr = &editor.screen;
+  int y = scr->rows - 1;
+  int msg_len = strlen(editor.statusmsg);
+
+  screen_clear(y, 0, scr->cols, HL_NORMAL);
 
-  if (saved_hl != NULL) {
-    memcpy(editor.rows[saved_hl_line].highlight, saved_hl,
-           editor.rows[saved_hl_line].render_size);
-    free(saved_hl);
-    saved_hl = NULL;
+  if (msg_len > scr->cols)
+    msg_len = scr->cols;
+
+  if (msg_len != 0 && time(NULL) - editor.statusmsg_time < 5)
+    screen_put(y, 0, editor.statusmsg, msg_len, HL_NORMAL);
+  else if (editor.stats.file != NULL) {
+    char line[160];
+    int len = MIN(stats_format(line, sizeof(line)), scr->cols);
+
+    screen_put(y, 0, line, len, HL_NORMAL);
   }
+}
 
-  if (key == '\r' || key == ESC_CHAR) {
-    last_match = -1;
-    direction = 1;
+/*
+ * Draw the rows from `row_offset` on, or when wrapping, the lines from
+ * `row_offset` on, where line `sub` of a row shows the `cols` render columns
+ * from `sub * cols` on.
+ */
+static void editor_draw_rows(struct editor_window *w) {
+  struct editor_screen *scr = &editor.screen;
+  struct text_store *ts = &w->buf->text;
+  int file_row = w->row_offset, from = w->col_offset, sub = 0;
+  int64_t start = stats_now();
+
+  if (w->buf->pager != NULL) {
+    editor_pager_draw_rows(w);
+    stats_add(STATS_DRAW, start);
     return;
-  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = 1;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
-  } else {
-    last_match = -1;
-    direction = 1;
   }
 
-  if (last_match == -1)
-    direction = 1;
-
-  for (int i = 0, current = last_match + direction; i < editor.num_rows;
-       i++, current += direction) {
-    struct editor_row *row;
-    char *match;
+  if (w->wrap.enabled)
+    file_row = editor_wrap_find(w, w->row_offset, &sub);
 
-    if (current == -1)
-      current = editor.num_rows - 1;
+  for (int y = 0; y < w->rows; y++) {
+    screen_clear(w->top + y, w->left, w->cols, HL_NORMAL);
 
-    if (current == editor.num_rows)
-      current = 0;
+    if (file_row >= ts->num_rows) {
+      if (ts->num_rows == 0 && y == w->rows / 3) {
+        char welcome[80];
+        int padding;
+        int welcome_len = snprintf(welcome, sizeof(welcome),
+                                   "Kilo editor -- version %s", KILO_VERSION);
 
-    row = &editor.rows[current];
-    match = strstr(row->render, query);
+        if (welcome_len > w->cols)
+          welcome_len = w->cols;
 
-    if (match != NULL) {
-      int rx = match - row->render;
-      last_match = current;
-      editor.cursor_y = current;
-      editor.cursor_x = editor_row_rx_to_cx(row, rx);
-      editor.row_offset = editor.num_rows;
+        padding = (w->cols - welcome_len) / 2;
+        if (padding != 0)
+          screen_put(w->top + y, w->left, "~", 1, HL_NORMAL);
 
-      saved_hl_line = current;
-      saved_hl = malloc(row->render_size);
-      memcpy(saved_hl, row->highlight, row->render_size);
+        screen_put(w->top + y, w->left + padding, welcome, welcome_len,
+                   HL_NORMAL);
+      } else
+        screen_put(w->top + y, w->left, "~", 1, HL_NORMAL);
+    } else {
+      struct editor_row *row = editor_row_prepare(file_row);
+      uint32_t *cell;
+      unsigned char *attr;
+      int len;
 
-      memset(&row->highlight[rx], HL_MATCH, strlen(query));
-      break;
-    }
-  }
-}
+      if (w->wrap.enabled)
+        from = sub * w->wrap.width;
 
-static char *editor_prompt(const char *prompt,
-                           void (*callback)(const char *, int)) {
-  size_t size = 128, len = 0;
-  char *buf = malloc(size);
+      len = row->render_size - from;
+      if (len < 0)
+        len = 0;
 
-  buf[0] = '\0';
+      if (len > w->cols)
+        len = w->cols;
 
-  for (;;) {
-    int c;
+      cell = &scr->chars[(w->top + y) * scr->cols + w->left];
+      attr = &scr->attrs[(w->top + y) * scr->cols + w->left];
 
-    editor_set_status_message(prompt, buf);
-    editor_refresh_screen();
+      editor_draw_highlight(row, from, attr, len);
+      if (editor.search.active && w->buf == editor.win->buf)
+        editor_draw_matches(row, file_row, from, attr, len);
+      editor_draw_cells(row, from, cell, attr, len);
 
-    c = editor_read_key();
-    if ((c == DEL_KEY || c == CTRL('h') || c == BACKSPACE) && len != 0) {
-      buf[--len] = '\0';
-    } else if (c == ESC_CHAR) {
-      editor_set_status_message("");
-      if (callback != NULL)
-        callback(buf, c);
-      free(buf);
-      return (NULL);
-    } else if (c == '\r' && len != 0) {
-      editor_set_status_message("");
-      if (callback != NULL)
-        callback(buf, c);
-      return (buf);
-    } else if (!iscntrl(c) && c < 128) {
-      if (len == size - 1) {
-        size *= 2;
-        buf = realloc(buf, size);
+      if (!w->wrap.enabled ||
+          ++sub == w->wrap.height[text_store_slot(ts, file_row)]) {
+        file_row++;
+        sub = 0;
       }
-      buf[len++] = c;
-      buf[len] = '\0';
     }
+  }
 
-    if (callback != NULL)
-      callback(buf, c);
+  stats_add(STATS_DRAW, start);
+}
+
+/*
+ * Fill `cell` with the render columns `[from, from + len)`.  Control
+ * characters and invalid bytes are shown inverted, and so is a wide
+ * character cut in half by the edge of the window, as a blank.
+ */
+static void editor_draw_cells(struct editor_row *row, int from, uint32_t *cell,
+                              unsigned char *attr, int len) {
+  const unsigned char *c = (const unsigned char *)&row->render[from];
+  int at, cp;
+
+  for (int i = 0; i < len; i++) {
+    if (c[i] == (unsigned char)RENDER_GLYPH) {
+      at = editor_row_rx_to_cx(row, from + i);
+      utf8_decode(&row->chars[at], row->size - at, &cp);
+
+      if (c[i + 1] == (unsigned char)RENDER_WIDE && i + 1 == len) {
+        cell[i] = ' ';
+        attr[i] |= ATTR_INVERT;
+      } else if (cp == -1 || cp < 0xa0) {
+        cell[i] = '?';
+        attr[i] |= ATTR_INVERT;
+      } else {
+        cell[i] = cp;
+        if (c[i + 1] == (unsigned char)RENDER_WIDE)
+          cell[++i] = 0;
+      }
+    } else if (c[i] == (unsigned char)RENDER_WIDE) {
+      cell[i] = ' ';
+      attr[i] |= ATTR_INVERT;
+    } else if (iscntrl(c[i])) {
+      cell[i] = (c[i] <= 26) ? '@' + c[i] : '?';
+      attr[i] |= ATTR_INVERT;
+    } else
+      cell[i] = c[i];
   }
 }
 
-static void editor_move_cursor(int key) {
-  struct editor_row *row =
-      editor.cursor_y >= editor.num_rows ? NULL : &editor.rows[editor.cursor_y];
-  int row_len;
+/* Expand the highlight of the render columns `[from, from + len)` to `attr`. */
+static void editor_draw_highlight(struct editor_row *row, int from,
+                                  unsigned char *attr, int len) {
+  for (int i = 0, x = 0; i < row->num_hl_spans && x < from + len; i++) {
+    int to = x + HL_SPAN_LEN(row->hl_spans[i]);
 
-  switch (key) {
-  case ARROW_LEFT:
-    if (editor.cursor_x != 0)
-      editor.cursor_x--;
-    else if (editor.cursor_y > 0)
-      editor.cursor_x = editor.rows[--editor.cursor_y].size;
-    break;
-  case ARROW_RIGHT:
-    if (row != NULL) {
-      if (editor.cursor_x < row->size)
-        editor.cursor_x++;
-      else if (editor.cursor_x == row->size) {
-        editor.cursor_x = 0;
-        editor.cursor_y++;
-      }
-    }
-    break;
-  case ARROW_UP:
-    if (editor.cursor_y != 0)
-      editor.cursor_y--;
-    break;
-  case ARROW_DOWN:
-    if (editor.cursor_y < editor.num_rows)
-      editor.cursor_y++;
-    break;
+    if (to > from)
+      memset(&attr[MAX(x, from) - from], HL_SPAN_HL(row->hl_spans[i]),
+             MIN(to, from + len) - MAX(x, from));
+    x = to;
   }
+}
 
-  row =
-      editor.cursor_y >= editor.num_rows ? NULL : &editor.rows[editor.cursor_y];
-  row_len = row == NULL ? 0 : row->size;
-  if (editor.cursor_x > row_len)
-    editor.cursor_x = row_len;
+/*
+ * Paint the search matches on `file_row` over the `len` cells of `attr`, which
+ * start at render column `from`.
+ */
+static void editor_draw_matches(struct editor_row *row, int file_row, int from,
+                                unsigned char *attr, int len) {
+  struct editor_search *search = &editor.search;
+
+  for (int i = editor_search_seek(search, file_row, 0);
+       i < search->num_matches && search->matches[i].row == file_row; i++) {
+    int cursor_x = search->matches[i].cursor_x;
+    int start = editor_row_cx_to_rx(row, cursor_x) - from;
+    int end = editor_row_cx_to_rx(row, cursor_x + search->matches[i].len) -
+              from;
+
+    if (start >= len)
+      break;
+
+    start = MAX(start, 0);
+    if (end > start)
+      memset(&attr[start], HL_MATCH, MIN(end, len) - start);
+  }
 }
 
-static void editor_process_keypress(void) {
-  static int quit_times = KILO_QUIT_TIMES;
-  int c = editor_read_key();
+/*
+ * Resize the framebuffer in place.  The cells both sizes share keep what was
+ * last sent to the terminal, which keeps them on a resize, and the exposed
+ * ones are marked unknown so that the next flush draws them.
+ */
+static void screen_resize(int rows, int cols) {
+  struct editor_screen *scr = &editor.screen;
+  size_t cells = (size_t)rows * cols;
+  uint32_t *last_chars = malloc(cells * sizeof(*last_chars));
+  unsigned char *last_attrs = malloc(cells);
+
+  free(scr->chars);
+  free(scr->attrs);
+  scr->chars = malloc(cells * sizeof(*scr->chars));
+  scr->attrs = malloc(cells);
+
+  if (scr->chars == NULL || scr->attrs == NULL || last_chars == NULL ||
+      last_attrs == NULL)
+    die("malloc");
+
+  screen_blank(last_chars, cells);
+  memset(last_attrs, ATTR_UNKNOWN, cells);
+  for (int y = 0; scr->valid && y < MIN(rows, scr->rows); y++) {
+    memcpy(&last_chars[y * cols], &scr->last_chars[y * scr->cols],
+           MIN(cols, scr->cols) * sizeof(*last_chars));
+    memcpy(&last_attrs[y * cols], &scr->last_attrs[y * scr->cols],
+           MIN(cols, scr->cols));
+  }
 
-  switch (c) {
-  case '\r':
-    editor_insert_newline();
-    break;
-  case CTRL('q'):
-    if (editor.dirty != 0 && quit_times > 0) {
-      editor_set_status_message("WARNING!!! File has unsaved changes. "
-                                "Press Ctrl-Q %d more times to quit.",
-                                quit_times--);
-      return;
+  free(scr->last_chars);
+  free(scr->last_attrs);
+  scr->last_chars = last_chars;
+  scr->last_attrs = last_attrs;
+  scr->rows = rows;
+  scr->cols = cols;
+  scr->cursor_y = -1;
+}
+
+static void screen_blank(uint32_t *cells, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    cells[i] = ' ';
+}
+
+/* Put the `len` bytes of UTF-8 text at `s` on row `y` from column `x` on. */
+static void screen_put(int y, int x, const char *s, int len,
+                       unsigned char attr) {
+  struct editor_screen *scr = &editor.screen;
+  uint32_t *cell = &scr->chars[y * scr->cols];
+  unsigned char *cell_attr = &scr->attrs[y * scr->cols];
+  int cp, width;
+
+  for (int i = 0; i < len && x < scr->cols;) {
+    i += utf8_decode(&s[i], len - i, &cp);
+    if ((width = utf8_width(cp)) == 0)
+      continue;
+
+    if (cp == -1 || x + width > scr->cols) {
+      cp = '?';
+      width = 1;
     }
-    leave_alt_buffer();
-    exit(EXIT_SUCCESS);
-    break;
-  case CTRL('s'):
-    editor_save();
-    break;
-  case HOME_KEY:
-    editor.cursor_x = 0;
-    break;
-  case END_KEY:
-    if (editor.cursor_y < editor.num_rows)
-      editor.cursor_x = editor.rows[editor.cursor_y].size;
-    break;
-  case CTRL('f'):
-    editor_find();
-    break;
-  case BACKSPACE:
-  case CTRL('h'):
-  case DEL_KEY:
-    if (c == DEL_KEY)
-      editor_move_cursor(ARROW_RIGHT);
-    editor_del_char();
-    break;
-  case PAGE_UP:
-    editor.cursor_y = editor.row_offset;
-    for (int i = 0; i < editor.screen_rows; i++)
-      editor_move_cursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-    break;
-  case PAGE_DOWN:
-    editor.cursor_y = editor.row_offset + editor.screen_rows - 1;
-    if (editor.cursor_y > editor.num_rows)
-      editor.cursor_y = editor.num_rows;
 
-    for (int i = 0; i < editor.screen_rows; i++)
-      editor_move_cursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-    break;
-  case ARROW_UP:
-  case ARROW_DOWN:
-  case ARROW_LEFT:
-  case ARROW_RIGHT:
-    editor_move_cursor(c);
-    break;
-  case CTRL('l'):
-  case ESC_CHAR:
-    break;
-  default:
-    editor_insert_char(c);
-    break;
+    cell[x] = cp;
+    cell_attr[x++] = attr;
+    if (width == 2) {
+      cell[x] = 0;
+      cell_attr[x++] = attr;
+    }
   }
-
-  quit_times = KILO_QUIT_TIMES;
 }
 
-static void editor_refresh_screen(void) {
-  struct sbuf *sb = sbuf_new_auto();
+static void screen_clear(int y, int x, int len, unsigned char attr) {
+  struct editor_screen *scr = &editor.screen;
+
+  screen_blank(&scr->chars[y * scr->cols + x], len);
+  memset(&scr->attrs[y * scr->cols + x], attr, len);
+}
 
-  editor_scroll();
+static void screen_set_attr(struct sbuf *sb, unsigned char attr) {
+  struct editor_screen *scr = &editor.screen;
 
-  sbuf_cat(sb, CURSOR_HIDE);
-  sbuf_cat(sb, CURSOR_MOVE(0, 0));
+  if (scr->attr == attr)
+    return;
 
-  editor_draw_rows(sb);
-  editor_draw_status_bar(sb);
-  editor_draw_message_bar(sb);
+  if (scr->attr == ATTR_UNKNOWN) {
+    sbuf_cat(sb, RESET_SGR);
+    scr->attr = HL_NORMAL;
+  }
 
-  sbuf_printf(sb, CURSOR_MOVE_FMT, editor.cursor_y - editor.row_offset + 1,
-              editor.render_x - editor.col_offset + 1);
+  if ((scr->attr ^ attr) & ATTR_INVERT)
+    sbuf_cat(sb, (attr & ATTR_INVERT) ? INVERT : NO_INVERT);
+  if ((scr->attr ^ attr) & ~ATTR_INVERT)
+    sbuf_cat(sb, hl_sgr[attr & ~ATTR_INVERT]);
 
-  sbuf_cat(sb, CURSOR_SHOW);
+  scr->attr = attr;
+}
 
-  if (write(editor.tty, sbuf_data(sb), sbuf_len(sb)) != sbuf_len(sb))
-    die("write");
+/*
+ * Scroll the `rows` terminal rows from `top` on by `lines` and shift the
+ * shadow framebuffer to match, so only the rows that scrolled in get redrawn.
+ */
+static void screen_scroll(struct sbuf *sb, int top, int rows, int lines) {
+  struct editor_screen *scr = &editor.screen;
+  int n = abs(lines), keep = rows - n;
+  size_t row = scr->cols;
+  uint32_t *chars = &scr->last_chars[top * row];
+  unsigned char *attrs = &scr->last_attrs[top * row];
+
+  screen_set_attr(sb, HL_NORMAL);
+  sbuf_printf(sb, SET_SCROLL_REGION_FMT, top + 1, top + rows);
+  sbuf_printf(sb, lines > 0 ? SCROLL_UP_FMT : SCROLL_DOWN_FMT, n);
+  sbuf_cat(sb, RESET_SCROLL_REGION);
+
+  if (lines > 0) {
+    memmove(chars, &chars[n * row], keep * row * sizeof(*chars));
+    memmove(attrs, &attrs[n * row], keep * row);
+    screen_blank(&chars[keep * row], n * row);
+    memset(&attrs[keep * row], HL_NORMAL, n * row);
+  } else {
+    memmove(&chars[n * row], chars, keep * row * sizeof(*chars));
+    memmove(&attrs[n * row], attrs, keep * row);
+    screen_blank(chars, n * row);
+    memset(attrs, HL_NORMAL, n * row);
+  }
 
-  sbuf_delete(sb);
+  scr->cursor_y = -1;
 }
 
-static void editor_set_status_message(const char *fmt, ...) {
-  va_list ap;
+static void screen_emit(struct sbuf *sb, int y, int from, int to) {
+  struct editor_screen *scr = &editor.screen;
+  uint32_t *cell = &scr->chars[y * scr->cols];
+  char utf8[4];
+  unsigned char *attr = &scr->attrs[y * scr->cols];
 
-  va_start(ap, fmt);
-  vsnprintf(editor.statusmsg, sizeof(editor.statusmsg), fmt, ap);
-  va_end(ap);
+  sbuf_printf(sb, CURSOR_MOVE_FMT, y + 1, from + 1);
+  for (int x = from, end; x < to; x = end) {
+    for (end = x + 1; end < to && attr[end] == attr[x]; end++)
+      ;
 
-  editor.statusmsg_time = time(NULL);
+    screen_set_attr(sb, attr[x]);
+    for (int i = x; i < end; i++) {
+      if (cell[i] == 0)
+        continue;
+      else if (cell[i] < 0x80)
+        sbuf_putc(sb, cell[i]);
+      else
+        sbuf_bcat(sb, utf8, utf8_encode(cell[i], utf8));
+    }
+  }
 }
 
-static void editor_scroll(void) {
-  editor.render_x = 0;
-  if (editor.cursor_y < editor.num_rows)
-    editor.render_x =
-        editor_row_cx_to_rx(&editor.rows[editor.cursor_y], editor.cursor_x);
+/*
+ * Emit the cells that differ from what was last written to the terminal.
+ * Changed cells closer than a cursor move apart are sent as one run, and a
+ * changed blank tail is cleared with an erase instead of spaces.
+ */
+static void screen_flush(struct sbuf *sb, int cursor_y, int cursor_x) {
+  struct editor_screen *scr = &editor.screen;
+  size_t cells = (size_t)scr->rows * scr->cols;
+  bool drawn = false;
+
+  if (!scr->valid) {
+    scr->attr = ATTR_UNKNOWN;
+    screen_set_attr(sb, HL_NORMAL);
+    sbuf_cat(sb, CURSOR_HIDE ERASE_IN_DISPLAY(ERASE_ENTIRE));
+    screen_blank(scr->last_chars, cells);
+    memset(scr->last_attrs, HL_NORMAL, cells);
+    scr->valid = drawn = true;
+  }
 
-  if (editor.cursor_y < editor.row_offset)
-    editor.row_offset = editor.cursor_y;
+  for (int y = 0; y < scr->rows; y++) {
+    size_t off = (size_t)y * scr->cols;
+    uint32_t *cell = &scr->chars[off], *last_cell = &scr->last_chars[off];
+    unsigned char *attr = &scr->attrs[off], *last_attr = &scr->last_attrs[off];
+    int blank = scr->cols;
 
-  if (editor.cursor_y >= editor.row_offset + editor.screen_rows)
-    editor.row_offset = editor.cursor_y - editor.screen_rows + 1;
+    if (memcmp(cell, last_cell, scr->cols * sizeof(*cell)) == 0 &&
+        memcmp(attr, last_attr, scr->cols) == 0)
+      continue;
 
-  if (editor.render_x < editor.col_offset)
-    editor.col_offset = editor.render_x;
+    while (blank > 0 && cell[blank - 1] == ' ' && attr[blank - 1] == HL_NORMAL)
+      blank--;
 
-  if (editor.render_x >= editor.col_offset + editor.screen_cols)
-    editor.col_offset = editor.render_x - editor.screen_cols + 1;
-}
+    for (int x = 0; x < scr->cols;) {
+      int from, to, same = 0;
 
-static void editor_draw_status_bar(struct sbuf *sb) {
-  char status[80], status_right[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-                     editor.file == NULL ? "[No Name]" : editor.file,
-                     editor.num_rows, editor.dirty != 0 ? "(modified)" : "");
-  int rlen =
-      snprintf(status_right, sizeof(status_right), "%s | %d/%d",
-               editor.syntax == NULL ? "no ft" : editor.syntax->file_type,
-               editor.cursor_y + 1, editor.num_rows);
-
-  if (len > editor.screen_cols)
-    len = editor.screen_cols;
-
-  sbuf_cat(sb, INVERT);
-  sbuf_bcat(sb, status, len);
-
-  while (len < editor.screen_cols) {
-    if (editor.screen_cols - len == rlen) {
-      sbuf_bcat(sb, status_right, rlen);
-      break;
+      if (cell[x] == last_cell[x] && attr[x] == last_attr[x]) {
+        x++;
+        continue;
+      }
+
+      if (!drawn) {
+        sbuf_cat(sb, CURSOR_HIDE);
+        drawn = true;
+      }
+
+      from = x;
+      to = ++x;
+      for (; x < scr->cols && same < SCREEN_MOVE_COST; x++) {
+        if (cell[x] == last_cell[x] && attr[x] == last_attr[x])
+          same++;
+        else {
+          same = 0;
+          to = x + 1;
+        }
+      }
+
+      if (to > blank) {
+        screen_emit(sb, y, from, MAX(from, blank));
+        screen_set_attr(sb, HL_NORMAL);
+        sbuf_cat(sb, ERASE_IN_LINE(ERASE_TO_END));
+        break;
+      }
+
+      screen_emit(sb, y, from, to);
     }
 
-    sbuf_cat(sb, " ");
-    len++;
+    memcpy(last_cell, cell, scr->cols * sizeof(*cell));
+    memcpy(last_attr, attr, scr->cols);
   }
 
-  sbuf_cat(sb, RESET_SGR "\r\n");
+  if (drawn || cursor_y != scr->cursor_y || cursor_x != scr->cursor_x)
+    sbuf_printf(sb, CURSOR_MOVE_FMT, cursor_y + 1, cursor_x + 1);
+
+  if (drawn)
+    sbuf_cat(sb, CURSOR_SHOW);
+
+  scr->cursor_y = cursor_y;
+  scr->cursor_x = cursor_x;
 }
 
-static void editor_draw_message_bar(struct sbuf *sb) {
-  int msg_len = strlen(editor.statusmsg);
+/* The monotonic clock in nanoseconds, or 0 when nothing is measured. */
+static int64_t stats_now(void) {
+  struct timespec now;
 
-  sbuf_cat(sb, ERASE_IN_LINE(ERASE_TO_END));
+  if (!editor.stats.enabled)
+    return (0);
 
-  if (msg_len > editor.screen_cols)
-    msg_len = editor.screen_cols;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((int64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+}
 
-  if (msg_len != 0 && time(NULL) - editor.statusmsg_time < 5)
-    sbuf_bcat(sb, editor.statusmsg, msg_len);
+/* Add the time since `start` to `counter` of the current frame. */
+static void stats_add(enum stats_counter counter, int64_t start) {
+  if (editor.stats.enabled)
+    editor.stats.frame[counter] += stats_now() - start;
 }
 
-static void editor_draw_rows(struct sbuf *sb) {
-  for (int y = 0; y < editor.screen_rows; y++) {
-    int file_row = y + editor.row_offset;
-    if (file_row >= editor.num_rows) {
-      if (editor.num_rows == 0 && y == editor.screen_rows / 3) {
-        char welcome[80];
-        int padding;
-        int welcome_len = snprintf(welcome, sizeof(welcome),
-                                   "Kilo editor -- version %s", KILO_VERSION);
+/* Close the current frame, which wrote `bytes` to the terminal. */
+static void stats_frame(size_t bytes) {
+  struct editor_stats *stats = &editor.stats;
 
-        if (welcome_len > editor.screen_cols)
-          welcome_len = editor.screen_cols;
+  if (!stats->enabled)
+    return;
 
-        padding = (editor.screen_cols - welcome_len) / 2;
-        if (padding != 0) {
-          sbuf_cat(sb, "~");
-          padding--;
-        }
+  stats->frame[STATS_BYTES] = bytes;
+  memcpy(stats->history[stats->frames++ % KILO_STATS_FRAMES], stats->frame,
+         sizeof(stats->frame));
+  memset(stats->frame, 0, sizeof(stats->frame));
+}
 
-        while ((padding--) != 0)
-          sbuf_cat(sb, " ");
+#ifdef KILO_AUDIT
+static void stats_malloc(void) {
+  if (pthread_equal(pthread_self(), editor.stats.thread))
+    editor.stats.frame[STATS_MALLOCS]++;
+}
+#endif
 
-        sbuf_bcat(sb, welcome, welcome_len);
-      } else
-        sbuf_cat(sb, "~");
-    } else {
-      int len = editor.rows[file_row].render_size - editor.col_offset;
-      char *c;
-      enum editor_highlight *hl;
+static int compare_int64(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
 
-      if (len < 0)
-        len = 0;
+  return ((x > y) - (x < y));
+}
 
-      if (len > editor.screen_cols)
-        len = editor.screen_cols;
+/* Nearest-rank percentiles of `counter` over the frames in the history. */
+static void stats_percentiles(enum stats_counter counter, int64_t *p50,
+                              int64_t *p99, int64_t *max) {
+  struct editor_stats *stats = &editor.stats;
+  int64_t values[KILO_STATS_FRAMES];
+  int n = MIN(stats->frames, KILO_STATS_FRAMES);
 
-      c = &editor.rows[file_row].render[editor.col_offset];
-      hl = &editor.rows[file_row].highlight[editor.col_offset];
+  *p50 = *p99 = *max = 0;
+  if (n == 0)
+    return;
 
-      for (int i = 0, current_color = -1; i < len; i++) {
-        if (iscntrl(c[i])) {
-          char symbol = (c[i] <= 26) ? '@' + c[i] : '?';
+  for (int i = 0; i < n; i++)
+    values[i] = stats->history[i][counter];
+  qsort(values, n, sizeof(*values), compare_int64);
 
-          sbuf_cat(sb, INVERT);
-          sbuf_bcat(sb, &symbol, 1);
-          sbuf_cat(sb, RESET_SGR);
+  *p50 = values[(n * 50 + 99) / 100 - 1];
+  *p99 = values[(n * 99 + 99) / 100 - 1];
+  *max = values[n - 1];
+}
 
-          if (current_color != -1)
-            sbuf_printf(sb, SGR_FMT, current_color);
-        } else if (hl[i] == HL_NORMAL) {
-          if (current_color != -1) {
-            sbuf_cat(sb, DEFAULT_FG);
-            current_color = -1;
-          }
-          sbuf_bcat(sb, &c[i], 1);
-        } else {
-          int color = editor_syntax_to_color(hl[i]);
-          if (current_color != color) {
-            current_color = color;
-            char color_buf[16];
-            int color_len =
-                snprintf(color_buf, sizeof(color_buf), SGR_FMT, color);
-            sbuf_bcat(sb, color_buf, color_len);
-          }
-          sbuf_bcat(sb, &c[i], 1);
-        }
-      }
-      sbuf_cat(sb, DEFAULT_FG);
+/* The line shown in the message bar: median/99th percentile of each counter. */
+static int stats_format(char *buf, size_t size) {
+  int64_t p50[STATS_COUNTERS], p99[STATS_COUNTERS], max;
+  int len;
+
+  for (int i = 0; i < STATS_COUNTERS; i++) {
+    stats_percentiles(i, &p50[i], &p99[i], &max);
+    if (i < STATS_BYTES) {
+      p50[i] /= 1000;
+      p99[i] /= 1000;
     }
+  }
+
+  len = snprintf(buf, size,
+                 "frame %" PRId64 "/%" PRId64 " key %" PRId64 "/%" PRId64
+                 " edit %" PRId64 "/%" PRId64 " hl %" PRId64 "/%" PRId64
+                 " draw %" PRId64 "/%" PRId64 " write %" PRId64 "/%" PRId64
+                 " us | %" PRId64 "/%" PRId64 " B | %" PRId64 "/%" PRId64
+                 " allocs",
+                 p50[STATS_FRAME], p99[STATS_FRAME], p50[STATS_DECODE],
+                 p99[STATS_DECODE], p50[STATS_EDIT],
+                 p99[STATS_EDIT], p50[STATS_SYNTAX], p99[STATS_SYNTAX],
+                 p50[STATS_DRAW], p99[STATS_DRAW], p50[STATS_WRITE],
+                 p99[STATS_WRITE], p50[STATS_BYTES], p99[STATS_BYTES],
+                 p50[STATS_ALLOCS], p99[STATS_ALLOCS]);
+
+  return (MIN(len, (int)size - 1));
+}
 
-    sbuf_cat(sb, ERASE_IN_LINE(ERASE_TO_END) "\r\n");
+/* Write the percentiles to the KILO_STATS file, if there is one. */
+static bool stats_dump(void) {
+  static const char *names[] = {
+      [STATS_DECODE] = "decode ns", [STATS_EDIT] = "edit ns",
+      [STATS_SYNTAX] = "syntax ns", [STATS_DRAW] = "draw ns",
+      [STATS_WRITE] = "write ns",   [STATS_FRAME] = "frame ns",
+      [STATS_BYTES] = "bytes",      [STATS_ALLOCS] = "allocs",
+#ifdef KILO_AUDIT
+      [STATS_MALLOCS] = "mallocs",
+#endif
+  };
+  struct editor_stats *stats = &editor.stats;
+  int64_t p50, p99, max;
+  FILE *fp;
+
+  if (stats->file == NULL)
+    return (true);
+
+  if ((fp = fopen(stats->file, "w")) == NULL)
+    return (false);
+
+  fprintf(fp, "%ld frames, percentiles of the last %d\n", stats->frames,
+          (int)MIN(stats->frames, KILO_STATS_FRAMES));
+  fprintf(fp, "%-10s %12s %12s %12s\n", "", "p50", "p99", "max");
+  for (int i = 0; i < STATS_COUNTERS; i++) {
+    stats_percentiles(i, &p50, &p99, &max);
+    fprintf(fp, "%-10s %12" PRId64 " %12" PRId64 " %12" PRId64 "\n", names[i],
+            p50, p99, max);
   }
+
+  return (fclose(fp) == 0);
 }
 
 static void enter_alt_buffer(void) {
-  if (dprintf(editor.tty, ALT_BUF_ON CURSOR_HIDE ERASE_IN_DISPLAY(ERASE_ENTIRE)
-                              CURSOR_MOVE(1, 1)) < 0)
+  if (dprintf(editor.tty, ALT_BUF_ON BRACKETED_PASTE_ON CURSOR_HIDE
+                              ERASE_IN_DISPLAY(ERASE_ENTIRE)
+                                  CURSOR_MOVE(1, 1)) < 0)
     err(EXIT_FAILURE, "dprintf");
 }
 
 static void leave_alt_buffer(void) {
-  dprintf(editor.tty, ALT_BUF_OFF CURSOR_SHOW);
+  dprintf(editor.tty, BRACKETED_PASTE_OFF ALT_BUF_OFF CURSOR_SHOW);
 }
 
 static void init_editor(void) {
-  editor.tty = editor.kq = -1;
-  editor.cursor_x = editor.cursor_y = 0;
-  editor.render_x = 0;
-  editor.row_offset = editor.col_offset = 0;
-  editor.num_rows = 0;
-  editor.dirty = 0;
-  editor.rows = NULL;
-  editor.file = NULL;
+  const char *trace = getenv("KILO_TRACE");
+
+  editor.tty = editor.kq = editor.trace = -1;
+  TAILQ_INIT(&editor.buffers);
+  editor.buf = editor_buffer_new();
+  editor.root = editor.win = editor_window_new(editor.buf);
+  editor.follow_updated = editor.pager_updated = editor.resized = false;
+  editor.swap_timer = false;
+  editor.stats.file = getenv("KILO_STATS");
+  editor.stats.enabled = editor.stats.file != NULL;
+  memset(editor.stats.frame, 0, sizeof(editor.stats.frame));
+  editor.stats.frames = editor.stats.edit_start = 0;
+#ifdef KILO_AUDIT
+  editor.stats.thread = pthread_self();
+#endif
   editor.statusmsg[0] = '\0';
   editor.statusmsg_time = 0;
-  editor.syntax = NULL;
+  editor.hl_buf = NULL;
+  editor.hl_buf_capacity = 0;
+  editor.syntax.image = NULL;
+  editor.syntax.syntaxes = NULL;
+  editor_syntax_load();
+  editor.screen.chars = editor.screen.last_chars = NULL;
+  editor.screen.attrs = editor.screen.last_attrs = NULL;
+  editor.screen.cursor_y = editor.screen.cursor_x = -1;
+  editor.screen.attr = ATTR_UNKNOWN;
+  editor.input.buf = NULL;
+  editor.input.pos = editor.input.len = editor.input.cap = 0;
+  editor.input.flush = false;
+  editor.search.query = NULL;
+  editor.search.matches = NULL;
+  editor.search.query_len = 0;
+  editor.search.num_matches = editor.search.capacity = 0;
+  editor.search.current = -1;
+  editor.search.seek_row = editor.search.seek_x = 0;
+  editor.search.active = editor.search.running = false;
+  editor.search.updated = editor.search.done = false;
+  editor.search.error = 0;
+  editor.search.use_regex = editor.search.bad_regex = false;
+  editor.search.regex = NULL;
+  for (size_t i = 0; i < nitems(editor.search.cache); i++)
+    editor.search.cache[i] = NULL;
+  editor.search.pending = NULL;
+  editor.search.num_pending = editor.search.pending_capacity = 0;
+  pthread_mutex_init(&editor.search.lock, NULL);
+  atomic_init(&editor.search.cancel, false);
+  editor.save.buf = NULL;
+  editor.save.tmp = editor.save.copy = NULL;
+  editor.save.iov = NULL;
+  editor.save.num_iov = editor.save.iov_capacity = 0;
+  editor.save.total = 0;
+  editor.save.dirty = editor.save.error = 0;
+  editor.save.running = editor.save.updated = false;
+  atomic_init(&editor.save.written, 0);
+  atomic_init(&editor.save.done, false);
+  if ((editor.screen.out = sbuf_new_auto()) == NULL)
+    err(EXIT_FAILURE, "sbuf_new_auto");
+
+  if (trace != NULL &&
+      (editor.trace = open(trace, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+    err(EXIT_FAILURE, "%s", trace);
+}
+
+/* Open the terminal and the kqueue, and size the screen to the terminal. */
+static void init_terminal(void) {
+  int rows, cols;
 
   if ((editor.tty = open("/dev/tty", O_RDWR)) == -1)
     err(EXIT_FAILURE, "open(/dev/tty)");
@@ -1193,8 +8426,9 @@ static void init_editor(void) {
   if ((editor.kq = kqueue()) == -1)
     err(EXIT_FAILURE, "kqueue() failed");
 
-  if (get_window_size(&editor.screen_rows, &editor.screen_cols) == -1)
+  if (get_window_size(&rows, &cols) == -1)
     die("get_window_size");
 
-  editor.screen_rows -= 2;
+  screen_resize(rows, cols);
+  editor_layout(editor.root, 0, 0, rows - 1, cols);
 }